@@ -0,0 +1,214 @@
+#define _POSIX_C_SOURCE 200809L
+#include "alert.h"
+#include "connmgr.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// One line of the alert config: "<default|room|sensor> [id] min max [hysteresis [min_duration [suppress]]]"
+// or "anomaly <zscore> <max_rate> <stuck_count>"
+typedef struct alert_entry {
+    unsigned int id;
+    alert_rule_t rule;
+} alert_entry_t;
+
+typedef struct alert_list {
+    size_t count;
+    size_t capacity;
+    alert_entry_t *entries;
+} alert_list_t;
+
+struct alert_config {
+    alert_rule_t fallback;
+    anomaly_rule_t anomaly;
+    alert_list_t rooms;
+    alert_list_t sensors;
+};
+
+static int entry_compare(const void *x, const void *y) {
+    const alert_entry_t *entry_x = x;
+    const alert_entry_t *entry_y = y;
+    if (entry_x->id < entry_y->id) return -1;
+    if (entry_x->id > entry_y->id) return 1;
+    return 0;
+}
+
+static int list_append(alert_list_t *list, unsigned int id, alert_rule_t rule) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 16;
+        alert_entry_t *entries = realloc(list->entries, capacity * sizeof(alert_entry_t));
+        if (entries == NULL) return ALERT_FAILURE;
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+    list->entries[list->count++] = (alert_entry_t){.id = id, .rule = rule};
+    return ALERT_SUCCESS;
+}
+
+static const alert_rule_t *list_find(const alert_list_t *list, unsigned int id) {
+    if (list->count == 0) return NULL;
+    alert_entry_t key = {.id = id};
+    alert_entry_t *entry = bsearch(&key, list->entries, list->count, sizeof(alert_entry_t), entry_compare);
+    return entry ? &entry->rule : NULL;
+}
+
+// Parse the thresholds of a line, fields that are left out keep the value of 'rule'
+static int parse_rule(char *fields, alert_rule_t *rule) {
+    double values[5];
+    int n = 0;
+    char *save = NULL;
+    for (char *token = strtok_r(fields, " \t\r\n", &save); token != NULL; token = strtok_r(NULL, " \t\r\n", &save)) {
+        if (token[0] == '#') break;
+        if (n == 5) return ALERT_FAILURE;
+        char *end;
+        errno = 0;
+        values[n] = strtod(token, &end);
+        if (errno != 0 || *end != '\0') return ALERT_FAILURE;
+        n++;
+    }
+    if (n < 2) return ALERT_FAILURE;
+
+    rule->min_temp = values[0];
+    rule->max_temp = values[1];
+    if (n > 2) rule->hysteresis = values[2];
+    if (n > 3) rule->min_duration = (sensor_ts_t)values[3];
+    if (n > 4) rule->suppress = (sensor_ts_t)values[4];
+    if (rule->min_temp > rule->max_temp || (n > 2 && values[2] < 0)) return ALERT_FAILURE;
+    return ALERT_SUCCESS;
+}
+
+alert_config_t *alert_config_load(const char *path) {
+    alert_config_t *config = calloc(1, sizeof(alert_config_t));
+    if (config == NULL) return NULL;
+    config->fallback = (alert_rule_t){.min_temp = SET_MIN_TEMP, .max_temp = SET_MAX_TEMP};
+    config->anomaly = (anomaly_rule_t){.zscore = ANOMALY_ZSCORE, .max_rate = ANOMALY_MAX_RATE,
+                                       .stuck_count = ANOMALY_STUCK_COUNT};
+
+    FILE *fp = (path != NULL) ? fopen(path, "r") : NULL;
+    if (fp == NULL) return config;
+
+    char line[256];
+    char log_msg[128];
+    int line_nr = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_nr++;
+        char *save = NULL;
+        char *scope = strtok_r(line, " \t\r\n", &save);
+        if (scope == NULL || scope[0] == '#') continue;
+
+        char *rest = strtok_r(NULL, "", &save);
+        int result = ALERT_FAILURE;
+        if (strcmp(scope, "default") == 0 && rest != NULL) {
+            result = parse_rule(rest, &config->fallback);
+        } else if (strcmp(scope, "anomaly") == 0 && rest != NULL) {
+            double zscore, max_rate;
+            unsigned int stuck_count;
+            char extra;
+            if (sscanf(rest, "%lf %lf %u %c", &zscore, &max_rate, &stuck_count, &extra) == 3 &&
+                zscore >= 0 && max_rate >= 0) {
+                config->anomaly = (anomaly_rule_t){.zscore = zscore, .max_rate = max_rate, .stuck_count = stuck_count};
+                result = ALERT_SUCCESS;
+            }
+        } else if ((strcmp(scope, "room") == 0 || strcmp(scope, "sensor") == 0) && rest != NULL) {
+            char *end;
+            unsigned long id = strtoul(rest, &end, 10);
+            alert_rule_t rule = {.hysteresis = -1, .min_duration = -1, .suppress = -1};
+            if (end != rest && parse_rule(end, &rule) == ALERT_SUCCESS) {
+                result = list_append(scope[0] == 'r' ? &config->rooms : &config->sensors, (unsigned int)id, rule);
+            }
+        }
+        if (result != ALERT_SUCCESS) {
+            snprintf(log_msg, sizeof(log_msg), "Alert config: invalid line %d in %s", line_nr, path);
+            write_log(log_msg);
+            fclose(fp);
+            alert_config_free(&config);
+            return NULL;
+        }
+    }
+    fclose(fp);
+
+    // Room and sensor lines inherit the optional fields from the default line, which may come later
+    alert_list_t *lists[2] = {&config->rooms, &config->sensors};
+    for (int i = 0; i < 2; i++) {
+        alert_list_t *list = lists[i];
+        for (size_t j = 0; j < list->count; j++) {
+            alert_rule_t *rule = &list->entries[j].rule;
+            if (rule->hysteresis < 0) rule->hysteresis = config->fallback.hysteresis;
+            if (rule->min_duration < 0) rule->min_duration = config->fallback.min_duration;
+            if (rule->suppress < 0) rule->suppress = config->fallback.suppress;
+        }
+        qsort(list->entries, list->count, sizeof(alert_entry_t), entry_compare);
+    }
+
+    snprintf(log_msg, sizeof(log_msg), "Alert config loaded: %zu room rules, %zu sensor rules",
+             config->rooms.count, config->sensors.count);
+    write_log(log_msg);
+    return config;
+}
+
+void alert_config_free(alert_config_t **config) {
+    if (config == NULL || *config == NULL) return;
+    free((*config)->rooms.entries);
+    free((*config)->sensors.entries);
+    free(*config);
+    *config = NULL;
+}
+
+alert_rule_t alert_config_lookup(const alert_config_t *config, sensor_id_t sensor_id, uint16_t room_id) {
+    if (config == NULL) return (alert_rule_t){.min_temp = SET_MIN_TEMP, .max_temp = SET_MAX_TEMP};
+
+    const alert_rule_t *rule = list_find(&config->sensors, sensor_id);
+    if (rule == NULL) rule = list_find(&config->rooms, room_id);
+    return rule ? *rule : config->fallback;
+}
+
+anomaly_rule_t alert_config_anomaly(const alert_config_t *config) {
+    if (config == NULL) {
+        return (anomaly_rule_t){.zscore = ANOMALY_ZSCORE, .max_rate = ANOMALY_MAX_RATE, .stuck_count = ANOMALY_STUCK_COUNT};
+    }
+    return config->anomaly;
+}
+
+void alert_evaluate(const alert_rule_t *rule, alert_state_t *state, sensor_id_t sensor_id,
+                    double avg, sensor_ts_t ts) {
+    alert_level_t level = ALERT_NORMAL;
+    if (avg < rule->min_temp) {
+        level = ALERT_TOO_COLD;
+    } else if (avg > rule->max_temp) {
+        level = ALERT_TOO_HOT;
+    } else if ((state->level == ALERT_TOO_COLD && avg < rule->min_temp + rule->hysteresis) ||
+               (state->level == ALERT_TOO_HOT && avg > rule->max_temp - rule->hysteresis)) {
+        // Inside the hysteresis band the excursion goes on
+        level = state->level;
+    }
+
+    char log_msg[128];
+    if (level != state->level) {
+        if (state->level != ALERT_NORMAL && state->fired && state->last_fired >= state->since) {
+            snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIsensor " is back in range (avg temp = %.2f)",
+                     sensor_id, avg);
+            write_log(log_msg);
+        }
+        state->level = level;
+        state->since = ts;
+        state->fired = false;
+    }
+
+    if (state->level == ALERT_NORMAL || state->fired || ts - state->since < rule->min_duration) return;
+
+    state->fired = true;
+    if (state->last_fired != 0 && ts - state->last_fired < rule->suppress) {
+        state->suppressed++;
+        return;
+    }
+    state->last_fired = ts;
+
+    if (state->level == ALERT_TOO_COLD) {
+        snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIsensor " reports it’s too cold (avg temp = %.2f)", sensor_id, avg);
+    } else {
+        snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIsensor " reports it’s too hot (avg temp = %.2f)", sensor_id, avg);
+    }
+    write_log(log_msg);
+}
@@ -0,0 +1,55 @@
+#ifndef _ALERT_H_
+#define _ALERT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "config.h"
+#include "anomaly.h"
+
+#define ALERT_FAILURE -1
+#define ALERT_SUCCESS 0
+
+// Thresholds of one sensor, resolved from the alert config
+typedef struct alert_rule {
+    double min_temp;
+    double max_temp;
+    double hysteresis;       // the average has to come back this far inside the range to end an excursion
+    sensor_ts_t min_duration; // seconds the average has to stay out of range before an alert fires
+    sensor_ts_t suppress;     // seconds after an alert during which new excursions are not reported
+} alert_rule_t;
+
+typedef enum {
+    ALERT_NORMAL, ALERT_TOO_COLD, ALERT_TOO_HOT
+} alert_level_t;
+
+// Per-sensor excursion tracking, lives in the data manager's sensor state
+typedef struct alert_state {
+    alert_level_t level;
+    sensor_ts_t since;        // timestamp of the first reading of the excursion
+    bool fired;               // the excursion has been reported (or suppressed)
+    sensor_ts_t last_fired;   // timestamp of the last reported alert, 0 if none
+    uint32_t suppressed;      // number of excursions that were not reported
+} alert_state_t;
+
+typedef struct alert_config alert_config_t;
+
+// Load per-sensor and per-room thresholds from 'path'
+// A missing file gives a config that only holds the compile-time SET_MIN_TEMP/SET_MAX_TEMP defaults.
+// Returns NULL if the file is malformed or memory allocation fails.
+alert_config_t *alert_config_load(const char *path);
+
+// Free the config and set '*config' to NULL
+void alert_config_free(alert_config_t **config);
+
+// Resolve the rule of a sensor: a sensor rule wins over a room rule, which wins over the default
+alert_rule_t alert_config_lookup(const alert_config_t *config, sensor_id_t sensor_id, uint16_t room_id);
+
+// Thresholds of the anomaly detection, set with an "anomaly <zscore> <max_rate> <stuck_count>" line
+anomaly_rule_t alert_config_anomaly(const alert_config_t *config);
+
+// Feed a new running average into the excursion state machine of a sensor
+// Logs at most one alert per excursion and one message when the sensor is back in range.
+void alert_evaluate(const alert_rule_t *rule, alert_state_t *state, sensor_id_t sensor_id,
+                    double avg, sensor_ts_t ts);
+
+#endif /* _ALERT_H_ */
@@ -0,0 +1,61 @@
+#include "anomaly.h"
+#include "connmgr.h"
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+
+unsigned int anomaly_check(const anomaly_rule_t *rule, anomaly_state_t *state, sensor_id_t sensor_id,
+                           sensor_value_t value, sensor_ts_t ts) {
+    unsigned int flags = 0;
+    double zscore = 0.0, rate = 0.0;
+
+    if (state->n >= ANOMALY_WARMUP && state->var > 0.0) {
+        zscore = fabs(value - state->mean) / sqrt(state->var);
+        if (rule->zscore > 0 && zscore > rule->zscore) flags |= ANOMALY_OUTLIER;
+    }
+    if (state->n > 0) {
+        // Readings within the same second say nothing about the rate
+        if (ts > state->last_ts) {
+            rate = fabs(value - state->last_value) / (double)(ts - state->last_ts);
+            if (rule->max_rate > 0 && rate > rule->max_rate) flags |= ANOMALY_SPIKE;
+        }
+        state->same_count = (value == state->last_value) ? state->same_count + 1 : 1;
+        if (rule->stuck_count > 0 && state->same_count >= rule->stuck_count) flags |= ANOMALY_STUCK;
+    } else {
+        state->same_count = 1;
+    }
+
+    // Exponentially weighted moments, a plain running mean while warming up
+    double alpha = (state->n < ANOMALY_WINDOW) ? 1.0 / (state->n + 1) : 1.0 / ANOMALY_WINDOW;
+    double diff = value - state->mean;
+    double increment = alpha * diff;
+    state->mean += increment;
+    state->var = (1.0 - alpha) * (state->var + diff * increment);
+    if (state->n < UINT32_MAX) state->n++;
+    state->last_value = value;
+    state->last_ts = ts;
+
+    unsigned int started = flags & ~state->active;
+    state->active = flags;
+    if (flags & ANOMALY_OUTLIER) state->outliers++;
+    if (flags & ANOMALY_SPIKE) state->spikes++;
+    if (started & ANOMALY_STUCK) state->stuck++;
+
+    char log_msg[160];
+    if (started & ANOMALY_OUTLIER) {
+        snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIsensor " reports an outlier (value = %.2f, z-score = %.1f)",
+                 sensor_id, value, zscore);
+        write_log(log_msg);
+    }
+    if (started & ANOMALY_SPIKE) {
+        snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIsensor " reports a sudden change (value = %.2f, %.2f degrees/s)",
+                 sensor_id, value, rate);
+        write_log(log_msg);
+    }
+    if (started & ANOMALY_STUCK) {
+        snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIsensor " seems stuck (value = %.2f for %" PRIu32 " readings)",
+                 sensor_id, value, state->same_count);
+        write_log(log_msg);
+    }
+    return flags;
+}
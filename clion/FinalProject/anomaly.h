@@ -0,0 +1,44 @@
+#ifndef _ANOMALY_H_
+#define _ANOMALY_H_
+
+#include <stdint.h>
+#include "config.h"
+
+#define ANOMALY_OUTLIER 0x1   // z-score against the rolling statistics above the threshold
+#define ANOMALY_SPIKE   0x2   // rate of change above the threshold
+#define ANOMALY_STUCK   0x4   // sensor keeps reporting the exact same value
+
+#define ANOMALY_WINDOW 64     // readings that dominate the exponentially weighted statistics
+#define ANOMALY_WARMUP 10     // readings needed before the z-score test is applied
+
+#define ANOMALY_ZSCORE 4.0
+#define ANOMALY_MAX_RATE 2.0
+#define ANOMALY_STUCK_COUNT 30
+
+// Thresholds, a value of 0 disables the test
+typedef struct anomaly_rule {
+    double zscore;
+    double max_rate;          // degrees per second
+    uint32_t stuck_count;     // identical readings in a row
+} anomaly_rule_t;
+
+// Incrementally maintained moments of one sensor
+typedef struct anomaly_state {
+    uint32_t n;
+    double mean;
+    double var;
+    sensor_value_t last_value;
+    sensor_ts_t last_ts;
+    uint32_t same_count;
+    unsigned int active;      // anomalies that are going on, they are logged only when they start
+    uint32_t outliers;
+    uint32_t spikes;
+    uint32_t stuck;
+} anomaly_state_t;
+
+// Check a reading against the statistics of its sensor and fold it in, O(1) per reading
+// Returns the ANOMALY_* flags of the reading and logs the anomalies that start with it.
+unsigned int anomaly_check(const anomaly_rule_t *rule, anomaly_state_t *state, sensor_id_t sensor_id,
+                           sensor_value_t value, sensor_ts_t ts);
+
+#endif /* _ANOMALY_H_ */
@@ -0,0 +1,451 @@
+#define _POSIX_C_SOURCE 200809L
+#include "arrowfile.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// An IPC file is "ARROW1" and padding, a stream of messages, and a footer that repeats the schema and points
+// at the record batches. A message is a continuation marker, the size of its metadata, the metadata as a
+// Message flatbuffer (Message.fbs, Schema.fbs and File.fbs of the Arrow format) and a body with the buffers.
+
+#define ARROW_MAGIC "ARROW1"
+#define ARROW_CONTINUATION 0xFFFFFFFFu
+#define ARROW_ALIGNMENT 8               // of messages and buffers in the file
+#define ARROW_COLUMNS 4
+
+// Values of the Arrow format
+#define METADATA_V5 4
+#define HEADER_SCHEMA 1
+#define HEADER_RECORD_BATCH 3
+#define TYPE_INT 2
+#define TYPE_FLOATING_POINT 3
+#define TYPE_TIMESTAMP 10
+#define PRECISION_DOUBLE 2
+#define TIME_UNIT_SECOND 0
+#define ENDIANNESS_LITTLE 0
+#define ENDIANNESS_BIG 1
+
+// Flatbuffers are built back to front: objects are added below the ones they point to, so every offset
+// points forward. Positions are kept as distances from the end of the buffer, which is padded to 8 bytes.
+#define FB_MAX_FIELDS 8
+
+typedef struct fb {
+    uint8_t *data;              // the buffer ends at data + capacity
+    size_t capacity;
+    size_t used;
+    size_t table_start;         // of the open table
+    size_t fields[FB_MAX_FIELDS];   // where the fields of the open table were written, 0 if not set
+    size_t field_count;
+    bool failed;                // out of memory, the buffer is not usable
+} fb_t;
+
+typedef struct arrow_block {
+    uint64_t offset;            // of the message in the file
+    uint32_t metadata_size;     // marker, size and flatbuffer
+    uint64_t body_size;
+} arrow_block_t;
+
+struct arrowfile {
+    int fd;
+    uint64_t offset;            // bytes written
+    size_t batch_rows;
+    size_t rows;                // in the current batch
+    uint64_t total_rows;
+    sensor_id_t *ids;
+    uint16_t *rooms;
+    double *values;
+    int64_t *timestamps;
+    arrow_block_t *blocks;      // of the record batches, for the footer
+    size_t block_count;
+    size_t block_capacity;
+    bool failed;
+};
+
+static bool host_is_big_endian(void) {
+    const uint16_t probe = 1;
+    return *(const uint8_t *)&probe == 0;
+}
+
+static void fb_reserve(fb_t *fb, size_t size) {
+    if (fb->failed || fb->used + size <= fb->capacity) return;
+    size_t capacity = fb->capacity ? fb->capacity : 1024;
+    while (capacity < fb->used + size) capacity *= 2;
+    uint8_t *data = malloc(capacity);
+    if (data == NULL) {
+        fb->failed = true;
+        return;
+    }
+    if (fb->used > 0) memcpy(data + capacity - fb->used, fb->data + fb->capacity - fb->used, fb->used);
+    free(fb->data);
+    fb->data = data;
+    fb->capacity = capacity;
+}
+
+// Write 'size' bytes of 'value', little endian as flatbuffers are
+static void fb_put(fb_t *fb, uint64_t value, size_t size) {
+    fb_reserve(fb, size);
+    if (fb->failed) return;
+    fb->used += size;
+    uint8_t *p = fb->data + fb->capacity - fb->used;
+    for (size_t i = 0; i < size; i++) p[i] = (uint8_t)(value >> (8 * i));
+}
+
+// Pad so that 'align' divides the position after 'extra' more bytes
+static void fb_prep(fb_t *fb, size_t align, size_t extra) {
+    size_t padding = (align - (fb->used + extra) % align) % align;
+    while (padding-- > 0) fb_put(fb, 0, 1);
+}
+
+static void fb_scalar(fb_t *fb, uint64_t value, size_t size) {
+    fb_prep(fb, size, 0);
+    fb_put(fb, value, size);
+}
+
+// Offsets are relative to where they are stored
+static void fb_offset(fb_t *fb, size_t target) {
+    fb_prep(fb, 4, 0);
+    fb_put(fb, fb->used + 4 - target, 4);
+}
+
+static size_t fb_string(fb_t *fb, const char *text) {
+    size_t length = strlen(text);
+    fb_prep(fb, 4, length + 1);
+    fb_reserve(fb, length + 1);
+    if (!fb->failed) {
+        fb->used += length + 1;
+        memcpy(fb->data + fb->capacity - fb->used, text, length + 1);
+    }
+    fb_put(fb, length, 4);
+    return fb->used;
+}
+
+static size_t fb_offset_vector(fb_t *fb, const size_t *targets, size_t count) {
+    fb_prep(fb, 4, 4 * count);
+    for (size_t i = count; i-- > 0;) fb_offset(fb, targets[i]);
+    fb_put(fb, count, 4);
+    return fb->used;
+}
+
+// Struct elements are written by the caller with fb_put(), last element and last field first
+static void fb_start_struct_vector(fb_t *fb, size_t element_size, size_t count) {
+    fb_prep(fb, 4, element_size * count);
+    fb_prep(fb, 8, element_size * count);
+}
+
+static size_t fb_end_vector(fb_t *fb, size_t count) {
+    fb_put(fb, count, 4);
+    return fb->used;
+}
+
+// Everything a table points to has to be added before the table is started
+static void fb_start_table(fb_t *fb) {
+    memset(fb->fields, 0, sizeof(fb->fields));
+    fb->field_count = 0;
+    fb->table_start = fb->used;
+}
+
+static void fb_mark_field(fb_t *fb, size_t id) {
+    fb->fields[id] = fb->used;
+    if (fb->field_count < id + 1) fb->field_count = id + 1;
+}
+
+static void fb_add_scalar(fb_t *fb, size_t id, uint64_t value, size_t size) {
+    fb_scalar(fb, value, size);
+    fb_mark_field(fb, id);
+}
+
+static void fb_add_offset(fb_t *fb, size_t id, size_t target) {
+    fb_offset(fb, target);
+    fb_mark_field(fb, id);
+}
+
+// The table starts with the offset of its vtable, which is written right below it
+static size_t fb_end_table(fb_t *fb) {
+    fb_prep(fb, 4, 0);
+    fb_put(fb, 0, 4);
+    size_t table = fb->used;
+    for (size_t i = fb->field_count; i-- > 0;) fb_put(fb, fb->fields[i] ? table - fb->fields[i] : 0, 2);
+    fb_put(fb, table - fb->table_start, 2);
+    fb_put(fb, 4 + 2 * fb->field_count, 2);
+    size_t vtable = fb->used;
+    if (!fb->failed) {
+        uint8_t *p = fb->data + fb->capacity - table;
+        uint32_t distance = (uint32_t)(vtable - table);
+        for (size_t i = 0; i < 4; i++) p[i] = (uint8_t)(distance >> (8 * i));
+    }
+    return table;
+}
+
+static void fb_finish(fb_t *fb, size_t root) {
+    fb_prep(fb, ARROW_ALIGNMENT, 4);
+    fb_offset(fb, root);
+}
+
+static const uint8_t *fb_bytes(const fb_t *fb) {
+    return fb->data + fb->capacity - fb->used;
+}
+
+static size_t build_int(fb_t *fb, int bits, bool is_signed) {
+    fb_start_table(fb);
+    fb_add_scalar(fb, 0, (uint32_t)bits, 4);
+    fb_add_scalar(fb, 1, is_signed, 1);
+    return fb_end_table(fb);
+}
+
+static size_t build_field(fb_t *fb, const char *name, uint8_t type_type, size_t type) {
+    size_t name_offset = fb_string(fb, name);
+    size_t children = fb_offset_vector(fb, NULL, 0);
+    fb_start_table(fb);
+    fb_add_offset(fb, 0, name_offset);
+    fb_add_scalar(fb, 1, false, 1);         // nullable
+    fb_add_scalar(fb, 2, type_type, 1);
+    fb_add_offset(fb, 3, type);
+    fb_add_offset(fb, 5, children);
+    return fb_end_table(fb);
+}
+
+static size_t build_schema(fb_t *fb) {
+    size_t fields[ARROW_COLUMNS];
+    fields[0] = build_field(fb, "sensor_id", TYPE_INT, build_int(fb, SENSOR_ID_BITS, false));
+    fields[1] = build_field(fb, "room_id", TYPE_INT, build_int(fb, 16, false));
+
+    fb_start_table(fb);
+    fb_add_scalar(fb, 0, PRECISION_DOUBLE, 2);
+    fields[2] = build_field(fb, "value", TYPE_FLOATING_POINT, fb_end_table(fb));
+
+    size_t timezone = fb_string(fb, "UTC");
+    fb_start_table(fb);
+    fb_add_scalar(fb, 0, TIME_UNIT_SECOND, 2);
+    fb_add_offset(fb, 1, timezone);
+    fields[3] = build_field(fb, "ts", TYPE_TIMESTAMP, fb_end_table(fb));
+
+    size_t field_vector = fb_offset_vector(fb, fields, ARROW_COLUMNS);
+    fb_start_table(fb);
+    fb_add_scalar(fb, 0, host_is_big_endian() ? ENDIANNESS_BIG : ENDIANNESS_LITTLE, 2);
+    fb_add_offset(fb, 1, field_vector);
+    return fb_end_table(fb);
+}
+
+static void build_message(fb_t *fb, uint8_t header_type, size_t header, uint64_t body_size) {
+    fb_start_table(fb);
+    fb_add_scalar(fb, 3, body_size, 8);
+    fb_add_offset(fb, 2, header);
+    fb_add_scalar(fb, 0, METADATA_V5, 2);
+    fb_add_scalar(fb, 1, header_type, 1);
+    fb_finish(fb, fb_end_table(fb));
+}
+
+static int write_all(arrowfile_t *file, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0) {
+        ssize_t n = write(file->fd, p, size);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            file->failed = true;
+            return ARROWFILE_FAILURE;
+        }
+        p += n;
+        size -= n;
+        file->offset += n;
+    }
+    return ARROWFILE_SUCCESS;
+}
+
+static int write_padding(arrowfile_t *file, size_t size) {
+    static const uint8_t zeros[ARROW_ALIGNMENT] = {0};
+    size_t padding = (ARROW_ALIGNMENT - size % ARROW_ALIGNMENT) % ARROW_ALIGNMENT;
+    return padding ? write_all(file, zeros, padding) : ARROWFILE_SUCCESS;
+}
+
+static size_t padded(size_t size) {
+    return (size + ARROW_ALIGNMENT - 1) / ARROW_ALIGNMENT * ARROW_ALIGNMENT;
+}
+
+// Write the metadata of a message, the body follows. The flatbuffer is a multiple of 8 bytes already.
+static int write_metadata(arrowfile_t *file, const fb_t *fb, arrow_block_t *block) {
+    if (fb->failed) return ARROWFILE_FAILURE;
+    uint8_t prefix[8];
+    uint32_t size = (uint32_t)fb->used;
+    for (size_t i = 0; i < 4; i++) {
+        prefix[i] = (uint8_t)(ARROW_CONTINUATION >> (8 * i));
+        prefix[4 + i] = (uint8_t)(size >> (8 * i));
+    }
+    block->offset = file->offset;
+    block->metadata_size = sizeof(prefix) + size;
+    if (write_all(file, prefix, sizeof(prefix)) != ARROWFILE_SUCCESS) return ARROWFILE_FAILURE;
+    return write_all(file, fb_bytes(fb), fb->used);
+}
+
+static int write_batch(arrowfile_t *file) {
+    if (file->block_count == file->block_capacity) {
+        size_t capacity = file->block_capacity ? file->block_capacity * 2 : 64;
+        arrow_block_t *blocks = realloc(file->blocks, capacity * sizeof(arrow_block_t));
+        if (blocks == NULL) {
+            file->failed = true;
+            return ARROWFILE_FAILURE;
+        }
+        file->blocks = blocks;
+        file->block_capacity = capacity;
+    }
+
+    size_t rows = file->rows;
+    const void *columns[ARROW_COLUMNS] = {file->ids, file->rooms, file->values, file->timestamps};
+    size_t sizes[ARROW_COLUMNS] = {rows * sizeof(sensor_id_t), rows * sizeof(uint16_t), rows * sizeof(double),
+                                   rows * sizeof(int64_t)};
+    uint64_t body_size = 0;
+    for (size_t i = 0; i < ARROW_COLUMNS; i++) body_size += padded(sizes[i]);
+
+    fb_t fb = {0};
+    fb_start_struct_vector(&fb, 16, ARROW_COLUMNS);
+    for (size_t i = 0; i < ARROW_COLUMNS; i++) {
+        fb_put(&fb, 0, 8);                  // null count
+        fb_put(&fb, rows, 8);               // length
+    }
+    size_t nodes = fb_end_vector(&fb, ARROW_COLUMNS);
+
+    // Every column has an empty validity buffer and a data buffer, in column order in the body
+    fb_start_struct_vector(&fb, 16, 2 * ARROW_COLUMNS);
+    uint64_t offset = body_size;
+    for (size_t i = ARROW_COLUMNS; i-- > 0;) {
+        offset -= padded(sizes[i]);
+        fb_put(&fb, sizes[i], 8);
+        fb_put(&fb, offset, 8);
+        fb_put(&fb, 0, 8);
+        fb_put(&fb, offset, 8);
+    }
+    size_t buffers = fb_end_vector(&fb, 2 * ARROW_COLUMNS);
+
+    fb_start_table(&fb);
+    fb_add_scalar(&fb, 0, rows, 8);
+    fb_add_offset(&fb, 1, nodes);
+    fb_add_offset(&fb, 2, buffers);
+    build_message(&fb, HEADER_RECORD_BATCH, fb_end_table(&fb), body_size);
+
+    arrow_block_t block = {.body_size = body_size};
+    int result = write_metadata(file, &fb, &block);
+    free(fb.data);
+    for (size_t i = 0; i < ARROW_COLUMNS && result == ARROWFILE_SUCCESS; i++) {
+        result = write_all(file, columns[i], sizes[i]);
+        if (result == ARROWFILE_SUCCESS) result = write_padding(file, sizes[i]);
+    }
+    if (result != ARROWFILE_SUCCESS) {
+        file->failed = true;
+        return ARROWFILE_FAILURE;
+    }
+    file->blocks[file->block_count++] = block;
+    file->rows = 0;
+    return ARROWFILE_SUCCESS;
+}
+
+static int write_schema(arrowfile_t *file) {
+    fb_t fb = {0};
+    build_message(&fb, HEADER_SCHEMA, build_schema(&fb), 0);
+    arrow_block_t block;
+    int result = write_metadata(file, &fb, &block);
+    free(fb.data);
+    return result;
+}
+
+static int write_footer(arrowfile_t *file) {
+    fb_t fb = {0};
+    size_t schema = build_schema(&fb);
+    size_t dictionaries = fb_offset_vector(&fb, NULL, 0);
+    fb_start_struct_vector(&fb, 24, file->block_count);
+    for (size_t i = file->block_count; i-- > 0;) {
+        fb_put(&fb, file->blocks[i].body_size, 8);
+        fb_put(&fb, 0, 4);                  // padding of the Block struct
+        fb_put(&fb, file->blocks[i].metadata_size, 4);
+        fb_put(&fb, file->blocks[i].offset, 8);
+    }
+    size_t record_batches = fb_end_vector(&fb, file->block_count);
+
+    fb_start_table(&fb);
+    fb_add_offset(&fb, 1, schema);
+    fb_add_offset(&fb, 2, dictionaries);
+    fb_add_offset(&fb, 3, record_batches);
+    fb_add_scalar(&fb, 0, METADATA_V5, 2);
+    fb_finish(&fb, fb_end_table(&fb));
+
+    int result = ARROWFILE_FAILURE;
+    if (!fb.failed) {
+        // End of stream marker, the footer, its size and the magic again
+        uint8_t end[8] = {0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0};
+        uint8_t trailer[4 + sizeof(ARROW_MAGIC) - 1];
+        for (size_t i = 0; i < 4; i++) trailer[i] = (uint8_t)(fb.used >> (8 * i));
+        memcpy(trailer + 4, ARROW_MAGIC, sizeof(ARROW_MAGIC) - 1);
+        if (write_all(file, end, sizeof(end)) == ARROWFILE_SUCCESS &&
+            write_all(file, fb_bytes(&fb), fb.used) == ARROWFILE_SUCCESS &&
+            write_all(file, trailer, sizeof(trailer)) == ARROWFILE_SUCCESS) {
+            result = ARROWFILE_SUCCESS;
+        }
+    }
+    free(fb.data);
+    return result;
+}
+
+static void arrowfile_free(arrowfile_t *file) {
+    free(file->ids);
+    free(file->rooms);
+    free(file->values);
+    free(file->timestamps);
+    free(file->blocks);
+    free(file);
+}
+
+arrowfile_t *arrowfile_create(const char *path, size_t batch_rows) {
+    arrowfile_t *file = calloc(1, sizeof(arrowfile_t));
+    if (file == NULL) return NULL;
+    file->batch_rows = batch_rows ? batch_rows : ARROWFILE_BATCH_ROWS;
+    file->ids = malloc(file->batch_rows * sizeof(sensor_id_t));
+    file->rooms = malloc(file->batch_rows * sizeof(uint16_t));
+    file->values = malloc(file->batch_rows * sizeof(double));
+    file->timestamps = malloc(file->batch_rows * sizeof(int64_t));
+    if (file->ids == NULL || file->rooms == NULL || file->values == NULL || file->timestamps == NULL) {
+        arrowfile_free(file);
+        return NULL;
+    }
+
+    file->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file->fd == -1) {
+        arrowfile_free(file);
+        return NULL;
+    }
+    static const uint8_t magic[ARROW_ALIGNMENT] = ARROW_MAGIC;
+    if (write_all(file, magic, sizeof(magic)) != ARROWFILE_SUCCESS || write_schema(file) != ARROWFILE_SUCCESS) {
+        close(file->fd);
+        arrowfile_free(file);
+        return NULL;
+    }
+    return file;
+}
+
+int arrowfile_append(arrowfile_t *file, const sensor_data_t *reading) {
+    if (file->failed) return ARROWFILE_FAILURE;
+    file->ids[file->rows] = reading->id;
+    file->rooms[file->rows] = reading->room_id;
+    file->values[file->rows] = reading->value;
+    file->timestamps[file->rows] = (int64_t)reading->ts;
+    file->rows++;
+    file->total_rows++;
+    if (file->rows == file->batch_rows) return write_batch(file);
+    return ARROWFILE_SUCCESS;
+}
+
+uint64_t arrowfile_rows(const arrowfile_t *file) {
+    return file->total_rows;
+}
+
+int arrowfile_close(arrowfile_t **file) {
+    if (file == NULL || *file == NULL) return ARROWFILE_FAILURE;
+    arrowfile_t *f = *file;
+    int result = f->failed ? ARROWFILE_FAILURE : ARROWFILE_SUCCESS;
+    if (result == ARROWFILE_SUCCESS && f->rows > 0) result = write_batch(f);
+    if (result == ARROWFILE_SUCCESS) result = write_footer(f);
+    if (close(f->fd) == -1) result = ARROWFILE_FAILURE;
+    arrowfile_free(f);
+    *file = NULL;
+    return result;
+}
@@ -0,0 +1,39 @@
+#ifndef _ARROWFILE_H_
+#define _ARROWFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+#define ARROWFILE_SUCCESS 0
+#define ARROWFILE_FAILURE -1
+
+// Default rows per record batch, a writer holds one batch in memory
+#ifndef ARROWFILE_BATCH_ROWS
+#define ARROWFILE_BATCH_ROWS 65536
+#endif
+
+// Writer of an Apache Arrow IPC file (format version V5) with the columns
+//   sensor_id  uint16 or uint32, following SENSOR_ID_BITS
+//   room_id    uint16
+//   value      float64
+//   ts         timestamp[s, tz=UTC]
+// None of the columns has nulls. Buffers are in host byte order, which the schema records.
+typedef struct arrowfile arrowfile_t;
+
+// Create the file at 'path', truncating it, with 'batch_rows' rows per record batch (0 for the default)
+// Returns NULL on failure.
+arrowfile_t *arrowfile_create(const char *path, size_t batch_rows);
+
+// Add a reading, a full batch is written to the file
+// Returns 0 on success, -1 on failure.
+int arrowfile_append(arrowfile_t *file, const sensor_data_t *reading);
+
+// Readings appended so far
+uint64_t arrowfile_rows(const arrowfile_t *file);
+
+// Write the last batch and the footer, close the file and set '*file' to NULL
+// A file that was not closed successfully cannot be read. Returns 0 on success, -1 on failure.
+int arrowfile_close(arrowfile_t **file);
+
+#endif /* _ARROWFILE_H_ */
@@ -0,0 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+#include "capture.h"
+#include "config.h"
+#include "connmgr.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct capture_buffer {
+    char *data;
+    size_t used;
+    struct capture_buffer *next;
+} capture_buffer_t;
+
+// The connection threads take turns copying chunks into the filling buffer. Full buffers go to the I/O thread,
+// which writes them and opens the next file, the lock is never held across I/O.
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_cond = PTHREAD_COND_INITIALIZER;   // a buffer is full, free or the capture stops
+static atomic_bool capturing = false;
+static capture_buffer_t *filling = NULL;
+static capture_buffer_t *free_buffers = NULL;
+static capture_buffer_t *full_head = NULL;      // oldest first
+static capture_buffer_t *full_tail = NULL;
+static bool stopping = false;
+static bool failed = false;                     // the I/O thread could not write, the capture has stopped
+static pthread_t io_tid;
+
+static uint64_t chunk_count = 0;
+static uint64_t captured_bytes = 0;
+
+// Only used by the I/O thread once the capture is open
+static char *file_prefix = NULL;
+static int file_fd = -1;
+static unsigned int file_index = 0;
+static uint64_t file_bytes = 0;
+static uint64_t rotate_bytes = 0;
+
+static int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return CAPTURE_FAILURE;
+        data += n;
+        size -= n;
+    }
+    return CAPTURE_SUCCESS;
+}
+
+static int open_file(void) {
+    size_t length = strlen(file_prefix) + 16;
+    char *path = malloc(length);
+    if (path == NULL) return CAPTURE_FAILURE;
+    snprintf(path, length, "%s.%04u", file_prefix, file_index);
+    file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    free(path);
+    if (file_fd == -1) return CAPTURE_FAILURE;
+
+    capture_header_t header = {.magic = CAPTURE_MAGIC, .byte_order = 0x01020304,
+                               .sensor_id_bytes = sizeof(sensor_id_t), .ts_bytes = sizeof(sensor_ts_t)};
+    file_index++;
+    file_bytes = sizeof(header);
+    return write_all(file_fd, (const char *)&header, sizeof(header));
+}
+
+// A buffer holds whole chunks, a file is rotated between buffers
+static int write_buffer(const capture_buffer_t *buffer) {
+    if (file_bytes + buffer->used > rotate_bytes && file_bytes > sizeof(capture_header_t)) {
+        int closed = close(file_fd);
+        file_fd = -1;
+        if (closed == -1 || open_file() != CAPTURE_SUCCESS) return CAPTURE_FAILURE;
+    }
+    file_bytes += buffer->used;
+    return write_all(file_fd, buffer->data, buffer->used);
+}
+
+static void *io_thread(void *arg) {
+    pthread_mutex_lock(&capture_lock);
+    while (true) {
+        while (full_head == NULL && !stopping) pthread_cond_wait(&capture_cond, &capture_lock);
+        capture_buffer_t *buffer = full_head;
+        if (buffer == NULL) break;
+        full_head = buffer->next;
+        if (full_head == NULL) full_tail = NULL;
+        bool skip = failed;
+        pthread_mutex_unlock(&capture_lock);
+
+        int result = skip ? CAPTURE_SUCCESS : write_buffer(buffer);
+        if (result != CAPTURE_SUCCESS) {
+            char log_msg[256];
+            snprintf(log_msg, sizeof(log_msg), "Capture stopped: failed to write %s.%04u: %s", file_prefix,
+                     file_index ? file_index - 1 : 0, strerror(errno));
+            write_log(log_msg);
+        }
+
+        pthread_mutex_lock(&capture_lock);
+        if (result != CAPTURE_SUCCESS) {
+            failed = true;
+            atomic_store(&capturing, false);
+        }
+        buffer->used = 0;
+        buffer->next = free_buffers;
+        free_buffers = buffer;
+        pthread_cond_broadcast(&capture_cond);
+    }
+    pthread_mutex_unlock(&capture_lock);
+    return NULL;
+}
+
+static void free_buffer_list(capture_buffer_t *buffer) {
+    while (buffer != NULL) {
+        capture_buffer_t *next = buffer->next;
+        free(buffer->data);
+        free(buffer);
+        buffer = next;
+    }
+}
+
+int capture_open(const char *prefix, unsigned int rotate_mb) {
+    if (file_prefix != NULL) return CAPTURE_FAILURE;
+    file_prefix = strdup(prefix);
+    if (file_prefix == NULL) return CAPTURE_FAILURE;
+    rotate_bytes = (uint64_t)(rotate_mb ? rotate_mb : CAPTURE_ROTATE_MB) << 20;
+    file_index = 0;
+    chunk_count = 0;
+    captured_bytes = 0;
+    stopping = failed = false;
+
+    for (int i = 0; i < CAPTURE_BUFFERS; i++) {
+        capture_buffer_t *buffer = calloc(1, sizeof(capture_buffer_t));
+        if (buffer != NULL && (buffer->data = malloc(CAPTURE_BUFFER_BYTES)) == NULL) {
+            free(buffer);
+            buffer = NULL;
+        }
+        if (buffer == NULL) break;
+        buffer->next = free_buffers;
+        free_buffers = buffer;
+    }
+    filling = free_buffers;
+    if (filling != NULL) free_buffers = filling->next;
+
+    if (filling == NULL || free_buffers == NULL || open_file() != CAPTURE_SUCCESS ||
+        pthread_create(&io_tid, NULL, io_thread, NULL) != 0) {
+        if (file_fd != -1) close(file_fd);
+        file_fd = -1;
+        free_buffer_list(filling);
+        free_buffer_list(free_buffers);
+        filling = free_buffers = NULL;
+        free(file_prefix);
+        file_prefix = NULL;
+        return CAPTURE_FAILURE;
+    }
+    filling->next = NULL;
+    atomic_store(&capturing, true);
+    return CAPTURE_SUCCESS;
+}
+
+// Hand the filling buffer to the I/O thread, the lock is held
+static void queue_filling(void) {
+    if (full_tail != NULL) {
+        full_tail->next = filling;
+    } else {
+        full_head = filling;
+    }
+    full_tail = filling;
+    filling = NULL;
+    pthread_cond_broadcast(&capture_cond);
+}
+
+// Make room for 'size' bytes in the filling buffer, swapping it for a free one when it is full. The lock is held.
+// Waits while the I/O thread is behind on every buffer. Returns -1 once the capture failed.
+static int make_room(size_t size) {
+    while (true) {
+        // The capture can fail or close while this waits
+        if (failed || !atomic_load(&capturing)) return CAPTURE_FAILURE;
+        if (filling->used + size <= CAPTURE_BUFFER_BYTES) return CAPTURE_SUCCESS;
+        if (free_buffers == NULL) {
+            pthread_cond_wait(&capture_cond, &capture_lock);
+            continue;
+        }
+        queue_filling();
+        filling = free_buffers;
+        free_buffers = filling->next;
+        filling->next = NULL;
+    }
+}
+
+void capture_chunk(uint32_t connection, const void *data, size_t length) {
+    if (!atomic_load(&capturing)) return;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    capture_chunk_t chunk = {.received_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec,
+                             .connection = connection, .length = (uint32_t)length};
+    size_t size = sizeof(capture_chunk_t) + length;
+    if (size > CAPTURE_BUFFER_BYTES) return;     // a receive buffer of connmgr always fits
+
+    pthread_mutex_lock(&capture_lock);
+    if (make_room(size) == CAPTURE_SUCCESS) {
+        memcpy(filling->data + filling->used, &chunk, sizeof(capture_chunk_t));
+        if (length > 0) memcpy(filling->data + filling->used + sizeof(capture_chunk_t), data, length);
+        filling->used += size;
+        chunk_count++;
+        captured_bytes += length;
+    }
+    pthread_mutex_unlock(&capture_lock);
+}
+
+void capture_close(void) {
+    if (file_prefix == NULL) return;
+    pthread_mutex_lock(&capture_lock);
+    atomic_store(&capturing, false);
+    queue_filling();
+    stopping = true;
+    pthread_cond_broadcast(&capture_cond);
+    pthread_mutex_unlock(&capture_lock);
+    pthread_join(io_tid, NULL);
+
+    if (close(file_fd) == -1 && !failed) write_log("Capture: failed to write the last chunks");
+    file_fd = -1;
+    char log_msg[256];
+    snprintf(log_msg, sizeof(log_msg), "Captured %" PRIu64 " bytes in %" PRIu64 " chunks to %u files %s.*",
+             captured_bytes, chunk_count, file_index, file_prefix);
+    write_log(log_msg);
+
+    free_buffer_list(filling);
+    free_buffer_list(free_buffers);
+    filling = free_buffers = NULL;
+    free(file_prefix);
+    file_prefix = NULL;
+}
@@ -0,0 +1,56 @@
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_SUCCESS 0
+#define CAPTURE_FAILURE -1
+
+// Chunks are collected in buffers of this size, an I/O thread writes the full ones and rotates the files
+// Connections only wait when all CAPTURE_BUFFERS are full, i.e. when the disk cannot keep up.
+#ifndef CAPTURE_BUFFER_BYTES
+#define CAPTURE_BUFFER_BYTES (1 << 20)
+#endif
+
+#ifndef CAPTURE_BUFFERS
+#define CAPTURE_BUFFERS 4
+#endif
+
+// A capture file is closed and the next one started once it holds this many MB
+#ifndef CAPTURE_ROTATE_MB
+#define CAPTURE_ROTATE_MB 256
+#endif
+
+#define CAPTURE_MAGIC "SGWCAP1"
+
+// A capture file is a capture_header_t followed by chunks, each a capture_chunk_t and the bytes that one recv()
+// of the connection returned. Everything is in the byte order of the gateway, which 'byte_order' shows.
+typedef struct capture_header {
+    char magic[8];              // CAPTURE_MAGIC
+    uint32_t byte_order;        // 0x01020304
+    uint8_t sensor_id_bytes;    // sizeof(sensor_id_t) and sizeof(sensor_ts_t) of the wire format
+    uint8_t ts_bytes;
+    uint16_t reserved;
+} capture_header_t;
+
+typedef struct capture_chunk {
+    int64_t received_ns;        // CLOCK_REALTIME when the bytes came in
+    uint32_t connection;        // numbered from 1 in the order the connections were accepted
+    uint32_t length;            // bytes that follow, 0 when the connection was closed
+} capture_chunk_t;
+
+// Start capturing to "<prefix>.0000", "<prefix>.0001", ... rotating after 'rotate_mb' MB (0 for the default)
+// A file is rotated between buffers, so it can end up to CAPTURE_BUFFER_BYTES over the limit.
+// Returns 0 on success, -1 on failure.
+int capture_open(const char *prefix, unsigned int rotate_mb);
+
+// Add what a connection received, a 'length' of 0 records that the connection closed
+// Does nothing when no capture is open. Called from every connection thread. After a write error the capture
+// stops, the error is logged once.
+void capture_chunk(uint32_t connection, const void *data, size_t length);
+
+// Write what is left and close the current file, logs how much was captured
+void capture_close(void);
+
+#endif /* _CAPTURE_H_ */
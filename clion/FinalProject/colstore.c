@@ -0,0 +1,424 @@
+#define _POSIX_C_SOURCE 200809L
+#include "colstore.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+struct colstore_reader {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;              // of the next block
+    sensor_data_t *readings;    // decoded readings of the current block
+    size_t capacity;
+    size_t count;
+    size_t next;
+};
+
+typedef struct bit_writer {
+    uint8_t *data;
+    size_t size;                // bytes in use, the last one may be partial
+    size_t capacity;
+    unsigned int used;          // bits used of the last byte, 0 when it is complete
+} bit_writer_t;
+
+typedef struct bit_reader {
+    const uint8_t *data;
+    size_t bits;
+    size_t pos;
+} bit_reader_t;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t size) {
+    pthread_once(&crc_once, crc_init);
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+uint32_t colstore_crc32(uint32_t crc, const void *data, size_t size) {
+    return crc32_update(crc, data, size);
+}
+
+static uint32_t block_checksum(const uint8_t *block, size_t size) {
+    colstore_block_header_t header;
+    memcpy(&header, block, sizeof(header));
+    header.checksum = 0;
+    uint32_t crc = crc32_update(0, (const uint8_t *)&header, sizeof(header));
+    return crc32_update(crc, block + sizeof(header), size - sizeof(header));
+}
+
+static bool bits_reserve(bit_writer_t *writer, size_t extra) {
+    if (writer->size + extra <= writer->capacity) return true;
+    size_t capacity = writer->capacity ? writer->capacity : 256;
+    while (capacity < writer->size + extra) capacity *= 2;
+    uint8_t *data = realloc(writer->data, capacity);
+    if (data == NULL) return false;
+    writer->data = data;
+    writer->capacity = capacity;
+    return true;
+}
+
+// Append the low 'count' bits of 'value', most significant first
+static bool bits_write(bit_writer_t *writer, uint64_t value, unsigned int count) {
+    if (!bits_reserve(writer, 9)) return false;
+    while (count > 0) {
+        if (writer->used == 0) writer->data[writer->size++] = 0;
+        unsigned int room = 8 - writer->used;
+        unsigned int n = count < room ? count : room;
+        uint8_t chunk = (uint8_t)((value >> (count - n)) & ((1u << n) - 1));
+        writer->data[writer->size - 1] |= (uint8_t)(chunk << (room - n));
+        writer->used = (writer->used + n) & 7;
+        count -= n;
+    }
+    return true;
+}
+
+static bool bits_read(bit_reader_t *reader, unsigned int count, uint64_t *value) {
+    if (reader->pos + count > reader->bits) return false;
+    uint64_t result = 0;
+    while (count > 0) {
+        unsigned int offset = reader->pos & 7;
+        unsigned int n = 8 - offset < count ? 8 - offset : count;
+        uint8_t byte = reader->data[reader->pos >> 3];
+        result = (result << n) | ((byte >> (8 - offset - n)) & ((1u << n) - 1));
+        reader->pos += n;
+        count -= n;
+    }
+    *value = result;
+    return true;
+}
+
+static bool varint_write(bit_writer_t *writer, uint64_t value) {
+    if (!bits_reserve(writer, 10)) return false;
+    do {
+        uint8_t byte = value & 0x7F;
+        value >>= 7;
+        writer->data[writer->size++] = byte | (value ? 0x80 : 0);
+    } while (value);
+    return true;
+}
+
+static bool varint_read(const uint8_t **p, const uint8_t *end, uint64_t *value) {
+    uint64_t result = 0;
+    for (unsigned int shift = 0; *p < end && shift < 64; shift += 7) {
+        uint8_t byte = *(*p)++;
+        result |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+    return false;
+}
+
+static uint64_t zigzag(int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Small signed integers with the buckets of the Gorilla paper, used for the delta of delta of the
+// timestamps, where readings every second cost one bit, and for the deltas of decimal values
+static bool bucket_write(bit_writer_t *writer, int64_t value) {
+    uint64_t z = zigzag(value);
+    if (z == 0) return bits_write(writer, 0x0, 1);
+    if (z < (1u << 7)) return bits_write(writer, 0x2, 2) && bits_write(writer, z, 7);
+    if (z < (1u << 9)) return bits_write(writer, 0x6, 3) && bits_write(writer, z, 9);
+    if (z < (1u << 12)) return bits_write(writer, 0xE, 4) && bits_write(writer, z, 12);
+    return bits_write(writer, 0xF, 4) && bits_write(writer, z, 64);
+}
+
+static bool bucket_read(bit_reader_t *reader, int64_t *value) {
+    static const unsigned int widths[] = {7, 9, 12, 64};
+    uint64_t bit, z = 0;
+    unsigned int bucket = 0;
+    if (!bits_read(reader, 1, &bit)) return false;
+    if (bit == 0) {
+        *value = 0;
+        return true;
+    }
+    while (bucket < 3) {
+        if (!bits_read(reader, 1, &bit)) return false;
+        if (bit == 0) break;
+        bucket++;
+    }
+    if (!bits_read(reader, widths[bucket], &z)) return false;
+    *value = unzigzag(z);
+    return true;
+}
+
+// Sensors report with a fixed resolution, a value that is an exact number of hundredths is stored as one
+static bool to_hundredths(sensor_value_t value, int64_t *hundredths) {
+    double scaled = value * 100.0;
+    if (!(scaled > -9e15 && scaled < 9e15)) return false;
+    int64_t q = (int64_t)(scaled + (scaled >= 0 ? 0.5 : -0.5));
+    double back = (double)q / 100.0;
+    if (memcmp(&back, &value, sizeof(back)) != 0) return false;   // also keeps -0.0 apart from 0.0
+    *hundredths = q;
+    return true;
+}
+
+static int reading_compare(const void *x, const void *y) {
+    const sensor_data_t *reading_x = x;
+    const sensor_data_t *reading_y = y;
+    if (reading_x->id != reading_y->id) return reading_x->id < reading_y->id ? -1 : 1;
+    if (reading_x->ts != reading_y->ts) return reading_x->ts < reading_y->ts ? -1 : 1;
+    return 0;
+}
+
+int colstore_encode(sensor_data_t *readings, size_t count, uint8_t **block, size_t *size) {
+    if (readings == NULL || count == 0 || count > UINT32_MAX || block == NULL || size == NULL) return COLSTORE_FAILURE;
+
+    // A block usually arrives sorted on time, grouping it per sensor makes the runs and deltas small
+    qsort(readings, count, sizeof(sensor_data_t), reading_compare);
+
+    colstore_block_header_t header = {.magic = COLSTORE_MAGIC, .version = COLSTORE_VERSION, .count = (uint32_t)count,
+                                      .min_id = readings[0].id, .max_id = readings[count - 1].id,
+                                      .min_ts = readings[0].ts, .max_ts = readings[0].ts};
+    bit_writer_t ids = {0}, ts = {0}, values = {0};
+    bool ok = true;
+
+    // Values that are all whole hundredths are stored as deltas, exact and much smaller than XORed doubles
+    int64_t prev_hundredths = 0, hundredths;
+    header.flags = COLSTORE_DECIMAL;
+    for (size_t i = 0; i < count && header.flags; i++) {
+        if (!to_hundredths(readings[i].value, &hundredths)) header.flags = 0;
+    }
+
+    uint32_t prev_id = 0;
+    uint64_t prev_bits = 0;
+    unsigned int prev_leading = 65, prev_trailing = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (readings[i].ts < header.min_ts) header.min_ts = readings[i].ts;
+        if (readings[i].ts > header.max_ts) header.max_ts = readings[i].ts;
+    }
+
+    for (size_t start = 0; ok && start < count;) {
+        size_t end = start + 1;
+        while (end < count && readings[end].id == readings[start].id) end++;
+        ok = varint_write(&ids, readings[start].id - prev_id) && varint_write(&ids, end - start);
+        prev_id = readings[start].id;
+        header.runs++;
+
+        // Every run restarts the timestamps from the start of the block
+        int64_t prev_ts = header.min_ts, prev_delta = 0;
+        for (size_t i = start; ok && i < end; i++) {
+            int64_t delta = (int64_t)readings[i].ts - prev_ts;
+            ok = bucket_write(&ts, delta - prev_delta);
+            prev_ts = readings[i].ts;
+            prev_delta = delta;
+
+            uint64_t bits;
+            memcpy(&bits, &readings[i].value, sizeof(bits));
+            if (header.flags & COLSTORE_DECIMAL) {
+                to_hundredths(readings[i].value, &hundredths);
+                ok = ok && bucket_write(&values, hundredths - prev_hundredths);
+                prev_hundredths = hundredths;
+            } else if (i == 0) {
+                ok = ok && bits_write(&values, bits, 64);
+            } else {
+                uint64_t x = bits ^ prev_bits;
+                if (x == 0) {
+                    ok = ok && bits_write(&values, 0x0, 1);
+                } else {
+                    unsigned int leading = __builtin_clzll(x), trailing = __builtin_ctzll(x);
+                    if (leading > 31) leading = 31;
+                    if (prev_leading <= 64 && leading >= prev_leading && trailing >= prev_trailing) {
+                        // The meaningful bits fit in the window of the previous value
+                        unsigned int width = 64 - prev_leading - prev_trailing;
+                        ok = ok && bits_write(&values, 0x2, 2) && bits_write(&values, x >> prev_trailing, width);
+                    } else {
+                        unsigned int width = 64 - leading - trailing;
+                        ok = ok && bits_write(&values, 0x3, 2) && bits_write(&values, leading, 5) &&
+                             bits_write(&values, width - 1, 6) && bits_write(&values, x >> trailing, width);
+                        prev_leading = leading;
+                        prev_trailing = trailing;
+                    }
+                }
+            }
+            prev_bits = bits;
+        }
+        start = end;
+    }
+
+    uint8_t *out = NULL;
+    if (ok) {
+        header.id_bytes = (uint32_t)ids.size;
+        header.ts_bytes = (uint32_t)ts.size;
+        header.value_bytes = (uint32_t)values.size;
+        *size = sizeof(header) + ids.size + ts.size + values.size;
+        out = malloc(*size);
+    }
+    if (out != NULL) {
+        memcpy(out + sizeof(header), ids.data, ids.size);
+        memcpy(out + sizeof(header) + ids.size, ts.data, ts.size);
+        memcpy(out + sizeof(header) + ids.size + ts.size, values.data, values.size);
+        memcpy(out, &header, sizeof(header));
+        header.checksum = block_checksum(out, *size);
+        memcpy(out, &header, sizeof(header));
+    }
+    free(ids.data);
+    free(ts.data);
+    free(values.data);
+    *block = out;
+    return out != NULL ? COLSTORE_SUCCESS : COLSTORE_FAILURE;
+}
+
+size_t colstore_check(const uint8_t *block, size_t size) {
+    colstore_block_header_t header;
+    if (size < sizeof(header)) return 0;
+    memcpy(&header, block, sizeof(header));
+    if (header.magic != COLSTORE_MAGIC || header.version != COLSTORE_VERSION || header.count == 0) return 0;
+
+    uint64_t total = (uint64_t)sizeof(header) + header.id_bytes + header.ts_bytes + header.value_bytes;
+    if (total > size || block_checksum(block, (size_t)total) != header.checksum) return 0;
+    return (size_t)total;
+}
+
+int colstore_decode(const uint8_t *block, sensor_data_t *readings) {
+    colstore_block_header_t header;
+    memcpy(&header, block, sizeof(header));
+    const uint8_t *p = block + sizeof(header);
+    const uint8_t *ids_end = p + header.id_bytes;
+    bit_reader_t ts = {.data = ids_end, .bits = (size_t)header.ts_bytes * 8};
+    bit_reader_t values = {.data = ids_end + header.ts_bytes, .bits = (size_t)header.value_bytes * 8};
+
+    uint64_t id = 0, prev_bits = 0;
+    int64_t prev_hundredths = 0;
+    unsigned int prev_leading = 0, prev_trailing = 0;
+    size_t i = 0;
+    for (uint32_t run = 0; run < header.runs; run++) {
+        uint64_t id_delta, length;
+        if (!varint_read(&p, ids_end, &id_delta) || !varint_read(&p, ids_end, &length) ||
+            length > header.count - i) {
+            return COLSTORE_CORRUPT;
+        }
+        id += id_delta;
+
+        int64_t prev_ts = header.min_ts, prev_delta = 0;
+        for (uint64_t k = 0; k < length; k++, i++) {
+            int64_t dod;
+            if (!bucket_read(&ts, &dod)) return COLSTORE_CORRUPT;
+            prev_delta += dod;
+            prev_ts += prev_delta;
+
+            uint64_t bits, flag;
+            if (header.flags & COLSTORE_DECIMAL) {
+                int64_t delta;
+                if (!bucket_read(&values, &delta)) return COLSTORE_CORRUPT;
+                prev_hundredths += delta;
+                sensor_value_t value = (double)prev_hundredths / 100.0;
+                memcpy(&bits, &value, sizeof(bits));
+            } else if (i == 0) {
+                if (!bits_read(&values, 64, &bits)) return COLSTORE_CORRUPT;
+            } else {
+                if (!bits_read(&values, 1, &flag)) return COLSTORE_CORRUPT;
+                bits = prev_bits;
+                if (flag) {
+                    uint64_t x, leading, width;
+                    if (!bits_read(&values, 1, &flag)) return COLSTORE_CORRUPT;
+                    if (flag) {
+                        if (!bits_read(&values, 5, &leading) || !bits_read(&values, 6, &width)) return COLSTORE_CORRUPT;
+                        width++;
+                        if (leading + width > 64) return COLSTORE_CORRUPT;
+                        prev_leading = (unsigned int)leading;
+                        prev_trailing = (unsigned int)(64 - leading - width);
+                    }
+                    width = 64 - prev_leading - prev_trailing;
+                    if (!bits_read(&values, (unsigned int)width, &x)) return COLSTORE_CORRUPT;
+                    bits ^= x << prev_trailing;
+                }
+            }
+            prev_bits = bits;
+
+            readings[i] = (sensor_data_t){.id = (sensor_id_t)id, .room_id = 0, .ts = (sensor_ts_t)prev_ts};
+            memcpy(&readings[i].value, &bits, sizeof(bits));
+        }
+    }
+    return (i == header.count) ? COLSTORE_SUCCESS : COLSTORE_CORRUPT;
+}
+
+colstore_reader_t *colstore_reader_open(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return NULL;
+
+    colstore_reader_t *reader = calloc(1, sizeof(colstore_reader_t));
+    struct stat st;
+    if (reader == NULL || fstat(fd, &st) == -1) {
+        free(reader);
+        close(fd);
+        return NULL;
+    }
+    reader->size = st.st_size;
+    if (reader->size > 0) {
+        void *data = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            free(reader);
+            close(fd);
+            return NULL;
+        }
+        posix_madvise(data, reader->size, POSIX_MADV_SEQUENTIAL);
+        reader->data = data;
+    }
+    close(fd);
+    return reader;
+}
+
+int colstore_reader_next(colstore_reader_t *reader, sensor_data_t *data) {
+    if (reader == NULL || data == NULL) return COLSTORE_FAILURE;
+
+    while (reader->next == reader->count) {
+        size_t remaining = reader->size - reader->offset;
+        colstore_block_header_t header;
+        // A block that is cut short was still being written, the file ends before it
+        if (remaining < sizeof(header)) return COLSTORE_END;
+        memcpy(&header, reader->data + reader->offset, sizeof(header));
+        if (header.magic != COLSTORE_MAGIC) return COLSTORE_CORRUPT;
+        if ((uint64_t)sizeof(header) + header.id_bytes + header.ts_bytes + header.value_bytes > remaining) {
+            return COLSTORE_END;
+        }
+
+        size_t size = colstore_check(reader->data + reader->offset, remaining);
+        if (size == 0) return COLSTORE_CORRUPT;
+        if (header.count > reader->capacity) {
+            sensor_data_t *readings = realloc(reader->readings, header.count * sizeof(sensor_data_t));
+            if (readings == NULL) return COLSTORE_FAILURE;
+            reader->readings = readings;
+            reader->capacity = header.count;
+        }
+        if (colstore_decode(reader->data + reader->offset, reader->readings) != COLSTORE_SUCCESS) {
+            return COLSTORE_CORRUPT;
+        }
+        reader->offset += size;
+        reader->count = header.count;
+        reader->next = 0;
+    }
+
+    *data = reader->readings[reader->next++];
+    return COLSTORE_SUCCESS;
+}
+
+void colstore_reader_close(colstore_reader_t **reader) {
+    if (reader == NULL || *reader == NULL) return;
+    if ((*reader)->data != NULL) munmap((void *)(*reader)->data, (*reader)->size);
+    free((*reader)->readings);
+    free(*reader);
+    *reader = NULL;
+}
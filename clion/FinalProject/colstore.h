@@ -0,0 +1,67 @@
+#ifndef _COLSTORE_H_
+#define _COLSTORE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+#define COLSTORE_SUCCESS 0
+#define COLSTORE_FAILURE -1
+#define COLSTORE_END 1          // no more readings
+#define COLSTORE_CORRUPT 2      // a block failed its checks, the rest of the file is not read
+
+#define COLSTORE_MAGIC 0x4B4C4253u     // "SBLK"
+#define COLSTORE_VERSION 1
+
+#define COLSTORE_DECIMAL 0x1    // block flag: values are deltas of whole hundredths instead of XORed doubles
+
+// Readings per block, the storage backend writes a block when it is full or when it is flushed
+#ifndef COLSTORE_BLOCK_READINGS
+#define COLSTORE_BLOCK_READINGS 4096
+#endif
+
+// A block is this header followed by three columns: the sensor ids as runs, the timestamps and the values.
+// Readings are sorted on sensor id and then on timestamp inside a block. Fields are in host byte order.
+typedef struct colstore_block_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint32_t count;             // readings in the block
+    uint32_t runs;              // sensor ids in the block
+    uint32_t id_bytes;          // varint (id delta, run length) pairs
+    uint32_t ts_bytes;          // delta-of-delta bit stream, restarted for every sensor
+    uint32_t value_bytes;       // XOR bit stream of the values, or their deltas in hundredths with COLSTORE_DECIMAL
+    uint32_t min_id;
+    uint32_t max_id;
+    uint32_t checksum;          // CRC-32 of the header, with this field 0, and of the columns
+    int64_t min_ts;
+    int64_t max_ts;
+} colstore_block_header_t;
+
+typedef struct colstore_reader colstore_reader_t;
+
+// Encode 'count' readings into a block, the readings are sorted in place
+// '*block' is allocated and has to be freed by the caller. Returns 0 on success, -1 on failure.
+int colstore_encode(sensor_data_t *readings, size_t count, uint8_t **block, size_t *size);
+
+// Check the header and checksum of the block at 'block', which holds at most 'size' bytes
+// Returns the size of the block, or 0 if it is not a complete and valid block.
+size_t colstore_check(const uint8_t *block, size_t size);
+
+// Decode a checked block into 'readings', which has room for header->count readings
+// The room id of the readings is left 0. Returns 0 on success, COLSTORE_CORRUPT on failure.
+int colstore_decode(const uint8_t *block, sensor_data_t *readings);
+
+// Open a file of blocks for reading, NULL on failure
+colstore_reader_t *colstore_reader_open(const char *path);
+
+// Read the next reading, returns 0, COLSTORE_END at the end of the file or COLSTORE_CORRUPT
+int colstore_reader_next(colstore_reader_t *reader, sensor_data_t *data);
+
+// Close the reader and set '*reader' to NULL
+void colstore_reader_close(colstore_reader_t **reader);
+
+// CRC-32 of 'size' bytes, continuing from 'crc' (0 to start), the checksum of the blocks
+uint32_t colstore_crc32(uint32_t crc, const void *data, size_t size);
+
+#endif /* _COLSTORE_H_ */
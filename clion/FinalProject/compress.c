@@ -0,0 +1,350 @@
+#define _POSIX_C_SOURCE 200809L
+#include "compress.h"
+#include "connmgr.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Only used by the storage manager thread
+
+typedef struct compress_entry {
+    unsigned int id;
+    compress_rule_t rule;
+} compress_entry_t;
+
+typedef struct compress_state {
+    bool used;
+    sensor_id_t id;
+    compress_rule_t rule;       // resolved when the sensor is first seen
+    bool started;               // 'stored' holds a reading
+    sensor_data_t stored;       // last reading that was stored
+    bool holding;               // swinging door: 'held' is the last reading and not stored yet
+    sensor_data_t held;
+    uint64_t door_from;         // input position of the first reading the open door covers
+    double slope_min;           // slopes from 'stored' that keep every reading since within epsilon
+    double slope_max;
+} compress_state_t;
+
+static compress_rule_t default_rule = {.mode = COMPRESS_OFF, .keepalive = COMPRESS_KEEPALIVE};
+static compress_entry_t *rules = NULL;      // sorted on sensor id
+static size_t rule_count = 0;
+
+// Open addressing on sensor id, kept at most half full
+static compress_state_t *states = NULL;
+static size_t state_mask = 0;
+static size_t state_count = 0;
+
+static uint64_t readings_in = 0;
+static uint64_t readings_out = 0;
+
+static size_t state_hash(sensor_id_t id) {
+    uint32_t h = (uint32_t)id * 0x9E3779B1u;
+    return h ^ (h >> 16);
+}
+
+static int append_entry(compress_entry_t **entries, size_t *count, size_t *capacity, unsigned int id,
+                        compress_rule_t rule) {
+    if (*count == *capacity) {
+        size_t grown_capacity = *capacity ? *capacity * 2 : 16;
+        compress_entry_t *grown = realloc(*entries, grown_capacity * sizeof(compress_entry_t));
+        if (grown == NULL) return COMPRESS_FAILURE;
+        *entries = grown;
+        *capacity = grown_capacity;
+    }
+    (*entries)[(*count)++] = (compress_entry_t){.id = id, .rule = rule};
+    return COMPRESS_SUCCESS;
+}
+
+static int entry_compare(const void *x, const void *y) {
+    const compress_entry_t *entry_x = x;
+    const compress_entry_t *entry_y = y;
+    if (entry_x->id < entry_y->id) return -1;
+    if (entry_x->id > entry_y->id) return 1;
+    return 0;
+}
+
+static compress_rule_t lookup_rule(sensor_id_t id) {
+    if (rule_count == 0) return default_rule;
+    compress_entry_t key = {.id = id};
+    compress_entry_t *entry = bsearch(&key, rules, rule_count, sizeof(compress_entry_t), entry_compare);
+    return entry ? entry->rule : default_rule;
+}
+
+static int grow_states(void) {
+    size_t capacity = states ? (state_mask + 1) * 2 : 64;
+    compress_state_t *grown = calloc(capacity, sizeof(compress_state_t));
+    if (grown == NULL) return COMPRESS_FAILURE;
+    for (size_t i = 0; states != NULL && i <= state_mask; i++) {
+        if (!states[i].used) continue;
+        size_t s = state_hash(states[i].id) & (capacity - 1);
+        while (grown[s].used) s = (s + 1) & (capacity - 1);
+        grown[s] = states[i];
+    }
+    free(states);
+    states = grown;
+    state_mask = capacity - 1;
+    return COMPRESS_SUCCESS;
+}
+
+// State of a sensor, created on first sight. NULL if memory runs out, the reading is stored then.
+static compress_state_t *find_state(sensor_id_t id) {
+    if (states == NULL || 2 * (state_count + 1) > state_mask + 1) {
+        if (grow_states() != COMPRESS_SUCCESS) return NULL;
+    }
+    size_t s = state_hash(id) & state_mask;
+    while (states[s].used) {
+        if (states[s].id == id) return &states[s];
+        s = (s + 1) & state_mask;
+    }
+    states[s] = (compress_state_t){.used = true, .id = id, .rule = lookup_rule(id)};
+    state_count++;
+    return &states[s];
+}
+
+int compress_parse_rule(const char *text, compress_rule_t *rule) {
+    compress_rule_t parsed = {.keepalive = COMPRESS_KEEPALIVE};
+    size_t length = strcspn(text, ":");
+    if (length == 3 && strncmp(text, "off", 3) == 0) {
+        parsed.mode = COMPRESS_OFF;
+    } else if (length == 8 && strncmp(text, "deadband", 8) == 0) {
+        parsed.mode = COMPRESS_DEADBAND;
+    } else if (length == 5 && strncmp(text, "swing", 5) == 0) {
+        parsed.mode = COMPRESS_SWINGING_DOOR;
+    } else {
+        return COMPRESS_FAILURE;
+    }
+
+    const char *field = text + length;
+    if (*field == ':') {
+        char *end;
+        errno = 0;
+        parsed.epsilon = strtod(field + 1, &end);
+        if (errno != 0 || end == field + 1 || parsed.epsilon < 0) return COMPRESS_FAILURE;
+        field = end;
+    }
+    if (*field == ':') {
+        char *end;
+        errno = 0;
+        long long keepalive = strtoll(field + 1, &end, 10);
+        if (errno != 0 || end == field + 1 || keepalive < 0) return COMPRESS_FAILURE;
+        parsed.keepalive = (sensor_ts_t)keepalive;
+        field = end;
+    }
+    if (*field != '\0') return COMPRESS_FAILURE;
+    *rule = parsed;
+    return COMPRESS_SUCCESS;
+}
+
+void compress_set_default(const compress_rule_t *rule) {
+    default_rule = *rule;
+}
+
+int compress_load_config(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return COMPRESS_FAILURE;
+
+    compress_rule_t fallback = default_rule;
+    compress_entry_t *entries = NULL;
+    size_t count = 0, capacity = 0;
+    char line[256];
+    int line_nr = 0;
+    int result = COMPRESS_SUCCESS;
+    while (result == COMPRESS_SUCCESS && fgets(line, sizeof(line), fp) != NULL) {
+        line_nr++;
+        char *save = NULL;
+        char *scope = strtok_r(line, " \t\r\n", &save);
+        if (scope == NULL || scope[0] == '#') continue;
+
+        char *id_text = strcmp(scope, "sensor") == 0 ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+        char *rule_text = strtok_r(NULL, " \t\r\n", &save);
+        char *extra = strtok_r(NULL, " \t\r\n", &save);
+        compress_rule_t rule;
+        result = COMPRESS_FAILURE;
+        if (rule_text == NULL || (extra != NULL && extra[0] != '#') ||
+            compress_parse_rule(rule_text, &rule) != COMPRESS_SUCCESS) {
+            break;
+        }
+        if (strcmp(scope, "default") == 0) {
+            fallback = rule;
+            result = COMPRESS_SUCCESS;
+        } else if (id_text != NULL) {
+            char *end;
+            unsigned long id = strtoul(id_text, &end, 10);
+            if (end != id_text && *end == '\0' && id <= SENSOR_ID_MAX) {
+                result = append_entry(&entries, &count, &capacity, (unsigned int)id, rule);
+            }
+        }
+    }
+    fclose(fp);
+
+    char log_msg[128];
+    if (result != COMPRESS_SUCCESS) {
+        snprintf(log_msg, sizeof(log_msg), "Compression config: invalid line %d in %s", line_nr, path);
+        write_log(log_msg);
+        free(entries);
+        return COMPRESS_FAILURE;
+    }
+
+    qsort(entries, count, sizeof(compress_entry_t), entry_compare);
+    free(rules);
+    rules = entries;
+    rule_count = count;
+    default_rule = fallback;
+    // Sensors that were already seen keep the rule they started with
+    snprintf(log_msg, sizeof(log_msg), "Compression config loaded: %zu sensor rules", count);
+    write_log(log_msg);
+    return COMPRESS_SUCCESS;
+}
+
+// The held reading as it came in, or moved onto the door if the line to it would leave an earlier reading more
+// than epsilon off. The textbook algorithm stores it as is and can then be off by up to twice epsilon.
+static sensor_data_t door_point(const compress_state_t *state) {
+    sensor_data_t point = state->held;
+    double dt = (double)(state->held.ts - state->stored.ts);
+    double slope = (state->held.value - state->stored.value) / dt;
+    if (slope < state->slope_min) slope = state->slope_min;
+    else if (slope > state->slope_max) slope = state->slope_max;
+    else return point;
+    point.value = state->stored.value + slope * dt;
+    return point;
+}
+
+// Start a new door from the stored reading through 'data', the reading at input position 'position'
+static void open_door(compress_state_t *state, const sensor_data_t *data, uint64_t position) {
+    double dt = (double)(data->ts - state->stored.ts);
+    state->slope_min = (data->value - state->stored.value - state->rule.epsilon) / dt;
+    state->slope_max = (data->value - state->stored.value + state->rule.epsilon) / dt;
+    state->held = *data;
+    state->holding = true;
+    state->door_from = position;
+}
+
+// Store the held reading, the door closes there
+static size_t close_door(compress_state_t *state, sensor_data_t *out) {
+    if (!state->holding) return 0;
+    state->stored = *out = door_point(state);
+    state->holding = false;
+    return 1;
+}
+
+static size_t swinging_door(compress_state_t *state, const sensor_data_t *data, uint64_t position,
+                            sensor_data_t *out) {
+    size_t n = 0;
+    if (state->rule.keepalive > 0 && data->ts - state->stored.ts >= state->rule.keepalive) {
+        n += close_door(state, &out[n]);
+        if (data->ts - state->stored.ts >= state->rule.keepalive) {
+            state->stored = out[n++] = *data;
+            return n;
+        }
+    }
+
+    if (data->ts <= state->stored.ts) {
+        // No slope to a reading at or before the stored one, a close value is dropped and any other stored
+        if (!state->holding && data->value - state->stored.value <= state->rule.epsilon &&
+            state->stored.value - data->value <= state->rule.epsilon) {
+            return n;
+        }
+        n += close_door(state, &out[n]);
+        state->stored = out[n++] = *data;
+        return n;
+    }
+    if (!state->holding) {
+        open_door(state, data, position);
+        return n;
+    }
+
+    double dt = (double)(data->ts - state->stored.ts);
+    double slope_min = (data->value - state->stored.value - state->rule.epsilon) / dt;
+    double slope_max = (data->value - state->stored.value + state->rule.epsilon) / dt;
+    if (slope_min < state->slope_min) slope_min = state->slope_min;
+    if (slope_max > state->slope_max) slope_max = state->slope_max;
+    if (slope_min <= slope_max) {
+        state->slope_min = slope_min;
+        state->slope_max = slope_max;
+        state->held = *data;
+        return n;
+    }
+
+    // The doors crossed: no line from the stored reading covers this one, the previous reading ends the segment
+    n += close_door(state, &out[n]);
+    if (data->ts > state->stored.ts) {
+        open_door(state, data, position);
+    } else {
+        state->stored = out[n++] = *data;
+    }
+    return n;
+}
+
+static size_t deadband(compress_state_t *state, const sensor_data_t *data, sensor_data_t *out) {
+    double change = data->value - state->stored.value;
+    if (change <= state->rule.epsilon && -change <= state->rule.epsilon &&
+        (state->rule.keepalive == 0 || data->ts - state->stored.ts < state->rule.keepalive)) {
+        return 0;
+    }
+    state->stored = *out = *data;
+    return 1;
+}
+
+size_t compress_batch(const sensor_data_t *readings, size_t count, sensor_data_t *out) {
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        const sensor_data_t *data = &readings[i];
+        compress_state_t *state = find_state(data->id);
+        if (state == NULL || state->rule.mode == COMPRESS_OFF) {
+            out[n++] = *data;
+        } else if (!state->started) {
+            // The first reading of a sensor is always stored
+            state->started = true;
+            state->stored = out[n++] = *data;
+        } else if (state->rule.mode == COMPRESS_DEADBAND) {
+            n += deadband(state, data, &out[n]);
+        } else {
+            n += swinging_door(state, data, readings_in + i, &out[n]);
+        }
+    }
+    readings_in += count;
+    readings_out += n;
+    return n;
+}
+
+size_t compress_drain(sensor_data_t *out, size_t max) {
+    size_t n = 0;
+    for (size_t i = 0; states != NULL && i <= state_mask && n < max; i++) {
+        if (states[i].used) n += close_door(&states[i], &out[n]);
+    }
+    readings_out += n;
+    return n;
+}
+
+uint64_t compress_pending_from(void) {
+    uint64_t oldest = readings_in;
+    for (size_t i = 0; states != NULL && i <= state_mask; i++) {
+        if (states[i].used && states[i].holding && states[i].door_from < oldest) oldest = states[i].door_from;
+    }
+    return oldest;
+}
+
+size_t compress_close_before(uint64_t position, sensor_data_t *out, size_t max) {
+    size_t n = 0;
+    for (size_t i = 0; states != NULL && i <= state_mask && n < max; i++) {
+        if (states[i].used && states[i].holding && states[i].door_from < position) n += close_door(&states[i], &out[n]);
+    }
+    readings_out += n;
+    return n;
+}
+
+void compress_counts(uint64_t *readings, uint64_t *stored) {
+    *readings = readings_in;
+    *stored = readings_out;
+}
+
+void compress_free(void) {
+    free(states);
+    free(rules);
+    states = NULL;
+    rules = NULL;
+    state_mask = state_count = rule_count = 0;
+    readings_in = readings_out = 0;
+}
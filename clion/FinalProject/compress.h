@@ -0,0 +1,66 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+#define COMPRESS_SUCCESS 0
+#define COMPRESS_FAILURE -1
+
+// Default seconds after which a reading is stored even if it adds nothing, so a quiet sensor still shows up
+#ifndef COMPRESS_KEEPALIVE
+#define COMPRESS_KEEPALIVE 300
+#endif
+
+typedef enum {
+    COMPRESS_OFF,               // store every reading
+    COMPRESS_DEADBAND,          // store a reading that differs more than epsilon from the last stored one
+    COMPRESS_SWINGING_DOOR      // store the points of a line that stays within epsilon of every reading
+} compress_mode_t;
+
+// Compression of one sensor. Reconstruct deadband by holding the last stored value and swinging door by
+// interpolating between stored readings, either way no reading is further than epsilon off.
+typedef struct compress_rule {
+    compress_mode_t mode;
+    double epsilon;
+    sensor_ts_t keepalive;      // 0 disables keep-alive points
+} compress_rule_t;
+
+// Parse "<off|deadband|swing>[:epsilon[:keepalive]]" into '*rule', keepalive defaults to COMPRESS_KEEPALIVE
+int compress_parse_rule(const char *text, compress_rule_t *rule);
+
+// Set the rule of the sensors that have no line in the compression config
+void compress_set_default(const compress_rule_t *rule);
+
+// Load per-sensor rules from 'path', lines are "default <rule>" or "sensor <id> <rule>" with a rule as above
+// Returns -1 if the file cannot be read or a line is malformed, no rules are changed then.
+int compress_load_config(const char *path);
+
+// Readings that compression holds back, at most twice as many as go in
+#define COMPRESS_OUT_MAX(count) (2 * (count))
+
+// Run 'count' readings through the compression of their sensors and write the ones to store to 'out'
+// A swinging door holds back the last reading of a sensor until the next one shows whether it is needed.
+// Returns the number of readings written to 'out', which has room for COMPRESS_OUT_MAX(count).
+size_t compress_batch(const sensor_data_t *readings, size_t count, sensor_data_t *out);
+
+// Write up to 'max' readings that are held back to 'out', call it until it returns 0 before the storage closes
+size_t compress_drain(sensor_data_t *out, size_t max);
+
+// Input position, counted like the readings of compress_counts(), of the oldest reading that an open swinging
+// door still covers. Every reading before it is stored or dropped for good. Without an open door that is the
+// number of readings that went in.
+uint64_t compress_pending_from(void);
+
+// Close the doors that cover a reading from before input position 'position' and write their held readings to
+// 'out', at most 'max'. Returns the number written, call it until it returns 0.
+size_t compress_close_before(uint64_t position, sensor_data_t *out, size_t max);
+
+// Readings that went in and readings that came out since the start
+void compress_counts(uint64_t *readings, uint64_t *stored);
+
+// Forget the sensor states and rules
+void compress_free(void);
+
+#endif /* _COMPRESS_H_ */
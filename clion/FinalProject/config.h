@@ -6,9 +6,27 @@
 #define _CONFIG_H_
 
 #include <stdint.h>
+#include <inttypes.h>
 #include <time.h>
 
+// Width of a sensor id in bits, 16 or 32. It is part of the wire format between the sensor nodes
+// and the gateway and of the binary sensor_data file, so every program has to be built with the same value.
+#ifndef SENSOR_ID_BITS
+#define SENSOR_ID_BITS 16
+#endif
+
+#if SENSOR_ID_BITS == 32
+typedef uint32_t sensor_id_t;
+#define PRIsensor PRIu32
+#define SENSOR_ID_MAX UINT32_MAX
+#elif SENSOR_ID_BITS == 16
 typedef uint16_t sensor_id_t;
+#define PRIsensor PRIu16
+#define SENSOR_ID_MAX UINT16_MAX
+#else
+#error "SENSOR_ID_BITS has to be 16 or 32"
+#endif
+
 typedef double sensor_value_t;
 typedef time_t sensor_ts_t;         // UTC timestamp as returned by time() - notice that the size of time_t is different on 32/64 bit machine
 
@@ -17,7 +35,6 @@ typedef struct {
     uint16_t room_id;
     sensor_value_t value;
     sensor_ts_t ts;
-    int processed;
 } sensor_data_t;
 
 #endif /* _CONFIG_H_ */
@@ -6,11 +6,16 @@
 #include "connmgr.h"
 #include "lib/tcpsock.h"
 #include "sbuffer.h"
+#include "capture.h"
 #include <unistd.h>
 #include <time.h>
 #include <sys/wait.h>
 
 #define BUFFER_SIZE 1024
+// Bytes taken from a connection at once, the readings in them are inserted as soon as they are complete
+#define RECEIVE_BUFFER_BYTES 4096
+// A reading on the wire: <sensor id><value><timestamp>, no padding
+#define WIRE_BYTES (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
 
 static int log_pipe[2];
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -120,6 +125,7 @@ typedef struct connmgr_state {
     tcpsock_t *server_socket;
     int max_connections;
     int conn_counter;
+    uint32_t connection_ids;    // last id handed out, captures tell the connections apart by it
     pthread_mutex_t conn_mutex;
     int server_running;
 } connmgr_state_t;
@@ -136,6 +142,7 @@ int connmgr_init(int port, int max_clients, sbuffer_t *buffer) {
 
     state.max_connections = max_clients;
     state.conn_counter = 0;
+    state.connection_ids = 0;
     state.server_running = 1;
     pthread_mutex_init(&state.conn_mutex, NULL);
     shared_buffer = buffer;
@@ -156,53 +163,67 @@ void connmgr_cleanup() {
 void *handle_client(void *arg) {
     tcpsock_t *client = (tcpsock_t *)arg;
     sensor_data_t data = {0};
-    int bytes, result;
+    int result;
     int first_message = 1;
+    int insert_failed = 0;
+    unsigned int duplicates = 0;
     char log_msg[256];
+    char buffer[RECEIVE_BUFFER_BYTES];
+    size_t buffered = 0;
 
-    do {
-        // Receive Sensor ID
-        bytes = sizeof(data.id);
-        result = tcp_receive(client, (void *)&data.id, &bytes);
-        if (result != TCP_NO_ERROR || bytes == 0) break;
-
-        // Receive Sensor Value
-        bytes = sizeof(data.value);
-        result = tcp_receive(client, (void *)&data.value, &bytes);
-        if (result != TCP_NO_ERROR || bytes == 0) break;
-
-        // Receive Sensor Timestamp
-        bytes = sizeof(data.ts);
-        result = tcp_receive(client, (void *)&data.ts, &bytes);
-        if (result != TCP_NO_ERROR || bytes == 0) break;
-
-        snprintf(log_msg, sizeof(log_msg),
-                 "handle_client: Received data - Sensor ID = %" PRIu16 ", Value = %.2f, Timestamp = %ld",
-                 data.id, data.value, (long int)data.ts);
-        write_log(log_msg);
+    pthread_mutex_lock(&state.conn_mutex);
+    uint32_t connection_id = ++state.connection_ids;
+    pthread_mutex_unlock(&state.conn_mutex);
 
-        if (first_message) {
-            snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIu16 " has opened a new connection", data.id);
+    do {
+        // Whatever the node sent so far, a reading can be split over two receives
+        int bytes = (int)(sizeof(buffer) - buffered);
+        result = tcp_receive(client, buffer + buffered, &bytes);
+        if (result != TCP_NO_ERROR) break;
+        capture_chunk(connection_id, buffer + buffered, bytes);
+        buffered += bytes;
+
+        size_t offset = 0;
+        for (; !insert_failed && buffered - offset >= WIRE_BYTES; offset += WIRE_BYTES) {
+            // Sent in this order: <sensor_id><temperature><timestamp>
+            memcpy(&data.id, buffer + offset, sizeof(data.id));
+            memcpy(&data.value, buffer + offset + sizeof(data.id), sizeof(data.value));
+            memcpy(&data.ts, buffer + offset + sizeof(data.id) + sizeof(data.value), sizeof(data.ts));
+
+            snprintf(log_msg, sizeof(log_msg),
+                     "handle_client: Received data - Sensor ID = %" PRIsensor ", Value = %.2f, Timestamp = %ld",
+                     data.id, data.value, (long int)data.ts);
             write_log(log_msg);
-            first_message = 0;
-        }
 
-        sensor_data_t local_data = {0};
-        local_data.id = data.id;
-        local_data.value = data.value;
-        local_data.ts = data.ts;
-        local_data.processed = 0;
+            if (first_message) {
+                snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIsensor " has opened a new connection", data.id);
+                write_log(log_msg);
+                first_message = 0;
+            }
 
-        // Insert data into the shared buffer
-        if (sbuffer_insert(shared_buffer, &local_data) != SBUFFER_SUCCESS) {
-            write_log("handle_client: Failed to insert data into shared buffer");
-            break;
+            // Insert data into the shared buffer
+            int insert_result = sbuffer_insert(shared_buffer, &data);
+            if (insert_result == SBUFFER_DUPLICATE) {
+                duplicates++;
+            } else if (insert_result != SBUFFER_SUCCESS) {
+                write_log("handle_client: Failed to insert data into shared buffer");
+                insert_failed = 1;
+            }
         }
-    } while (1);
+        memmove(buffer, buffer + offset, buffered - offset);
+        buffered -= offset;
+    } while (!insert_failed);
+    capture_chunk(connection_id, NULL, 0);
+
+    if (duplicates > 0) {
+        snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIsensor " resent %u readings that were dropped as duplicates",
+                 data.id, duplicates);
+        write_log(log_msg);
+    }
 
     // Handle connection closure or error
     if (result == TCP_CONNECTION_CLOSED) {
-        snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIu16 " has closed the connection", data.id);
+        snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIsensor " has closed the connection", data.id);
         write_log(log_msg);
     } else {
         write_log("handle_client: Connection error occurred");
@@ -0,0 +1,69 @@
+#include "csvfmt.h"
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+// Values up to this are formatted here, a hundred times them is still far below 2^53
+#define FIXED2_FAST_LIMIT 1e13
+
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+size_t csvfmt_uint(char *out, uint64_t value) {
+    char digits[20];
+    char *p = digits + sizeof(digits);
+    while (value >= 100) {
+        unsigned int pair = (unsigned int)(value % 100);
+        value /= 100;
+        p -= 2;
+        memcpy(p, &digit_pairs[2 * pair], 2);
+    }
+    if (value >= 10) {
+        p -= 2;
+        memcpy(p, &digit_pairs[2 * value], 2);
+    } else {
+        *--p = (char)('0' + value);
+    }
+    size_t length = digits + sizeof(digits) - p;
+    memcpy(out, p, length);
+    return length;
+}
+
+size_t csvfmt_int(char *out, int64_t value) {
+    if (value >= 0) return csvfmt_uint(out, (uint64_t)value);
+    *out = '-';
+    return 1 + csvfmt_uint(out + 1, 0 - (uint64_t)value);
+}
+
+size_t csvfmt_fixed2(char *out, double value) {
+    double magnitude = fabs(value);
+    if (!(magnitude < FIXED2_FAST_LIMIT)) return (size_t)snprintf(out, CSVFMT_FIXED2_MAX, "%.2f", value);
+
+    // Cents: the product is off by at most half an ulp, so only a fraction close to .5 can round the wrong way.
+    // printf rounds the exact binary value, which snprintf is left to do for those.
+    double cents = magnitude * 100;
+    double whole = floor(cents);
+    double fraction = cents - whole;
+    if (fabs(fraction - 0.5) <= cents * 0x1p-50) return (size_t)snprintf(out, CSVFMT_FIXED2_MAX, "%.2f", value);
+    uint64_t rounded = (uint64_t)whole + (fraction > 0.5);
+
+    // "-0.00" for negative values that round to zero, as printf writes
+    size_t length = 0;
+    if (signbit(value)) out[length++] = '-';
+    length += csvfmt_uint(out + length, rounded / 100);
+    out[length++] = '.';
+    memcpy(out + length, &digit_pairs[2 * (rounded % 100)], 2);
+    return length + 2;
+}
+
+size_t csvfmt_reading(char *out, sensor_id_t id, sensor_value_t value, sensor_ts_t ts) {
+    size_t length = csvfmt_uint(out, id);
+    out[length++] = ',';
+    length += csvfmt_fixed2(out + length, value);
+    out[length++] = ',';
+    length += csvfmt_int(out + length, (int64_t)ts);
+    out[length++] = '\n';
+    return length;
+}
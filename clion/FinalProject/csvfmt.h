@@ -0,0 +1,28 @@
+#ifndef _CSVFMT_H_
+#define _CSVFMT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+// Room that csvfmt_fixed2() needs, "%.2f" of the largest double takes 313 characters
+#define CSVFMT_FIXED2_MAX 320
+
+// Room that csvfmt_reading() needs
+#define CSVFMT_LINE_MAX 400
+
+// Write 'value' in decimal, returns the number of characters written (at most 20)
+size_t csvfmt_uint(char *out, uint64_t value);
+
+// Same for a signed value (at most 20 characters)
+size_t csvfmt_int(char *out, int64_t value);
+
+// Write 'value' as "%.2f" does in the C locale into CSVFMT_FIXED2_MAX characters, returns the number written
+// Values that are too large, not finite or too close to halfway between two cents go through snprintf.
+size_t csvfmt_fixed2(char *out, double value);
+
+// Write a data.csv line "<id>,<value>,<ts>\n", byte for byte what "%u,%.2f,%ld\n" gives
+// 'out' needs room for CSVFMT_LINE_MAX characters. Returns the length of the line.
+size_t csvfmt_reading(char *out, sensor_id_t id, sensor_value_t value, sensor_ts_t ts);
+
+#endif /* _CSVFMT_H_ */
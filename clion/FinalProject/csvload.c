@@ -0,0 +1,631 @@
+#define _GNU_SOURCE
+#include "csvload.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CSVLOAD_X86
+#endif
+
+#define CSV_HEADER "SensorID,"
+#define DIGITS_MAX 800              // enough to round any double, later digits only matter if they are not all 0
+#define BIG_LIMBS 128               // 4096 bits, a value of DIGITS_MAX digits scaled to the double range fits
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define CSVLOAD_SWAR
+#define ZEROS 0x3030303030303030ULL
+#endif
+
+// Bit i of the result is set if block[i] is a comma or a newline, for 64 bytes
+typedef uint64_t (*delimiters_t)(const char *block);
+
+// A chunk is parsed into a slot, slots are handed to the caller in chunk order
+typedef struct slot {
+    bool ready;
+    size_t index;               // of the chunk in the slot
+    int result;
+    sensor_data_t *readings;
+    size_t count;
+    size_t capacity;
+    uint64_t lines;
+    uint64_t malformed;
+} slot_t;
+
+typedef struct load {
+    const char *data;
+    size_t size;
+    size_t chunk_count;
+    delimiters_t delimiters;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t next_chunk;          // to be claimed by a thread
+    size_t delivered;           // chunks that the caller is done with
+    bool stopping;
+    slot_t *slots;
+    size_t slot_count;
+} load_t;
+
+static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+                                       1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19,
+                                       1e20, 1e21, 1e22};
+
+static uint64_t delimiters_scalar(const char *block) {
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; i++) mask |= (uint64_t)(block[i] == ',' || block[i] == '\n') << i;
+    return mask;
+}
+
+#ifdef CSVLOAD_X86
+__attribute__((target("sse2")))
+static uint64_t delimiters_sse2(const char *block) {
+    const __m128i comma = _mm_set1_epi8(','), newline = _mm_set1_epi8('\n');
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(block + 16 * i));
+        __m128i found = _mm_or_si128(_mm_cmpeq_epi8(bytes, comma), _mm_cmpeq_epi8(bytes, newline));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(found) << (16 * i);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+static uint64_t delimiters_avx2(const char *block) {
+    const __m256i comma = _mm256_set1_epi8(','), newline = _mm256_set1_epi8('\n');
+    __m256i low = _mm256_loadu_si256((const __m256i *)block);
+    __m256i high = _mm256_loadu_si256((const __m256i *)(block + 32));
+    __m256i found_low = _mm256_or_si256(_mm256_cmpeq_epi8(low, comma), _mm256_cmpeq_epi8(low, newline));
+    __m256i found_high = _mm256_or_si256(_mm256_cmpeq_epi8(high, comma), _mm256_cmpeq_epi8(high, newline));
+    return (uint64_t)(uint32_t)_mm256_movemask_epi8(found_low) |
+           (uint64_t)(uint32_t)_mm256_movemask_epi8(found_high) << 32;
+}
+#endif
+
+static delimiters_t pick_delimiters(const char **name) {
+#ifdef CSVLOAD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return delimiters_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *name = "sse2";
+        return delimiters_sse2;
+    }
+#endif
+    *name = "scalar";
+    return delimiters_scalar;
+}
+
+const char *csvload_simd(void) {
+    const char *name;
+    pick_delimiters(&name);
+    return name;
+}
+
+// Up to 19 decimal digits, nothing else
+static bool parse_digits(const char *p, const char *end, uint64_t *value) {
+    if (p == end || end - p > 19) return false;
+    uint64_t v = 0;
+    for (; p < end; p++) {
+        unsigned int digit = (unsigned char)*p - '0';
+        if (digit > 9) return false;
+        v = v * 10 + digit;
+    }
+    *value = v;
+    return true;
+}
+
+static bool parse_integer(const char *p, const char *end, int64_t *value) {
+    bool negative = p < end && *p == '-';
+    uint64_t magnitude;
+    if (!parse_digits(p + negative, end, &magnitude) || magnitude > (uint64_t)INT64_MAX) return false;
+    *value = negative ? -(int64_t)magnitude : (int64_t)magnitude;
+    return true;
+}
+
+// Unsigned integer of up to BIG_LIMBS 32 bit limbs, the least significant first
+typedef struct big {
+    int size;
+    uint32_t limb[BIG_LIMBS];
+} big_t;
+
+static void big_multiply(big_t *big, uint32_t factor, uint32_t add) {
+    uint64_t carry = add;
+    for (int i = 0; i < big->size; i++) {
+        carry += (uint64_t)big->limb[i] * factor;
+        big->limb[i] = (uint32_t)carry;
+        carry >>= 32;
+    }
+    if (carry != 0) big->limb[big->size++] = (uint32_t)carry;
+}
+
+static void big_power_of_ten(big_t *big, int exponent) {
+    for (; exponent >= 9; exponent -= 9) big_multiply(big, 1000000000, 0);
+    big_multiply(big, (uint32_t)powers_of_ten[exponent], 0);
+}
+
+static int big_bits(const big_t *big) {
+    return big->size == 0 ? 0 : 32 * (big->size - 1) + 32 - __builtin_clz(big->limb[big->size - 1]);
+}
+
+static void big_shift_left(big_t *big, int bits) {
+    int limbs = bits / 32;
+    bits %= 32;
+    big->limb[big->size] = 0;
+    for (int i = big->size; i >= 0; i--) {
+        uint32_t low = (bits && i > 0) ? big->limb[i - 1] >> (32 - bits) : 0;
+        big->limb[i + limbs] = (big->limb[i] << bits) | low;
+    }
+    for (int i = 0; i < limbs; i++) big->limb[i] = 0;
+    big->size += limbs + 1;
+    while (big->size > 0 && big->limb[big->size - 1] == 0) big->size--;
+}
+
+static void big_shift_right_one(big_t *big) {
+    for (int i = 0; i < big->size; i++) {
+        big->limb[i] = (big->limb[i] >> 1) | (i + 1 < big->size ? big->limb[i + 1] << 31 : 0);
+    }
+    if (big->size > 0 && big->limb[big->size - 1] == 0) big->size--;
+}
+
+static int big_compare(const big_t *x, const big_t *y) {
+    if (x->size != y->size) return x->size < y->size ? -1 : 1;
+    for (int i = x->size - 1; i >= 0; i--) {
+        if (x->limb[i] != y->limb[i]) return x->limb[i] < y->limb[i] ? -1 : 1;
+    }
+    return 0;
+}
+
+// x -= y, with x >= y
+static void big_subtract(big_t *x, const big_t *y) {
+    int64_t borrow = 0;
+    for (int i = 0; i < x->size; i++) {
+        int64_t difference = (int64_t)x->limb[i] - (i < y->size ? y->limb[i] : 0) - borrow;
+        borrow = difference < 0;
+        x->limb[i] = (uint32_t)(difference + (borrow << 32));
+    }
+    while (x->size > 0 && x->limb[x->size - 1] == 0) x->size--;
+}
+
+// The double nearest to 'bits' * 2^exponent, plus a little more if 'inexact', ties to even. 'bits' is not 0 and
+// has more than 54 significant bits whenever 'inexact' is set.
+static double round_binary(uint64_t bits, int exponent, bool inexact) {
+    int top = 63 - __builtin_clzll(bits) + exponent;
+    if (top > 1023) return INFINITY;
+    int last = top - 52 < -1074 ? -1074 : top - 52;       // exponent of the last bit that fits
+    int drop = last - exponent;
+    uint64_t mantissa;
+    if (drop <= 0) {
+        mantissa = bits << -drop;
+    } else if (drop > 64) {
+        return 0;
+    } else {
+        mantissa = drop == 64 ? 0 : bits >> drop;
+        bool half = (bits >> (drop - 1)) & 1;
+        bool rest = inexact || (drop > 1 && (bits & ((1ULL << (drop - 1)) - 1)) != 0);
+        if (half && (rest || (mantissa & 1))) mantissa++;
+    }
+    // The exponent field counts from the last bit, a mantissa of 2^53 carries into it
+    uint64_t pattern = ((uint64_t)(last + 1074) << 52) + mantissa;
+    if (pattern >= 0x7FF0000000000000ULL) return INFINITY;
+    double value;
+    memcpy(&value, &pattern, sizeof(value));
+    return value;
+}
+
+// Exact conversion of 'count' decimal digits times 10^exponent, with big integers
+static double decimal_value(const unsigned char *digits, int count, int exponent) {
+    if (count + exponent > 310) return INFINITY;
+    if (count + exponent < -324) return 0;
+    big_t number = {0};
+    for (int i = 0; i < count; i++) big_multiply(&number, 10, digits[i]);
+    if (number.size == 0) return 0;
+
+    if (exponent >= 0) {
+        big_power_of_ten(&number, exponent);
+        int bits = big_bits(&number);
+        if (bits <= 64) {
+            uint64_t value = number.limb[0] | (number.size > 1 ? (uint64_t)number.limb[1] << 32 : 0);
+            return round_binary(value, 0, false);
+        }
+        // The top 64 bits, anything below them only makes it inexact
+        int shift = bits - 64;
+        bool inexact = false;
+        for (int i = 0; i < shift / 32; i++) inexact |= number.limb[i] != 0;
+        if (shift % 32 != 0) inexact |= (number.limb[shift / 32] & ((1U << (shift % 32)) - 1)) != 0;
+        uint64_t value = 0;
+        for (int bit = 63; bit >= 0; bit--) {
+            int at = shift + bit;
+            value |= (uint64_t)((number.limb[at / 32] >> (at % 32)) & 1) << bit;
+        }
+        return round_binary(value, shift, inexact);
+    }
+
+    // Divide, scaled so that the quotient has 63 or 64 bits, one bit at a time
+    big_t divisor = {.size = 1, .limb = {1}};
+    big_power_of_ten(&divisor, -exponent);
+    int scale = big_bits(&divisor) - big_bits(&number) + 63;
+    if (scale > 0) {
+        big_shift_left(&number, scale);
+    } else if (scale < 0) {
+        big_shift_left(&divisor, -scale);
+    }
+    big_shift_left(&divisor, 63);
+    uint64_t quotient = 0;
+    for (int bit = 63; bit >= 0; bit--) {
+        if (big_compare(&number, &divisor) >= 0) {
+            big_subtract(&number, &divisor);
+            quotient |= 1ULL << bit;
+        }
+        big_shift_right_one(&divisor);
+    }
+    return round_binary(quotient, -scale, number.size != 0);
+}
+
+static bool same_word(const char *p, const char *end, const char *word) {
+    size_t length = strlen(word);
+    if ((size_t)(end - p) != length) return false;
+    for (size_t i = 0; i < length; i++) {
+        if ((p[i] | 0x20) != word[i]) return false;
+    }
+    return true;
+}
+
+// A decimal number with an optional exponent, "inf", "infinity" or "nan", rounded the way strtod() rounds it.
+// A mantissa of at most 19 digits and 2^53 with a power of ten up to 10^22 is the product or quotient of two
+// exact doubles, which rounds correctly on its own. Anything else is converted exactly with big integers.
+static bool parse_value(const char *p, const char *end, double *value) {
+    bool negative = p < end && *p == '-';
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    if (p < end && ((*p | 0x20) == 'i' || (*p | 0x20) == 'n')) {
+        if (same_word(p, end, "inf") || same_word(p, end, "infinity")) {
+            *value = negative ? -INFINITY : INFINITY;
+        } else if (same_word(p, end, "nan")) {
+            *value = negative ? -NAN : NAN;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    unsigned char digits[DIGITS_MAX + 1];
+    int count = 0, exponent = 0;
+    bool point = false, any = false, dropped = false;
+    for (; p < end; p++) {
+        unsigned int digit = (unsigned char)*p - '0';
+        if (digit <= 9) {
+            any = true;
+            if (count == 0 && digit == 0) {
+                exponent -= point;
+            } else if (count < DIGITS_MAX) {
+                digits[count++] = digit;
+                exponent -= point;
+            } else {
+                dropped |= digit != 0;
+                exponent += !point;
+            }
+        } else if (*p == '.' && !point) {
+            point = true;
+        } else {
+            break;
+        }
+    }
+    if (!any) return false;
+    if (p < end && (*p | 0x20) == 'e') {
+        bool exponent_negative = p + 1 < end && p[1] == '-';
+        p += 1 + (p + 1 < end && (p[1] == '-' || p[1] == '+'));
+        if (p == end) return false;
+        int written = 0;
+        for (; p < end && (unsigned int)((unsigned char)*p - '0') <= 9; p++) {
+            if (written < 100000) written = written * 10 + (*p - '0');
+        }
+        exponent += exponent_negative ? -written : written;
+    }
+    if (p != end) return false;
+
+    uint64_t mantissa = 0;
+    for (int i = 0; i < count && i < 19; i++) mantissa = mantissa * 10 + digits[i];
+    double v;
+    if (count == 0) {
+        v = 0;
+    } else if (count <= 19 && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22) {
+        v = (double)mantissa;
+        v = exponent < 0 ? v / powers_of_ten[-exponent] : v * powers_of_ten[exponent];
+    } else {
+        // Digits past DIGITS_MAX that are not all 0 put the value just above the ones that were kept
+        if (dropped) {
+            digits[count++] = 1;
+            exponent--;
+        }
+        v = decimal_value(digits, count, exponent);
+    }
+    *value = negative ? -v : v;
+    return true;
+}
+
+#ifdef CSVLOAD_SWAR
+// The 'length' (1 to 8) characters before 'end' as digit values in the top bytes, the first one lowest, with
+// zeros below them. Characters that are not digits come out above 9.
+static inline uint64_t digits_before(const char *end, unsigned int length) {
+    uint64_t word;
+    memcpy(&word, end - 8, sizeof(word));
+    return (word ^ ZEROS) & (~0ULL << (64 - 8 * length));
+}
+
+// The high bit of every byte above 9
+static inline uint64_t non_digits(uint64_t bytes) {
+    return ((bytes + 0x7676767676767676ULL) | bytes) & 0x8080808080808080ULL;
+}
+
+// Eight digit values, the most significant in the lowest byte, as a number
+static inline uint64_t digits_value(uint64_t bytes) {
+    bytes = bytes * 10 + (bytes >> 8);
+    return (((bytes & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+            (((bytes >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+}
+
+// A line as csvfmt writes it: an id of up to 8 digits, a value with two decimals of up to 8 characters and a
+// timestamp of 9 to 16 digits, converted 8 characters at a time. Anything else is left to parse_line().
+// The line starts at least 8 bytes into the file, so every load stays inside it.
+static inline bool swar_line(const char *line, const char *first, const char *second, const char *eol,
+                             sensor_data_t *reading) {
+    unsigned int id_length = (unsigned int)(first - line);
+    bool negative = first[1] == '-';
+    unsigned int value_length = (unsigned int)(second - first - 1 - negative);
+    bool ts_negative = second[1] == '-';
+    unsigned int ts_length = (unsigned int)(eol - second - 1 - ts_negative);
+    if (id_length - 1 > 7 || value_length - 4 > 4 || second[-3] != '.' || ts_length - 9 > 7) return false;
+
+    // The point is byte 5 of the value, the digits before it move up into its place
+    uint64_t id = digits_before(first, id_length);
+    uint64_t value = digits_before(second, value_length);
+    value = ((value & 0x000000FFFFFFFFFFULL) << 8) | (value & 0xFFFF000000000000ULL);
+    uint64_t ts_low = digits_before(eol, 8);
+    uint64_t ts_high = digits_before(eol - 8, ts_length - 8);
+    if ((non_digits(id) | non_digits(value) | non_digits(ts_low) | non_digits(ts_high)) != 0) return false;
+
+    // At most 7 digits, so the division rounds like parse_value()
+    uint64_t sensor = digits_value(id);
+    double v = (double)digits_value(value) / 100;
+    uint64_t ts = digits_value(ts_high) * 100000000 + digits_value(ts_low);
+    reading->id = (sensor_id_t)sensor;
+    reading->room_id = 0;
+    reading->value = negative ? -v : v;
+    reading->ts = ts_negative ? -(sensor_ts_t)ts : (sensor_ts_t)ts;
+    return sensor <= SENSOR_ID_MAX;
+}
+#endif
+
+// A line from 'line' up to the newline at 'eol', with the first two commas at 'commas'
+// There is room for one more reading in the slot.
+static void parse_line(slot_t *slot, const char *line, const char *const *commas, int comma_count, const char *eol) {
+    if (eol > line && eol[-1] == '\r') eol--;
+    if (eol == line) return;
+    slot->lines++;
+
+    uint64_t id;
+    int64_t ts;
+    sensor_data_t *reading = &slot->readings[slot->count];
+    if (comma_count != 2 || !parse_digits(line, commas[0], &id) || id > SENSOR_ID_MAX ||
+        !parse_value(commas[0] + 1, commas[1], &reading->value) || !parse_integer(commas[1] + 1, eol, &ts)) {
+        slot->malformed++;
+        return;
+    }
+    reading->id = (sensor_id_t)id;
+    reading->room_id = 0;
+    reading->ts = (sensor_ts_t)ts;
+    slot->count++;
+}
+
+// Start of the first line that begins at or after 'offset'
+static size_t line_start(const load_t *load, size_t offset) {
+    if (offset == 0) return 0;
+    if (offset >= load->size) return load->size;
+    const char *newline = memchr(load->data + offset - 1, '\n', load->size - offset + 1);
+    return newline ? (size_t)(newline - load->data) + 1 : load->size;
+}
+
+static int parse_chunk(const load_t *load, size_t index, slot_t *slot) {
+    const char *p = load->data + line_start(load, index * (size_t)CSVLOAD_CHUNK_BYTES);
+    const char *end = load->data + line_start(load, (index + 1) * (size_t)CSVLOAD_CHUNK_BYTES);
+    slot->count = 0;
+    slot->lines = 0;
+    slot->malformed = 0;
+#ifdef MADV_POPULATE_READ
+    // Map the pages of the chunk at once instead of taking a fault every few pages
+    uintptr_t page = (uintptr_t)p & ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1);
+    madvise((void *)page, (uintptr_t)end - page, MADV_POPULATE_READ);
+#endif
+    if (p == load->data && (size_t)(end - p) >= strlen(CSV_HEADER) && memcmp(p, CSV_HEADER, strlen(CSV_HEADER)) == 0) {
+        const char *newline = memchr(p, '\n', end - p);
+        p = newline ? newline + 1 : end;
+    }
+
+    // The delimiters of 64 bytes at a time come out as a bit mask, the lines are cut at its set bits
+    const char *line = p;
+    const char *commas[4] = {NULL, NULL, NULL, NULL};
+    int comma_count = 0;
+    sensor_data_t *readings = slot->readings;
+    size_t count = 0;
+    uint64_t lines = 0;         // of the readings that took the fast path
+    for (const char *block = p; block < end; block += 64) {
+        // A newline ends at most one reading, so there is room for the readings of a block up front
+        if (count + 64 > slot->capacity) {
+            size_t capacity = slot->capacity ? slot->capacity * 2 : 4096;
+            readings = realloc(slot->readings, capacity * sizeof(sensor_data_t));
+            if (readings == NULL) return CSVLOAD_FAILURE;
+            slot->readings = readings;
+            slot->capacity = capacity;
+        }
+        uint64_t mask;
+        if (end - block >= 64) {
+            mask = load->delimiters(block);
+        } else {
+            mask = 0;
+            for (int i = 0; i < end - block; i++) mask |= (uint64_t)(block[i] == ',' || block[i] == '\n') << i;
+        }
+        while (mask != 0) {
+            const char *delimiter = block + __builtin_ctzll(mask);
+            mask &= mask - 1;
+            if (*delimiter == ',') {
+                commas[comma_count] = delimiter;
+                comma_count += comma_count < 3;
+                continue;
+            }
+#ifdef CSVLOAD_SWAR
+            if (comma_count == 2 && line - load->data >= 8 &&
+                swar_line(line, commas[0], commas[1], delimiter, &readings[count])) {
+                count++;
+                lines++;
+                line = delimiter + 1;
+                comma_count = 0;
+                continue;
+            }
+#endif
+            slot->count = count;
+            parse_line(slot, line, commas, comma_count, delimiter);
+            count = slot->count;
+            line = delimiter + 1;
+            comma_count = 0;
+        }
+    }
+    slot->count = count;
+    slot->lines += lines;
+
+    // The last line of the file may not end in a newline
+    if (line < end) parse_line(slot, line, commas, comma_count, end);
+    return CSVLOAD_SUCCESS;
+}
+
+static void *load_worker(void *arg) {
+    load_t *load = arg;
+    pthread_mutex_lock(&load->lock);
+    while (true) {
+        // A thread stays at most slot_count chunks ahead of the caller, that bounds the memory
+        while (!load->stopping && load->next_chunk < load->chunk_count &&
+               load->next_chunk >= load->delivered + load->slot_count) {
+            pthread_cond_wait(&load->cond, &load->lock);
+        }
+        if (load->stopping || load->next_chunk >= load->chunk_count) break;
+        size_t index = load->next_chunk++;
+        slot_t *slot = &load->slots[index % load->slot_count];
+        pthread_mutex_unlock(&load->lock);
+
+        int result = parse_chunk(load, index, slot);
+
+        pthread_mutex_lock(&load->lock);
+        slot->index = index;
+        slot->result = result;
+        slot->ready = true;
+        pthread_cond_broadcast(&load->cond);
+    }
+    pthread_mutex_unlock(&load->lock);
+    return NULL;
+}
+
+// Hand a parsed chunk to the caller
+static int deliver(slot_t *slot, csvload_callback_t callback, void *arg, csvload_stats_t *stats) {
+    if (slot->result != CSVLOAD_SUCCESS) return CSVLOAD_FAILURE;
+    stats->lines += slot->lines;
+    stats->readings += slot->count;
+    stats->malformed += slot->malformed;
+    if (slot->count > 0 && callback(slot->readings, slot->count, arg) != 0) return CSVLOAD_STOPPED;
+    return CSVLOAD_SUCCESS;
+}
+
+static int load_parallel(load_t *load, unsigned int threads, csvload_callback_t callback, void *arg,
+                         csvload_stats_t *stats) {
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    if (workers == NULL) return CSVLOAD_FAILURE;
+    pthread_mutex_init(&load->lock, NULL);
+    pthread_cond_init(&load->cond, NULL);
+    unsigned int started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, load_worker, load) == 0) started++;
+
+    int result = started > 0 ? CSVLOAD_SUCCESS : CSVLOAD_FAILURE;
+    for (size_t index = 0; index < load->chunk_count && result == CSVLOAD_SUCCESS; index++) {
+        slot_t *slot = &load->slots[index % load->slot_count];
+        pthread_mutex_lock(&load->lock);
+        while (!slot->ready || slot->index != index) pthread_cond_wait(&load->cond, &load->lock);
+        pthread_mutex_unlock(&load->lock);
+
+        result = deliver(slot, callback, arg, stats);
+
+        pthread_mutex_lock(&load->lock);
+        slot->ready = false;
+        load->delivered++;
+        pthread_cond_broadcast(&load->cond);
+        pthread_mutex_unlock(&load->lock);
+    }
+
+    pthread_mutex_lock(&load->lock);
+    load->stopping = true;
+    pthread_cond_broadcast(&load->cond);
+    pthread_mutex_unlock(&load->lock);
+    for (unsigned int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&load->lock);
+    pthread_cond_destroy(&load->cond);
+    free(workers);
+    return result;
+}
+
+int csvload_file(const char *path, unsigned int threads, csvload_callback_t callback, void *arg, csvload_stats_t *stats) {
+    csvload_stats_t unused;
+    if (stats == NULL) stats = &unused;
+    memset(stats, 0, sizeof(csvload_stats_t));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return CSVLOAD_FAILURE;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return CSVLOAD_FAILURE;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return CSVLOAD_SUCCESS;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return CSVLOAD_FAILURE;
+    posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    const char *name;
+    load_t load = {.data = data, .size = st.st_size, .delimiters = pick_delimiters(&name)};
+    load.chunk_count = (load.size + CSVLOAD_CHUNK_BYTES - 1) / CSVLOAD_CHUNK_BYTES;
+    stats->bytes = load.size;
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned int)cpus : 1;
+    }
+    if (threads > load.chunk_count) threads = (unsigned int)load.chunk_count;
+    load.slot_count = threads > 1 ? 2 * (size_t)threads : 1;
+    load.slots = calloc(load.slot_count, sizeof(slot_t));
+
+    int result = CSVLOAD_FAILURE;
+    if (load.slots != NULL && threads > 1) {
+        result = load_parallel(&load, threads, callback, arg, stats);
+    } else if (load.slots != NULL) {
+        result = CSVLOAD_SUCCESS;
+        for (size_t index = 0; index < load.chunk_count && result == CSVLOAD_SUCCESS; index++) {
+            load.slots[0].result = parse_chunk(&load, index, &load.slots[0]);
+            result = deliver(&load.slots[0], callback, arg, stats);
+        }
+    }
+
+    for (size_t i = 0; load.slots != NULL && i < load.slot_count; i++) free(load.slots[i].readings);
+    free(load.slots);
+    munmap(data, st.st_size);
+    return result;
+}
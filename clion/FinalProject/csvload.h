@@ -0,0 +1,37 @@
+#ifndef _CSVLOAD_H_
+#define _CSVLOAD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+#define CSVLOAD_SUCCESS 0
+#define CSVLOAD_FAILURE -1
+#define CSVLOAD_STOPPED 1       // the callback asked to stop
+
+// Files are parsed in chunks of about this size, at most two chunks per thread are held in memory
+#ifndef CSVLOAD_CHUNK_BYTES
+#define CSVLOAD_CHUNK_BYTES (1 << 20)
+#endif
+
+typedef struct csvload_stats {
+    uint64_t bytes;
+    uint64_t lines;             // without the header and empty lines
+    uint64_t readings;
+    uint64_t malformed;         // lines that were skipped
+} csvload_stats_t;
+
+// Receives the readings of a chunk, in file order. The room id is 0. A non-zero return stops the load.
+typedef int (*csvload_callback_t)(const sensor_data_t *readings, size_t count, void *arg);
+
+// Load a file in the format of data.csv, "<sensor id>,<value>,<timestamp>" lines after an optional header
+// 'threads' parse chunks in parallel (0 for one per CPU), the callback is only called from the calling thread
+// and sees the chunks in file order. Values are decimals with an optional exponent, "inf" or "nan", and come
+// out exactly as strtod() reads them. Malformed lines, hex floats and spaces included, are skipped and counted.
+// 'stats' may be NULL. Returns 0 on success, CSVLOAD_STOPPED or -1 on failure.
+int csvload_file(const char *path, unsigned int threads, csvload_callback_t callback, void *arg, csvload_stats_t *stats);
+
+// Instruction set the parser finds delimiters with on this machine: "avx2", "sse2" or "scalar"
+const char *csvload_simd(void);
+
+#endif /* _CSVLOAD_H_ */
@@ -1,52 +1,552 @@
+#define _POSIX_C_SOURCE 200809L
 #include "datamgr.h"
 #include "connmgr.h"
+#include "alert.h"
+#include "rollup.h"
+#include "anomaly.h"
 #include <inttypes.h>
-#include "lib/dplist.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define RUN_AVG_LENGTH 5
+#define WATCH_POLL_MS 500
+#define DEDUP_SLOTS 8
 
-static dplist_t *sensor_list = NULL;
-static double min_temp = SET_MIN_TEMP;
-static double max_temp = SET_MAX_TEMP;
+// Seconds between two checkpoints of the sensor state
+#ifndef CHECKPOINT_INTERVAL
+#define CHECKPOINT_INTERVAL 30
+#endif
 
-int element_compare(void *x, void *y) {
-    sensor_data_t *sensor_x = (sensor_data_t *)x;
-    sensor_data_t *sensor_y = (sensor_data_t *)y;
-    if (sensor_x->id < sensor_y->id) return -1;
-    if (sensor_x->id > sensor_y->id) return 1;
+#define CHECKPOINT_MAGIC "DMCKPT\0\0"
+#define CHECKPOINT_VERSION 1
+
+// What other threads may read of a sensor, published under the seqlock of its state
+typedef struct sensor_live {
+    sensor_value_t last_value;
+    sensor_value_t avg;
+    sensor_ts_t last_ts;
+    alert_level_t alarm;
+    unsigned int anomalies;
+} sensor_live_t;
+
+// Per-sensor state, shared between consecutive sensor tables so that it
+// survives a reload of the sensor map
+typedef struct sensor_state {
+    sensor_value_t window[RUN_AVG_LENGTH];
+    int window_count;
+    int window_pos;
+    double window_sum;
+    atomic_uint seq;            // odd while the data manager updates the state
+    sensor_live_t live;
+    alert_state_t alert;
+    anomaly_state_t anomaly;
+    rollup_reorder_t reorder;
+    rollup_state_t rollup;
+
+    // Duplicate detection, used by the connection threads under dedup_lock
+    atomic_flag dedup_lock;
+    sensor_ts_t dedup_last_ts;
+    uint32_t dedup_recent[DEDUP_SLOTS];
+    uint32_t dedup_pos;
+    atomic_uint duplicates;
+} sensor_state_t;
+
+// Per-room state, carried over like the sensor state
+typedef struct room_state {
+    atomic_uint seq;
+    rollup_state_t rollup;
+} room_state_t;
+
+typedef struct sensor_entry {
+    sensor_id_t id;
+    uint16_t room_id;
+    alert_rule_t rule;
+    anomaly_rule_t anomaly;
+    sensor_state_t *state;
+    room_state_t *room;
+} sensor_entry_t;
+
+typedef struct room_entry {
+    uint16_t id;
+    room_state_t *state;
+} room_entry_t;
+
+// Slot of the open addressing index over the entries, pos is the entry index + 1 and 0 for an empty slot
+typedef struct table_slot {
+    sensor_id_t id;
+    uint32_t pos;
+} table_slot_t;
+
+// Immutable once published, entries are sorted on sensor id and rooms on room id.
+// Memory per sensor: one sensor_entry_t (80 bytes with 32 bit ids), a sensor_state_t (about 1 KB, most of it
+// the rollup windows) and 2 to 4 index slots of 8 bytes, as the index is kept at most half full.
+typedef struct sensor_table {
+    size_t count;
+    sensor_entry_t *entries;
+    table_slot_t *slots;        // hash index on sensor id for O(1) lookups
+    size_t slot_mask;
+    size_t room_count;
+    room_entry_t *rooms;
+} sensor_table_t;
+
+// Checkpoint file: a header followed by the sensor records sorted on id and the room records sorted on id.
+// Records have a fixed size so that a restore can walk the mapped file in place.
+typedef struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t sensor_size;       // record sizes, a checkpoint of a build with another layout is not restored
+    uint32_t room_size;
+    uint32_t reserved;
+    uint64_t sensor_count;
+    uint64_t room_count;
+    int64_t created;
+    uint64_t checksum;          // of everything after the header
+} checkpoint_header_t;
+
+typedef struct checkpoint_sensor {
+    uint32_t id;
+    int32_t window_count;
+    int32_t window_pos;
+    uint32_t duplicates;
+    sensor_value_t window[RUN_AVG_LENGTH];
+    double window_sum;
+    sensor_live_t live;
+    alert_state_t alert;
+    anomaly_state_t anomaly;
+    rollup_reorder_t reorder;
+    rollup_state_t rollup;
+    sensor_ts_t dedup_last_ts;
+    uint32_t dedup_recent[DEDUP_SLOTS];
+    uint32_t dedup_pos;
+} checkpoint_sensor_t;
+
+typedef struct checkpoint_room {
+    uint32_t id;
+    rollup_state_t rollup;
+} checkpoint_room_t;
+
+// RCU-style publication: readers announce themselves in the counter of the current
+// epoch and never block, the writer swaps the pointer, moves to the next epoch and
+// waits for the counter of the old one to drain before it frees the old table.
+// Readers that come later count in the other counter, they cannot hold up a reload.
+static _Atomic(sensor_table_t *) current_table = NULL;
+static atomic_uint table_epoch = 0;
+static atomic_int table_readers[2];
+static pthread_mutex_t publish_mutex = PTHREAD_MUTEX_INITIALIZER;
+static alert_config_t *alert_config = NULL;
+
+static pthread_t watcher_tid;
+static atomic_int watcher_running = 0;
+static char *watched_path = NULL;
+static char *alert_config_path = NULL;
+
+static pthread_t checkpoint_tid;
+static atomic_int checkpoint_running = 0;
+static pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+static char *checkpoint_path = NULL;
+// Double buffered: a checkpoint is built into one image while the previous one is still written from the other.
+// Builds take turns under the build mutex, writes keep their order under the write mutex.
+static pthread_mutex_t checkpoint_build_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t checkpoint_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char *checkpoint_images[2] = {NULL, NULL};
+static size_t checkpoint_image_sizes[2] = {0, 0};
+static unsigned int checkpoint_next = 0;           // image the next build fills
+
+// Only used by the thread that processes the data
+static rollup_emit_fn rollup_emit = NULL;
+static void *rollup_emit_arg = NULL;
+static rollup_record_t *rollup_queue = NULL;    // emitted while the seqlock was held, handed on after it
+static size_t rollup_queued = 0;
+static size_t rollup_queue_size = 0;
+
+// '*epoch' is set to what sensor_table_release() needs
+static sensor_table_t *sensor_table_acquire(unsigned int *epoch) {
+    *epoch = atomic_load(&table_epoch) & 1;
+    atomic_fetch_add(&table_readers[*epoch], 1);
+    return atomic_load(&current_table);
+}
+
+static void sensor_table_release(unsigned int epoch) {
+    atomic_fetch_sub(&table_readers[epoch], 1);
+}
+
+// A reader that read the epoch just before a flip counts in the old counter but can see the new table,
+// so the writer waits out two flips before nothing can refer to the table it replaced
+static void sensor_table_synchronize(void) {
+    for (int flip = 0; flip < 2; flip++) {
+        unsigned int old = atomic_fetch_add(&table_epoch, 1) & 1;
+        while (atomic_load(&table_readers[old]) > 0) {
+            nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 100000}, NULL);
+        }
+    }
+}
+
+static int room_compare(const void *x, const void *y) {
+    const room_entry_t *room_x = x;
+    const room_entry_t *room_y = y;
+    if (room_x->id < room_y->id) return -1;
+    if (room_x->id > room_y->id) return 1;
     return 0;
 }
 
-void *copy_sensor_data(void *element) {
-    if (element == NULL) return NULL;
+static size_t slot_hash(sensor_id_t id) {
+    uint32_t h = (uint32_t)id * 0x9E3779B1u;
+    return h ^ (h >> 16);
+}
+
+static sensor_entry_t *sensor_table_find(const sensor_table_t *table, sensor_id_t id) {
+    if (table == NULL || table->slots == NULL) return NULL;
+    for (size_t i = slot_hash(id) & table->slot_mask;; i = (i + 1) & table->slot_mask) {
+        const table_slot_t *slot = &table->slots[i];
+        if (slot->pos == 0) return NULL;
+        if (slot->id == id) return &table->entries[slot->pos - 1];
+    }
+}
 
-    sensor_data_t *copy = malloc(sizeof(sensor_data_t));
-    if (copy == NULL) {
-        write_log("Memory allocation failed for sensor data copy");
-        exit(EXIT_FAILURE);
+// Build the hash index of the entries, with linear probing and at least twice as many slots as sensors
+static int sensor_table_index(sensor_table_t *table) {
+    size_t capacity = 16;
+    while (capacity < 2 * table->count) capacity *= 2;
+    free(table->slots);
+    table->slots = calloc(capacity, sizeof(table_slot_t));
+    if (table->slots == NULL) return DATAMGR_FAILURE;
+    table->slot_mask = capacity - 1;
+
+    for (size_t i = 0; i < table->count; i++) {
+        size_t s = slot_hash(table->entries[i].id) & table->slot_mask;
+        while (table->slots[s].pos != 0) s = (s + 1) & table->slot_mask;
+        table->slots[s] = (table_slot_t){.id = table->entries[i].id, .pos = (uint32_t)(i + 1)};
+    }
+    return DATAMGR_SUCCESS;
+}
+
+static room_entry_t *sensor_table_find_room(const sensor_table_t *table, uint16_t id) {
+    if (table == NULL || table->room_count == 0) return NULL;
+    room_entry_t key = {.id = id};
+    return bsearch(&key, table->rooms, table->room_count, sizeof(room_entry_t), room_compare);
+}
+
+static void sensor_table_free(sensor_table_t *table, bool free_states) {
+    if (table == NULL) return;
+    if (free_states) {
+        for (size_t i = 0; i < table->count; i++) {
+            free(table->entries[i].state);
+        }
+        for (size_t i = 0; i < table->room_count; i++) {
+            free(table->rooms[i].state);
+        }
     }
+    free(table->entries);
+    free(table->slots);
+    free(table->rooms);
+    free(table);
+}
+
+// Build a new table from the map file, the states are filled in on publication
+// A line of the sensor map, line numbers are kept for the error messages
+typedef struct map_line {
+    sensor_id_t id;
+    uint16_t room_id;
+    uint32_t line;
+} map_line_t;
 
-    *copy = *(sensor_data_t *)element;
-    return copy;
+// Parse an unsigned decimal number no larger than 'max', returns the position after it or NULL
+static const char *parse_uint(const char *p, const char *end, unsigned long max, unsigned long *value) {
+    if (p == end || *p < '0' || *p > '9') return NULL;
+    unsigned long n = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        n = n * 10 + (unsigned long)(*p++ - '0');
+        if (n > max) return NULL;
+    }
+    *value = n;
+    return p;
 }
 
-void free_sensor_data(void **element) {
-    if (element != NULL && *element != NULL) {
-        free(*element);
-        *element = NULL;
+// Stable LSD radix sort on sensor id, so that the first line of a sensor stays in front of its duplicates
+static map_line_t *map_lines_sort(map_line_t *lines, size_t count) {
+    bool sorted = true;
+    for (size_t i = 1; i < count && sorted; i++) sorted = lines[i - 1].id <= lines[i].id;
+    if (sorted) return lines;
+
+    map_line_t *tmp = malloc(count * sizeof(map_line_t));
+    if (tmp == NULL) return NULL;
+    for (unsigned int shift = 0; shift < sizeof(sensor_id_t) * 8; shift += 8) {
+        size_t offsets[256] = {0};
+        for (size_t i = 0; i < count; i++) offsets[(lines[i].id >> shift) & 0xFF]++;
+        size_t total = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t n = offsets[b];
+            offsets[b] = total;
+            total += n;
+        }
+        for (size_t i = 0; i < count; i++) tmp[offsets[(lines[i].id >> shift) & 0xFF]++] = lines[i];
+        map_line_t *swap = lines;
+        lines = tmp;
+        tmp = swap;
     }
+    free(tmp);
+    return lines;
 }
 
-void datamgr_init() {
-    sensor_list = dpl_create(copy_sensor_data, free_sensor_data, element_compare);
-    if (sensor_list == NULL) {
-        write_log("Failed to create sensor list.\n");
-        exit(1);
+// Parse "<room id> <sensor id>" lines, blank lines are skipped
+// Returns NULL if a line is malformed or memory allocation fails, every bad line is logged with its number.
+static sensor_table_t *sensor_table_build(const char *data, size_t size) {
+    size_t capacity = 64, count = 0, errors = 0;
+    map_line_t *lines = malloc(capacity * sizeof(map_line_t));
+    if (lines == NULL) return NULL;
+
+    const char *p = data, *end = data + size;
+    for (uint32_t line = 1; p < end; line++) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL) eol = end;
+        const char *q = p;
+        unsigned long room_id = 0, sensor_id = 0;
+
+        while (q < eol && (*q == ' ' || *q == '\t')) q++;
+        if (q < eol && *q != '\r') {
+            q = parse_uint(q, eol, UINT16_MAX, &room_id);
+            const char *gap = q;
+            while (q != NULL && q < eol && (*q == ' ' || *q == '\t')) q++;
+            if (q == gap) q = NULL;
+            if (q != NULL) q = parse_uint(q, eol, SENSOR_ID_MAX, &sensor_id);
+            while (q != NULL && q < eol && (*q == ' ' || *q == '\t' || *q == '\r')) q++;
+
+            if (q != eol) {
+                if (++errors <= 10) {
+                    char log_msg[160];
+                    snprintf(log_msg, sizeof(log_msg), "Sensor map line %" PRIu32 ": expected \"<room id> <sensor id>\", got \"%.*s\"",
+                             line, (int)(eol - p > 40 ? 40 : eol - p), p);
+                    write_log(log_msg);
+                }
+            } else {
+                if (count == capacity) {
+                    capacity *= 2;
+                    map_line_t *grown = realloc(lines, capacity * sizeof(map_line_t));
+                    if (grown == NULL) {
+                        free(lines);
+                        return NULL;
+                    }
+                    lines = grown;
+                }
+                lines[count++] = (map_line_t){.id = (sensor_id_t)sensor_id, .room_id = (uint16_t)room_id, .line = line};
+            }
+        }
+        p = eol + 1;
+    }
+    if (errors > 0) {
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "Sensor map rejected: %zu malformed lines", errors);
+        write_log(log_msg);
+        free(lines);
+        return NULL;
+    }
+
+    map_line_t *sorted = map_lines_sort(lines, count);
+    sensor_table_t *table = (sorted != NULL) ? calloc(1, sizeof(sensor_table_t)) : NULL;
+    if (table != NULL) table->entries = malloc((count ? count : 1) * sizeof(sensor_entry_t));
+    if (table == NULL || table->entries == NULL) {
+        free(sorted ? sorted : lines);
+        free(table);
+        return NULL;
+    }
+
+    // Keep the first mapping of a sensor that is listed more than once
+    uint32_t kept_line = 0;
+    size_t duplicates = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (table->count > 0 && table->entries[table->count - 1].id == sorted[i].id) {
+            if (++duplicates <= 10) {
+                char log_msg[160];
+                snprintf(log_msg, sizeof(log_msg), "Sensor map line %" PRIu32 " lists sensor %" PRIsensor " again, line %" PRIu32 " is used",
+                         sorted[i].line, sorted[i].id, kept_line);
+                write_log(log_msg);
+            }
+            continue;
+        }
+        kept_line = sorted[i].line;
+        table->entries[table->count++] = (sensor_entry_t){.id = sorted[i].id, .room_id = sorted[i].room_id, .state = NULL};
+    }
+    if (duplicates > 10) {
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "Sensor map lists %zu sensors more than once", duplicates);
+        write_log(log_msg);
+    }
+    free(sorted);
+    return table;
+}
+
+// Map the sensor map into memory and build a table from it, files that cannot be mapped are read instead
+static sensor_table_t *sensor_table_load(FILE *fp_sensor_map) {
+    struct stat st;
+    int fd = fileno(fp_sensor_map);
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size == 0) return sensor_table_build("", 0);
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+            sensor_table_t *table = sensor_table_build(data, st.st_size);
+            munmap(data, st.st_size);
+            return table;
+        }
+    }
+
+    size_t size = 0, capacity = 4096;
+    char *data = malloc(capacity);
+    size_t n;
+    while (data != NULL && (n = fread(data + size, 1, capacity - size, fp_sensor_map)) > 0) {
+        size += n;
+        if (size == capacity) {
+            char *grown = realloc(data, capacity *= 2);
+            if (grown == NULL) free(data);
+            data = grown;
+        }
     }
+    sensor_table_t *table = (data != NULL) ? sensor_table_build(data, size) : NULL;
+    free(data);
+    return table;
+}
+
+static sensor_table_t *sensor_table_clone(const sensor_table_t *table) {
+    sensor_table_t *clone = calloc(1, sizeof(sensor_table_t));
+    if (clone == NULL) return NULL;
+    if (table == NULL || table->count == 0) return clone;
+
+    clone->entries = malloc(table->count * sizeof(sensor_entry_t));
+    if (clone->entries == NULL) {
+        free(clone);
+        return NULL;
+    }
+    memcpy(clone->entries, table->entries, table->count * sizeof(sensor_entry_t));
+    clone->count = table->count;
+    return clone;
+}
+
+// Free the states of 'table' that 'keep' does not refer to, returns the number of sensors dropped
+static size_t sensor_table_detach(sensor_table_t *table, const sensor_table_t *keep) {
+    size_t removed = 0;
+    for (size_t i = 0; i < table->count; i++) {
+        if (table->entries[i].state != NULL && sensor_table_find(keep, table->entries[i].id) == NULL) {
+            free(table->entries[i].state);
+            removed++;
+        }
+    }
+    for (size_t i = 0; i < table->room_count; i++) {
+        if (sensor_table_find_room(keep, table->rooms[i].id) == NULL) free(table->rooms[i].state);
+    }
+    return removed;
+}
+
+// Give every sensor and room of 'table' its state, reusing the ones of 'old_table'
+static int sensor_table_attach(sensor_table_t *table, const sensor_table_t *old_table, size_t *added) {
+    // Room ids are 16 bit, a presence map gives the sorted list of rooms in linear time
+    free(table->rooms);
+    table->rooms = calloc(table->count ? table->count : 1, sizeof(room_entry_t));
+    table->room_count = 0;
+    bool *present = calloc(UINT16_MAX + 1, sizeof(bool));
+    if (table->rooms == NULL || present == NULL || sensor_table_index(table) != DATAMGR_SUCCESS) {
+        free(present);
+        return DATAMGR_FAILURE;
+    }
+
+    for (size_t i = 0; i < table->count; i++) {
+        table->entries[i].state = NULL;
+        present[table->entries[i].room_id] = true;
+    }
+    for (uint32_t id = 0; id <= UINT16_MAX; id++) {
+        if (present[id]) table->rooms[table->room_count++].id = (uint16_t)id;
+    }
+    free(present);
+
+    int result = DATAMGR_SUCCESS;
+    for (size_t i = 0; i < table->room_count; i++) {
+        room_entry_t *old_room = sensor_table_find_room(old_table, table->rooms[i].id);
+        table->rooms[i].state = old_room ? old_room->state : calloc(1, sizeof(room_state_t));
+        if (table->rooms[i].state == NULL) result = DATAMGR_FAILURE;
+    }
+
+    *added = 0;
+    for (size_t i = 0; i < table->count; i++) {
+        sensor_entry_t *entry = &table->entries[i];
+        sensor_entry_t *old_entry = sensor_table_find(old_table, entry->id);
+        if (old_entry != NULL) {
+            entry->state = old_entry->state;
+        } else if ((entry->state = calloc(1, sizeof(sensor_state_t))) != NULL) {
+            (*added)++;
+        } else {
+            result = DATAMGR_FAILURE;
+        }
+        entry->room = sensor_table_find_room(table, entry->room_id)->state;
+    }
+    return result;
+}
+
+// Swap in a freshly built table, reusing the state of sensors that remain
+// If 'config' is given it replaces the alert config, a NULL 'table' then republishes the current map
+static int sensor_table_publish(sensor_table_t *table, alert_config_t *config) {
+    pthread_mutex_lock(&publish_mutex);
+
+    // Only this function swaps tables, so the old one can be read without a reader slot
+    sensor_table_t *old_table = atomic_load(&current_table);
+    size_t added = 0, removed = 0;
+    bool new_map = (table != NULL);
+
+    if (table == NULL && (table = sensor_table_clone(old_table)) == NULL) {
+        pthread_mutex_unlock(&publish_mutex);
+        alert_config_free(&config);
+        return DATAMGR_FAILURE;
+    }
+    if (config != NULL) {
+        alert_config_free(&alert_config);
+        alert_config = config;
+    }
+
+    if (sensor_table_attach(table, old_table, &added) != DATAMGR_SUCCESS) {
+        sensor_table_detach(table, old_table);
+        sensor_table_free(table, false);
+        pthread_mutex_unlock(&publish_mutex);
+        return DATAMGR_FAILURE;
+    }
+    for (size_t i = 0; i < table->count; i++) {
+        table->entries[i].rule = alert_config_lookup(alert_config, table->entries[i].id, table->entries[i].room_id);
+        table->entries[i].anomaly = alert_config_anomaly(alert_config);
+    }
+
+    atomic_store(&current_table, table);
+    sensor_table_synchronize();
+
+    if (old_table != NULL) {
+        removed = sensor_table_detach(old_table, table);
+        sensor_table_free(old_table, false);
+    }
+    pthread_mutex_unlock(&publish_mutex);
+
+    if (new_map) {
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "Sensor map loaded: %zu sensors (%zu added, %zu removed)",
+                 table->count, added, removed);
+        write_log(log_msg);
+    }
+    return DATAMGR_SUCCESS;
+}
+
+void datamgr_init() {
+    atomic_store(&current_table, NULL);
+    atomic_store(&table_readers[0], 0);
+    atomic_store(&table_readers[1], 0);
 }
 
 void datamgr_parse_sensor_files(FILE *fp_sensor_map, FILE *fp_sensor_data) {
@@ -55,71 +555,671 @@ void datamgr_parse_sensor_files(FILE *fp_sensor_map, FILE *fp_sensor_data) {
         exit(EXIT_FAILURE);
     }
 
-    uint16_t room_id, sensor_id;
-    while (fscanf(fp_sensor_map, "%u %u\n", (unsigned int *)&room_id, (unsigned int *)&sensor_id) == 2) {
-        sensor_data_t *sensor = malloc(sizeof(sensor_data_t));
-        if (sensor == NULL) {
-            write_log("Error: Memory allocation failed for sensor data\n");
-            exit(EXIT_FAILURE);
+    sensor_table_t *table = sensor_table_load(fp_sensor_map);
+    if (table == NULL || sensor_table_publish(table, NULL) != DATAMGR_SUCCESS) {
+        write_log("Error: Sensor map could not be loaded\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int datamgr_reload_sensor_map(const char *path) {
+    FILE *fp_sensor_map = fopen(path, "r");
+    if (fp_sensor_map == NULL) {
+        write_log("Sensor map reload: could not open the sensor map, keeping the current one");
+        return DATAMGR_FAILURE;
+    }
+
+    sensor_table_t *table = sensor_table_load(fp_sensor_map);
+    fclose(fp_sensor_map);
+    if (table == NULL) {
+        write_log("Sensor map reload: keeping the current map");
+        return DATAMGR_FAILURE;
+    }
+    return sensor_table_publish(table, NULL);
+}
+
+int datamgr_load_alert_config(const char *path) {
+    // Remember the path even if the file is broken, the watcher picks up the fix
+    if (path != alert_config_path) {
+        free(alert_config_path);
+        alert_config_path = path ? strdup(path) : NULL;
+    }
+
+    alert_config_t *config = alert_config_load(path);
+    if (config == NULL) {
+        write_log("Alert config: keeping the current thresholds");
+        return DATAMGR_FAILURE;
+    }
+    return sensor_table_publish(NULL, config);
+}
+
+// Split 'path' into the directory to watch and the file name to look for
+static const char *watch_target(const char *path, char *dir, size_t dir_size) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        snprintf(dir, dir_size, ".");
+        return path;
+    }
+    snprintf(dir, dir_size, "%.*s", (int)(slash - path + (slash == path)), path);
+    return slash + 1;
+}
+
+static void *sensor_map_watcher(void *arg) {
+    char map_dir[4096], alert_dir[4096];
+    const char *map_name = watch_target(watched_path, map_dir, sizeof(map_dir));
+    const char *alert_name = alert_config_path ? watch_target(alert_config_path, alert_dir, sizeof(alert_dir)) : NULL;
+
+    // Watch the directories, editors usually replace the file instead of rewriting it
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int map_wd = (fd != -1) ? inotify_add_watch(fd, map_dir, IN_CLOSE_WRITE | IN_MOVED_TO) : -1;
+    int alert_wd = (map_wd != -1 && alert_name) ? inotify_add_watch(fd, alert_dir, IN_CLOSE_WRITE | IN_MOVED_TO) : -1;
+    if (map_wd == -1) {
+        write_log("Sensor map watcher: inotify setup failed, hot reload disabled");
+        if (fd != -1) close(fd);
+        return NULL;
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (atomic_load(&watcher_running)) {
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, WATCH_POLL_MS) <= 0) continue;
+
+        bool map_changed = false, alert_changed = false;
+        ssize_t len;
+        while ((len = read(fd, events, sizeof(events))) > 0) {
+            for (char *p = events; p < events + len;) {
+                struct inotify_event *event = (struct inotify_event *)p;
+                if (event->len > 0 && event->wd == map_wd && strcmp(event->name, map_name) == 0) {
+                    map_changed = true;
+                }
+                if (event->len > 0 && event->wd == alert_wd && strcmp(event->name, alert_name) == 0) {
+                    alert_changed = true;
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
         }
-        sensor->room_id = room_id;
-        sensor->id = sensor_id;
-        sensor->value = 0;
-        sensor->ts = 0;
+        if (alert_changed) datamgr_load_alert_config(alert_config_path);
+        if (map_changed) datamgr_reload_sensor_map(watched_path);
+    }
 
-        dpl_insert_at_index(sensor_list, sensor, dpl_size(sensor_list), true);
-        free(sensor);
+    close(fd);
+    return NULL;
+}
+
+int datamgr_watch_sensor_map(const char *path) {
+    if (path == NULL || atomic_load(&watcher_running)) return DATAMGR_FAILURE;
+
+    watched_path = strdup(path);
+    if (watched_path == NULL) return DATAMGR_FAILURE;
+
+    atomic_store(&watcher_running, 1);
+    if (pthread_create(&watcher_tid, NULL, sensor_map_watcher, NULL) != 0) {
+        atomic_store(&watcher_running, 0);
+        free(watched_path);
+        watched_path = NULL;
+        return DATAMGR_FAILURE;
     }
+    return DATAMGR_SUCCESS;
 }
 
 void datamgr_free() {
-    dpl_free(&sensor_list, true);
+    if (atomic_exchange(&watcher_running, 0)) {
+        pthread_join(watcher_tid, NULL);
+        free(watched_path);
+        watched_path = NULL;
+    }
+
+    // Leave a last checkpoint behind so that the next start resumes where this one stopped
+    if (atomic_load(&checkpoint_running)) {
+        pthread_mutex_lock(&checkpoint_mutex);
+        atomic_store(&checkpoint_running, 0);
+        pthread_cond_signal(&checkpoint_cond);
+        pthread_mutex_unlock(&checkpoint_mutex);
+        pthread_join(checkpoint_tid, NULL);
+        datamgr_checkpoint(checkpoint_path);
+        free(checkpoint_path);
+        checkpoint_path = NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        free(checkpoint_images[i]);
+        checkpoint_images[i] = NULL;
+        checkpoint_image_sizes[i] = 0;
+    }
+    free(rollup_queue);
+    rollup_queue = NULL;
+    rollup_queued = rollup_queue_size = 0;
+
+    pthread_mutex_lock(&publish_mutex);
+    sensor_table_t *table = atomic_exchange(&current_table, NULL);
+    sensor_table_synchronize();
+    sensor_table_free(table, true);
+    alert_config_free(&alert_config);
+    pthread_mutex_unlock(&publish_mutex);
+
+    free(alert_config_path);
+    alert_config_path = NULL;
+}
+
+// Running average once 'value' is added to the window, computed the same way as the update does
+static sensor_value_t window_avg(const sensor_state_t *state, sensor_value_t value) {
+    if (state->window_count == RUN_AVG_LENGTH) {
+        return (state->window_sum - state->window[state->window_pos] + value) / RUN_AVG_LENGTH;
+    }
+    return (state->window_sum + value) / (state->window_count + 1);
+}
+
+// Seqlock writer side, only the thread that processes the data writes the sensor and room state
+static void seq_write_begin(atomic_uint *seq) {
+    unsigned int value = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, value + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static void seq_write_end(atomic_uint *seq) {
+    unsigned int value = atomic_load_explicit(seq, memory_order_relaxed);
+    atomic_store_explicit(seq, value + 1, memory_order_release);
+}
+
+// Seqlock reader side, copy the state between seq_read_begin() and seq_read_retry() and retry
+// instead of blocking the writer. A write section does no I/O, a reader that finds one open yields to it.
+static unsigned int seq_read_begin(atomic_uint *seq) {
+    unsigned int value;
+    while ((value = atomic_load_explicit(seq, memory_order_acquire)) & 1) sched_yield();
+    return value;
+}
+
+// Rollup emit callback inside a write section, the records are written by rollup_queue_emit() afterwards
+static void rollup_queue_add(const rollup_record_t *record, void *arg) {
+    if (rollup_queued == rollup_queue_size) {
+        size_t size = rollup_queue_size ? 2 * rollup_queue_size : 16;
+        rollup_record_t *grown = realloc(rollup_queue, size * sizeof(rollup_record_t));
+        if (grown == NULL) {
+            // Better late readers than a lost rollup
+            rollup_emit(record, rollup_emit_arg);
+            return;
+        }
+        rollup_queue = grown;
+        rollup_queue_size = size;
+    }
+    rollup_queue[rollup_queued++] = *record;
+}
+
+static void rollup_queue_emit(void) {
+    for (size_t i = 0; i < rollup_queued; i++) rollup_emit(&rollup_queue[i], rollup_emit_arg);
+    rollup_queued = 0;
+}
+
+static bool seq_read_retry(atomic_uint *seq, unsigned int start) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(seq, memory_order_relaxed) != start;
+}
+
+// The duplicate filter of a sensor is shared by its connection thread and the checkpoint thread, neither holds
+// it for more than a few loads and stores
+static void dedup_lock(sensor_state_t *state) {
+    while (atomic_flag_test_and_set_explicit(&state->dedup_lock, memory_order_acquire)) sched_yield();
+}
+
+static void dedup_unlock(sensor_state_t *state) {
+    atomic_flag_clear_explicit(&state->dedup_lock, memory_order_release);
+}
+
+static sensor_live_t live_read(sensor_state_t *state) {
+    sensor_live_t live;
+    unsigned int seq;
+    do {
+        seq = seq_read_begin(&state->seq);
+        live = state->live;
+    } while (seq_read_retry(&state->seq, seq));
+    return live;
+}
+
+static void snapshot_fill(datamgr_snapshot_t *snapshot, const sensor_entry_t *sensor) {
+    sensor_live_t live = live_read(sensor->state);
+    *snapshot = (datamgr_snapshot_t){
+            .id = sensor->id, .room_id = sensor->room_id, .last_value = live.last_value, .avg = live.avg,
+            .last_ts = live.last_ts, .alarm = live.alarm, .anomalies = live.anomalies,
+            .duplicates = atomic_load(&sensor->state->duplicates)};
 }
 
 int datamgr_process_data(sensor_data_t *data) {
-    int index = dpl_get_index_of_element(sensor_list, data);
-    if (index == -1) {
+    unsigned int epoch;
+    sensor_table_t *table = sensor_table_acquire(&epoch);
+    sensor_entry_t *sensor = sensor_table_find(table, data->id);
+    if (sensor == NULL) {
+        sensor_table_release(epoch);
         char log_msg[128];
-        snprintf(log_msg, sizeof(log_msg), "Received sensor data with invalid sensor node ID %" PRIu16, data->id);
+        snprintf(log_msg, sizeof(log_msg), "Received sensor data with invalid sensor node ID %" PRIsensor, data->id);
         write_log(log_msg);
         return DATAMGR_FAILURE;
     }
 
-    sensor_data_t *sensor = (sensor_data_t *)dpl_get_element_at_index(sensor_list, index);
-    sensor->value = data->value;
-    sensor->ts = data->ts;
+    // Only this thread writes the state, alerts and anomalies are evaluated on copies so that their logging
+    // happens outside the write section. Readers of the state never wait for I/O.
+    sensor_state_t *state = sensor->state;
+    double avg = window_avg(state, data->value);
+    alert_state_t alert = state->alert;
+    anomaly_state_t anomaly = state->anomaly;
+    alert_evaluate(&sensor->rule, &alert, sensor->id, avg, data->ts);
+    unsigned int anomalies = anomaly_check(&sensor->anomaly, &anomaly, sensor->id, data->value, data->ts);
+    data->room_id = sensor->room_id;
 
-    double avg = datamgr_get_avg(sensor->id);
-    fprintf(stdout, "Room %u: Sensor %u Running Avg = %.2f°C\n", sensor->room_id, sensor->id, avg);
+    seq_write_begin(&state->seq);
+    if (state->window_count == RUN_AVG_LENGTH) {
+        state->window_sum -= state->window[state->window_pos];
+    } else {
+        state->window_count++;
+    }
+    state->window[state->window_pos] = data->value;
+    state->window_sum += data->value;
+    state->window_pos = (state->window_pos + 1) % RUN_AVG_LENGTH;
+    state->alert = alert;
+    state->anomaly = anomaly;
+    state->live = (sensor_live_t){.last_value = data->value, .avg = avg, .last_ts = data->ts,
+                                  .alarm = alert.level, .anomalies = anomalies};
 
-    char log_msg[128];
-    if (avg < min_temp) {
-        snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIu16 " reports it’s too cold (avg temp = %.2f)", sensor->id, avg);
-        write_log(log_msg);
-    } else if (avg > max_temp) {
-        snprintf(log_msg, sizeof(log_msg), "Sensor node %" PRIu16 " reports it’s too hot (avg temp = %.2f)", sensor->id, avg);
-        write_log(log_msg);
+    // Rollups are keyed on event time, the reorder buffer hands them the readings in timestamp order
+    rollup_reorder_push(&state->reorder, data->value, data->ts);
+    rollup_emit_fn emit = rollup_emit ? rollup_queue_add : NULL;
+    sensor_value_t value;
+    sensor_ts_t ts;
+    seq_write_begin(&sensor->room->seq);
+    while (rollup_reorder_pop(&state->reorder, &value, &ts, false)) {
+        rollup_add(&state->rollup, ROLLUP_SENSOR, sensor->id, value, ts, emit, NULL);
+        rollup_add(&sensor->room->rollup, ROLLUP_ROOM, sensor->room_id, value, ts, emit, NULL);
     }
+    seq_write_end(&sensor->room->seq);
+    seq_write_end(&state->seq);
 
+    fprintf(stdout, "Room %" PRIu16 ": Sensor %" PRIsensor " Running Avg = %.2f°C\n", sensor->room_id, sensor->id, avg);
+    rollup_queue_emit();
+    sensor_table_release(epoch);
     return DATAMGR_SUCCESS;
 }
 
+// Fingerprint of a reading, never 0 so that empty slots do not match
+static uint32_t reading_hash(sensor_ts_t ts, sensor_value_t value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint64_t h = ((uint64_t)ts * 0x9E3779B97F4A7C15ULL) ^ bits;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return (uint32_t)h | 1;
+}
+
+bool datamgr_is_duplicate(const sensor_data_t *data) {
+    unsigned int epoch;
+    sensor_table_t *table = sensor_table_acquire(&epoch);
+    sensor_entry_t *sensor = sensor_table_find(table, data->id);
+    if (sensor == NULL) {
+        sensor_table_release(epoch);
+        return false;
+    }
+
+    sensor_state_t *state = sensor->state;
+    uint32_t hash = reading_hash(data->ts, data->value);
+    bool duplicate = false;
+
+    dedup_lock(state);
+    // Readings newer than anything seen so far cannot be a resend
+    if (data->ts <= state->dedup_last_ts) {
+        for (int i = 0; i < DEDUP_SLOTS; i++) {
+            if (state->dedup_recent[i] == hash) duplicate = true;
+        }
+    } else {
+        state->dedup_last_ts = data->ts;
+    }
+    if (!duplicate) {
+        state->dedup_recent[state->dedup_pos] = hash;
+        state->dedup_pos = (state->dedup_pos + 1) % DEDUP_SLOTS;
+    }
+    dedup_unlock(state);
+
+    if (duplicate) atomic_fetch_add(&state->duplicates, 1);
+    sensor_table_release(epoch);
+    return duplicate;
+}
+
 sensor_value_t datamgr_get_avg(sensor_id_t sensor_id) {
-    sensor_data_t temp_sensor;
-    temp_sensor.id = sensor_id;
+    unsigned int epoch;
+    sensor_table_t *table = sensor_table_acquire(&epoch);
+    sensor_entry_t *sensor = sensor_table_find(table, sensor_id);
+    sensor_value_t avg = (sensor != NULL) ? live_read(sensor->state).avg : 0.0;
+    sensor_table_release(epoch);
+    return avg;
+}
+
+int datamgr_get_snapshot(sensor_id_t sensor_id, datamgr_snapshot_t *snapshot) {
+    unsigned int epoch;
+    sensor_table_t *table = sensor_table_acquire(&epoch);
+    sensor_entry_t *sensor = sensor_table_find(table, sensor_id);
+    if (sensor != NULL) snapshot_fill(snapshot, sensor);
+    sensor_table_release(epoch);
+    return (sensor != NULL) ? DATAMGR_SUCCESS : DATAMGR_FAILURE;
+}
 
-    int index = dpl_get_index_of_element(sensor_list, &temp_sensor);
-    if (index == -1) return 0.0;
+void datamgr_for_each_snapshot(datamgr_snapshot_fn fn, void *arg) {
+    unsigned int epoch;
+    sensor_table_t *table = sensor_table_acquire(&epoch);
+    for (size_t i = 0; table != NULL && i < table->count; i++) {
+        datamgr_snapshot_t snapshot;
+        snapshot_fill(&snapshot, &table->entries[i]);
+        fn(&snapshot, arg);
+    }
+    sensor_table_release(epoch);
+}
+
+void datamgr_set_rollup_sink(rollup_emit_fn emit, void *arg) {
+    rollup_emit = emit;
+    rollup_emit_arg = arg;
+}
 
-    int count = 0;
-    double sum = 0.0;
-    for (int i = index; i >= 0 && count < RUN_AVG_LENGTH; i--) {
-        sensor_data_t *sensor = (sensor_data_t *)dpl_get_element_at_index(sensor_list, i);
-        if (sensor->id == sensor_id) {
-            sum += sensor->value;
-            count++;
+void datamgr_flush_rollups(void) {
+    unsigned int epoch;
+    sensor_table_t *table = sensor_table_acquire(&epoch);
+    rollup_emit_fn emit = rollup_emit ? rollup_queue_add : NULL;
+    if (table != NULL) {
+        for (size_t i = 0; i < table->count; i++) {
+            sensor_entry_t *sensor = &table->entries[i];
+            sensor_value_t value;
+            sensor_ts_t ts;
+            seq_write_begin(&sensor->state->seq);
+            seq_write_begin(&sensor->room->seq);
+            while (rollup_reorder_pop(&sensor->state->reorder, &value, &ts, true)) {
+                rollup_add(&sensor->state->rollup, ROLLUP_SENSOR, sensor->id, value, ts, emit, NULL);
+                rollup_add(&sensor->room->rollup, ROLLUP_ROOM, sensor->room_id, value, ts, emit, NULL);
+            }
+            seq_write_end(&sensor->room->seq);
+            rollup_flush(&sensor->state->rollup, ROLLUP_SENSOR, sensor->id, emit, NULL);
+            seq_write_end(&sensor->state->seq);
+            rollup_queue_emit();
+        }
+        for (size_t i = 0; i < table->room_count; i++) {
+            room_state_t *room = table->rooms[i].state;
+            seq_write_begin(&room->seq);
+            rollup_flush(&room->rollup, ROLLUP_ROOM, table->rooms[i].id, emit, NULL);
+            seq_write_end(&room->seq);
+            rollup_queue_emit();
         }
     }
+    sensor_table_release(epoch);
+}
 
-    return (count > 0) ? sum / count : 0.0;
+static uint64_t checkpoint_checksum(const unsigned char *data, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Copy the state of a sensor into its record, the data manager keeps running while this retries
+static void checkpoint_sensor_fill(checkpoint_sensor_t *record, const sensor_entry_t *sensor) {
+    sensor_state_t *state = sensor->state;
+    unsigned int seq;
+    record->id = sensor->id;
+    do {
+        seq = seq_read_begin(&state->seq);
+        memcpy(record->window, state->window, sizeof(record->window));
+        record->window_count = state->window_count;
+        record->window_pos = state->window_pos;
+        record->window_sum = state->window_sum;
+        record->live = state->live;
+        record->alert = state->alert;
+        record->anomaly = state->anomaly;
+        record->reorder = state->reorder;
+        record->rollup = state->rollup;
+    } while (seq_read_retry(&state->seq, seq));
+
+    dedup_lock(state);
+    record->dedup_last_ts = state->dedup_last_ts;
+    memcpy(record->dedup_recent, state->dedup_recent, sizeof(record->dedup_recent));
+    record->dedup_pos = state->dedup_pos;
+    dedup_unlock(state);
+    record->duplicates = atomic_load(&state->duplicates);
+}
+
+static void checkpoint_room_fill(checkpoint_room_t *record, const room_entry_t *room) {
+    unsigned int seq;
+    record->id = room->id;
+    do {
+        seq = seq_read_begin(&room->state->seq);
+        record->rollup = room->state->rollup;
+    } while (seq_read_retry(&room->state->seq, seq));
+}
+
+// Build the checkpoint image of the current table in checkpoint_images[slot], returns its size or 0
+static size_t checkpoint_build(unsigned int slot) {
+    unsigned int epoch;
+    sensor_table_t *table = sensor_table_acquire(&epoch);
+    if (table == NULL) {
+        sensor_table_release(epoch);
+        return 0;
+    }
+
+    size_t size = sizeof(checkpoint_header_t) + table->count * sizeof(checkpoint_sensor_t) +
+                  table->room_count * sizeof(checkpoint_room_t);
+    if (size > checkpoint_image_sizes[slot]) {
+        unsigned char *image = realloc(checkpoint_images[slot], size);
+        if (image == NULL) {
+            sensor_table_release(epoch);
+            return 0;
+        }
+        checkpoint_images[slot] = image;
+        checkpoint_image_sizes[slot] = size;
+    }
+    memset(checkpoint_images[slot], 0, size);
+
+    checkpoint_header_t *header = (checkpoint_header_t *)checkpoint_images[slot];
+    checkpoint_sensor_t *sensors = (checkpoint_sensor_t *)(header + 1);
+    checkpoint_room_t *rooms = (checkpoint_room_t *)(sensors + table->count);
+    for (size_t i = 0; i < table->count; i++) {
+        checkpoint_sensor_fill(&sensors[i], &table->entries[i]);
+    }
+    for (size_t i = 0; i < table->room_count; i++) {
+        checkpoint_room_fill(&rooms[i], &table->rooms[i]);
+    }
+
+    memcpy(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic));
+    header->version = CHECKPOINT_VERSION;
+    header->sensor_size = sizeof(checkpoint_sensor_t);
+    header->room_size = sizeof(checkpoint_room_t);
+    header->sensor_count = table->count;
+    header->room_count = table->room_count;
+    header->created = (int64_t)time(NULL);
+    sensor_table_release(epoch);
+
+    header->checksum = checkpoint_checksum((unsigned char *)(header + 1), size - sizeof(checkpoint_header_t));
+    return size;
+}
+
+// Write the image next to the checkpoint and rename it over the old one once it is on disk,
+// a crash at any point leaves either the old or the new checkpoint in place
+static int checkpoint_write(const char *path, const unsigned char *image, size_t size) {
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) return DATAMGR_FAILURE;
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return DATAMGR_FAILURE;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(fd, image + written, size - written);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    if (written != size || fdatasync(fd) == -1) {
+        close(fd);
+        unlink(tmp_path);
+        return DATAMGR_FAILURE;
+    }
+    close(fd);
+    if (rename(tmp_path, path) == -1) {
+        unlink(tmp_path);
+        return DATAMGR_FAILURE;
+    }
+
+    // Make the rename itself durable
+    char dir[4096];
+    watch_target(path, dir, sizeof(dir));
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return DATAMGR_SUCCESS;
+}
+
+int datamgr_checkpoint(const char *path) {
+    if (path == NULL) return DATAMGR_FAILURE;
+
+    pthread_mutex_lock(&checkpoint_build_mutex);
+    unsigned int slot = checkpoint_next;
+    checkpoint_next ^= 1;
+    size_t size = checkpoint_build(slot);
+    // The write of the previous checkpoint finishes first, after that its image is free for the next build
+    pthread_mutex_lock(&checkpoint_write_mutex);
+    pthread_mutex_unlock(&checkpoint_build_mutex);
+    int result = (size > 0) ? checkpoint_write(path, checkpoint_images[slot], size) : DATAMGR_FAILURE;
+    pthread_mutex_unlock(&checkpoint_write_mutex);
+
+    if (result != DATAMGR_SUCCESS) {
+        char log_msg[160];
+        snprintf(log_msg, sizeof(log_msg), "Checkpoint: could not write %s", path);
+        write_log(log_msg);
+    }
+    return result;
+}
+
+static void checkpoint_sensor_restore(sensor_state_t *state, const checkpoint_sensor_t *record) {
+    seq_write_begin(&state->seq);
+    memcpy(state->window, record->window, sizeof(state->window));
+    state->window_count = record->window_count;
+    state->window_pos = record->window_pos;
+    state->window_sum = record->window_sum;
+    state->live = record->live;
+    state->alert = record->alert;
+    state->anomaly = record->anomaly;
+    state->reorder = record->reorder;
+    state->rollup = record->rollup;
+    seq_write_end(&state->seq);
+
+    dedup_lock(state);
+    state->dedup_last_ts = record->dedup_last_ts;
+    memcpy(state->dedup_recent, record->dedup_recent, sizeof(state->dedup_recent));
+    state->dedup_pos = record->dedup_pos;
+    dedup_unlock(state);
+    atomic_store(&state->duplicates, record->duplicates);
+}
+
+// Check that a mapped checkpoint is complete and was written by a build with the same layout
+static bool checkpoint_valid(const unsigned char *data, size_t size) {
+    if (size < sizeof(checkpoint_header_t)) return false;
+    const checkpoint_header_t *header = (const checkpoint_header_t *)data;
+    if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != CHECKPOINT_VERSION ||
+        header->sensor_size != sizeof(checkpoint_sensor_t) || header->room_size != sizeof(checkpoint_room_t)) {
+        return false;
+    }
+    size_t payload = size - sizeof(checkpoint_header_t);
+    if (header->sensor_count > payload / sizeof(checkpoint_sensor_t) ||
+        header->room_count > payload / sizeof(checkpoint_room_t) ||
+        header->sensor_count * sizeof(checkpoint_sensor_t) + header->room_count * sizeof(checkpoint_room_t) != payload) {
+        return false;
+    }
+    return checkpoint_checksum(data + sizeof(checkpoint_header_t), payload) == header->checksum;
+}
+
+int datamgr_restore_checkpoint(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return DATAMGR_FAILURE;   // no checkpoint yet, start cold
+
+    struct stat st;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED || !checkpoint_valid(data, st.st_size)) {
+        if (data != MAP_FAILED) munmap(data, st.st_size);
+        char log_msg[160];
+        snprintf(log_msg, sizeof(log_msg), "Checkpoint: %s is damaged or from another version, starting cold", path);
+        write_log(log_msg);
+        return DATAMGR_FAILURE;
+    }
+    posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    const checkpoint_header_t *header = data;
+    const checkpoint_sensor_t *sensors = (const checkpoint_sensor_t *)(header + 1);
+    const checkpoint_room_t *rooms = (const checkpoint_room_t *)(sensors + header->sensor_count);
+
+    // Both the records and the table are sorted on id, walk them side by side
+    unsigned int epoch;
+    sensor_table_t *table = sensor_table_acquire(&epoch);
+    size_t restored = 0, skipped = 0;
+    size_t entry = 0;
+    for (uint64_t i = 0; i < header->sensor_count; i++) {
+        while (table != NULL && entry < table->count && table->entries[entry].id < sensors[i].id) entry++;
+        if (table != NULL && entry < table->count && table->entries[entry].id == sensors[i].id) {
+            checkpoint_sensor_restore(table->entries[entry].state, &sensors[i]);
+            restored++;
+        } else {
+            skipped++;
+        }
+    }
+    size_t room = 0;
+    for (uint64_t i = 0; i < header->room_count; i++) {
+        while (table != NULL && room < table->room_count && table->rooms[room].id < rooms[i].id) room++;
+        if (table != NULL && room < table->room_count && table->rooms[room].id == rooms[i].id) {
+            room_state_t *state = table->rooms[room].state;
+            seq_write_begin(&state->seq);
+            state->rollup = rooms[i].rollup;
+            seq_write_end(&state->seq);
+        }
+    }
+    sensor_table_release(epoch);
+    munmap(data, st.st_size);
+
+    char log_msg[160];
+    snprintf(log_msg, sizeof(log_msg), "Checkpoint restored: %zu sensors (%zu no longer in the sensor map)",
+             restored, skipped);
+    write_log(log_msg);
+    return DATAMGR_SUCCESS;
+}
+
+static void *checkpoint_thread(void *arg) {
+    pthread_mutex_lock(&checkpoint_mutex);
+    while (atomic_load(&checkpoint_running)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CHECKPOINT_INTERVAL;
+        while (atomic_load(&checkpoint_running) &&
+               pthread_cond_timedwait(&checkpoint_cond, &checkpoint_mutex, &deadline) != ETIMEDOUT);
+        if (!atomic_load(&checkpoint_running)) break;
+
+        pthread_mutex_unlock(&checkpoint_mutex);
+        datamgr_checkpoint(checkpoint_path);
+        pthread_mutex_lock(&checkpoint_mutex);
+    }
+    pthread_mutex_unlock(&checkpoint_mutex);
+    return NULL;
+}
+
+int datamgr_start_checkpoints(const char *path) {
+    if (path == NULL || atomic_load(&checkpoint_running)) return DATAMGR_FAILURE;
+
+    checkpoint_path = strdup(path);
+    if (checkpoint_path == NULL) return DATAMGR_FAILURE;
+
+    atomic_store(&checkpoint_running, 1);
+    if (pthread_create(&checkpoint_tid, NULL, checkpoint_thread, NULL) != 0) {
+        atomic_store(&checkpoint_running, 0);
+        free(checkpoint_path);
+        checkpoint_path = NULL;
+        return DATAMGR_FAILURE;
+    }
+    return DATAMGR_SUCCESS;
 }
@@ -1,26 +1,85 @@
 #ifndef _DATAMGR_H_
 #define _DATAMGR_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include "config.h"
+#include "rollup.h"
 
 #define DATAMGR_FAILURE -1
 #define DATAMGR_SUCCESS 0
 
+// Current state of a sensor as seen by other threads
+typedef struct datamgr_snapshot {
+    sensor_id_t id;
+    uint16_t room_id;
+    sensor_value_t last_value;
+    sensor_value_t avg;
+    sensor_ts_t last_ts;
+    int alarm;                  // alert_level_t of the running average
+    unsigned int anomalies;     // ANOMALY_* flags of the last reading
+    uint32_t duplicates;
+} datamgr_snapshot_t;
+
+typedef void (*datamgr_snapshot_fn)(const datamgr_snapshot_t *snapshot, void *arg);
+
 // Initialize the data manager
 void datamgr_init(void);
 
-// Parse the sensor map file
+// Parse the sensor map file, "<room id> <sensor id>" per line
+// Exits if a line is malformed, the line numbers are in the log. A sensor listed twice keeps its first room.
 void datamgr_parse_sensor_files(FILE *fp_sensor_map, FILE *fp_sensor_data);
 
+// Reload the sensor map at 'path' and publish it without blocking readers
+// The state of sensors that remain in the map is carried over
+int datamgr_reload_sensor_map(const char *path);
+
+// Load per-sensor and per-room alert thresholds from 'path' and apply them to the current map
+// Without a config file the compile-time SET_MIN_TEMP/SET_MAX_TEMP thresholds are used.
+int datamgr_load_alert_config(const char *path);
+
+// Watch the sensor map at 'path' and the alert config with inotify and reload them whenever they change
+int datamgr_watch_sensor_map(const char *path);
+
+// Restore the sensor state saved in the checkpoint at 'path' for the sensors in the current map
+// Call from the thread that processes the data, before the first reading. Fails if there is no valid checkpoint.
+int datamgr_restore_checkpoint(const char *path);
+
+// Write a checkpoint of all sensor state to 'path' every CHECKPOINT_INTERVAL seconds and once more in datamgr_free()
+// The state is copied under its seqlock, so the data manager is never stopped for a checkpoint.
+int datamgr_start_checkpoints(const char *path);
+
+// Write a checkpoint to 'path' now, through a temporary file that is renamed over the previous checkpoint
+// Checkpoints are double buffered, the next one is built while this one is still being written.
+int datamgr_checkpoint(const char *path);
+
 // Free all memory used by the data manager
 void datamgr_free(void);
 
 // Process a single sensor data entry
 int datamgr_process_data(sensor_data_t *data);
 
+// Check a reading against the recent readings of its sensor and remember it if it is new
+// Returns true for a resend of a reading that was already accepted; safe to call from any thread.
+// A sensor that is not in the loaded map has no history, its readings are never duplicates.
+bool datamgr_is_duplicate(const sensor_data_t *data);
+
 // Get the running average for a given sensor ID
 sensor_value_t datamgr_get_avg(sensor_id_t sensor_id);
 
+// Set the callback that receives the 1 minute and 1 hour rollups of sensors and rooms when a window closes
+// The callback runs on the thread that calls datamgr_process_data().
+void datamgr_set_rollup_sink(rollup_emit_fn emit, void *arg);
+
+// Emit the rollup windows that are still open, e.g. before shutting down
+void datamgr_flush_rollups(void);
+
+// Take a consistent snapshot of one sensor without locking out the data manager
+int datamgr_get_snapshot(sensor_id_t sensor_id, datamgr_snapshot_t *snapshot);
+
+// Call 'fn' with a snapshot of every sensor in the map, sorted on sensor id
+// 'fn' should not block, the current sensor table is kept alive while it runs.
+void datamgr_for_each_snapshot(datamgr_snapshot_fn fn, void *arg);
+
 #endif /* _DATAMGR_H_ */
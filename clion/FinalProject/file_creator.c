@@ -8,6 +8,7 @@
 #include <time.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include "config.h"
 
 
 #define FILE_ERROR(fp, error_msg)    do {               \
@@ -24,7 +25,7 @@
 #define TEMP_DEV            5       // max afwijking vorige temperatuur in 0.1 celsius
 
 uint16_t room_id[NUM_SENSORS] = {1, 2, 3, 4, 11, 12, 13, 14};
-uint16_t sensor_id[NUM_SENSORS] = {15, 21, 37, 49, 112, 129, 132, 142};
+sensor_id_t sensor_id[NUM_SENSORS] = {15, 21, 37, 49, 112, 129, 132, 142};
 double sensor_temperature[NUM_SENSORS] = {15, 17, 18, 19, 20, 23, 24, 25}; // starting temperatures
 
 int main(int argc, char *argv[]) {
@@ -37,7 +38,7 @@ int main(int argc, char *argv[]) {
     fp_text = fopen("room_sensor.map", "w");
     FILE_ERROR(fp_text, "Couldn't create room_sensor.map\n");
     for (i = 0; i < NUM_SENSORS; i++) {
-        fprintf(fp_text, "%" PRIu16 " %" PRIu16 "\n", room_id[i], sensor_id[i]);
+        fprintf(fp_text, "%" PRIu16 " %" PRIsensor "\n", room_id[i], sensor_id[i]);
     }
     fclose(fp_text);
 
@@ -57,7 +58,7 @@ int main(int argc, char *argv[]) {
             fwrite(&(sensor_temperature[j]), sizeof(sensor_temperature[0]), 1, fp_bin);
             fwrite(&starttime, sizeof(time_t), 1, fp_bin);
 #ifdef DEBUG
-            fprintf(fp_text,"%" PRIu16 " %g %ld\n", sensor_id[j],sensor_temperature[j],(long)starttime);
+            fprintf(fp_text,"%" PRIsensor " %g %ld\n", sensor_id[j],sensor_temperature[j],(long)starttime);
 #endif
 
             // get new temperature: still needs some fine-tuning ...
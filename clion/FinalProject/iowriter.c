@@ -0,0 +1,154 @@
+#define _POSIX_C_SOURCE 200809L
+#include "iowriter.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+struct iowriter {
+    int fd;
+    bool sync;
+    size_t size;
+    char *buffers[2];
+    int filling;                // index of the buffer the caller fills
+    size_t filled;
+
+    // Shared with the I/O thread
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    const char *writing;        // buffer handed to the I/O thread, NULL once it is written
+    size_t writing_size;
+    int error;                  // errno of a failed write, reported once
+    bool closing;
+};
+
+static int write_all(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1) return errno;
+        if (n == 0) return EIO;
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static void *io_thread(void *arg) {
+    iowriter_t *writer = arg;
+    pthread_mutex_lock(&writer->lock);
+    while (true) {
+        while (writer->writing == NULL && !writer->closing) pthread_cond_wait(&writer->cond, &writer->lock);
+        if (writer->writing == NULL) break;
+        const char *data = writer->writing;
+        size_t size = writer->writing_size;
+        pthread_mutex_unlock(&writer->lock);
+
+        // The lock is not held here, so the caller keeps filling the other buffer while this one is written
+        int error = write_all(writer->fd, data, size);
+        if (error == 0 && writer->sync && fdatasync(writer->fd) == -1) error = errno;
+
+        pthread_mutex_lock(&writer->lock);
+        if (error != 0) writer->error = error;
+        writer->writing = NULL;
+        pthread_cond_broadcast(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+iowriter_t *iowriter_open(int fd, size_t buffer_size, bool sync) {
+    if (fd < 0 || buffer_size == 0) return NULL;
+    iowriter_t *writer = calloc(1, sizeof(iowriter_t));
+    if (writer == NULL) return NULL;
+    writer->fd = fd;
+    writer->sync = sync;
+    writer->size = buffer_size;
+    writer->buffers[0] = malloc(buffer_size);
+    writer->buffers[1] = malloc(buffer_size);
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if (writer->buffers[0] == NULL || writer->buffers[1] == NULL ||
+        pthread_create(&writer->thread, NULL, io_thread, writer) != 0) {
+        pthread_mutex_destroy(&writer->lock);
+        pthread_cond_destroy(&writer->cond);
+        free(writer->buffers[0]);
+        free(writer->buffers[1]);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+char *iowriter_reserve(iowriter_t *writer, size_t size) {
+    if (writer->size - writer->filled < size) return NULL;
+    return writer->buffers[writer->filling] + writer->filled;
+}
+
+void iowriter_commit(iowriter_t *writer, size_t size) {
+    writer->filled += size;
+}
+
+size_t iowriter_pending(const iowriter_t *writer) {
+    return writer->filled;
+}
+
+// Wait for the I/O thread to be done and take the error it ran into, the lock is held
+static int wait_locked(iowriter_t *writer) {
+    while (writer->writing != NULL) pthread_cond_wait(&writer->cond, &writer->lock);
+    if (writer->error == 0) return IOWRITER_SUCCESS;
+    errno = writer->error;
+    writer->error = 0;
+    return IOWRITER_FAILURE;
+}
+
+int iowriter_swap(iowriter_t *writer) {
+    pthread_mutex_lock(&writer->lock);
+    int result = wait_locked(writer);
+    if (writer->filled > 0) {
+        writer->writing = writer->buffers[writer->filling];
+        writer->writing_size = writer->filled;
+        writer->filling ^= 1;
+        writer->filled = 0;
+        pthread_cond_signal(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return result;
+}
+
+int iowriter_wait(iowriter_t *writer) {
+    pthread_mutex_lock(&writer->lock);
+    int result = wait_locked(writer);
+    pthread_mutex_unlock(&writer->lock);
+    return result;
+}
+
+int iowriter_sync(iowriter_t *writer) {
+    int result = iowriter_wait(writer);
+    if (!writer->sync && fdatasync(writer->fd) == -1) result = IOWRITER_FAILURE;
+    return result;
+}
+
+int iowriter_close(iowriter_t **writer) {
+    if (writer == NULL || *writer == NULL) return IOWRITER_FAILURE;
+    iowriter_t *w = *writer;
+
+    int result = iowriter_swap(w);
+    if (iowriter_wait(w) != IOWRITER_SUCCESS) result = IOWRITER_FAILURE;
+
+    pthread_mutex_lock(&w->lock);
+    w->closing = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    if (close(w->fd) == -1) result = IOWRITER_FAILURE;
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    free(w->buffers[0]);
+    free(w->buffers[1]);
+    free(w);
+    *writer = NULL;
+    return result;
+}
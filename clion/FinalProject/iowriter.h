@@ -0,0 +1,41 @@
+#ifndef _IOWRITER_H_
+#define _IOWRITER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define IOWRITER_SUCCESS 0
+#define IOWRITER_FAILURE -1
+
+// Double buffered file writer: the caller fills one buffer while an I/O thread writes the other.
+// Buffers change hands by swapping pointers, a slow disk only makes iowriter_swap() wait.
+typedef struct iowriter iowriter_t;
+
+// Start writing to 'fd', which the writer closes, with two buffers of 'buffer_size' bytes
+// With 'sync' every buffer is fdatasync'ed after it is written. NULL on failure.
+iowriter_t *iowriter_open(int fd, size_t buffer_size, bool sync);
+
+// Room for 'size' bytes at the end of the buffer being filled, NULL if it does not have that much left
+char *iowriter_reserve(iowriter_t *writer, size_t size);
+
+// Add 'size' bytes that were written to the reserved room to the buffer
+void iowriter_commit(iowriter_t *writer, size_t size);
+
+// Bytes in the buffer being filled
+size_t iowriter_pending(const iowriter_t *writer);
+
+// Hand the filled buffer to the I/O thread, waits only while the previous one is still being written
+// Returns -1 if writing a previous buffer failed, its data is lost and errno is set.
+int iowriter_swap(iowriter_t *writer);
+
+// Wait until every buffer that was handed over is written, returns -1 as iowriter_swap() does
+int iowriter_wait(iowriter_t *writer);
+
+// Wait until every buffer that was handed over is written and fdatasync the file
+int iowriter_sync(iowriter_t *writer);
+
+// Write what is left, stop the I/O thread and close the file
+int iowriter_close(iowriter_t **writer);
+
+#endif /* _IOWRITER_H_ */
@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 199309L
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
@@ -6,55 +6,183 @@
 #include <time.h>
 #include <string.h>
 #include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include "connmgr.h"
 #include "datamgr.h"
 #include "sbuffer.h"
 #include "sensor_db.h"
+#include "statesrv.h"
+#include "wal.h"
+#include "compress.h"
+#include "capture.h"
 #include "config.h"
 
 // Shared buffer for sensor data
 static sbuffer_t *shared_buffer = NULL;
-static pthread_mutex_t buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
 #define MAX_SENSORS 1000
-static volatile int program_running = 1;
+// Shutdown drains the pipeline: the data manager stops once it has processed every reading that was
+// accepted, the storage manager once it has stored everything the data manager processed
+static atomic_bool program_running = true;
+static atomic_bool data_manager_running = true;
+
+// The duplicate filter looks sensors up in the map the data manager loads, connections wait for it
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+static bool data_manager_ready = false;
+
+// Storage sinks that every reading goes to, data.csv unless the command line picks others
+#define MAX_SINKS 4
+#define STORAGE_BATCH_READINGS 256     // readings taken from the buffer at once
+static const storage_sink_ops_t *sinks[MAX_SINKS];
+static size_t sink_count = 0;
+
+// With the write-ahead log every accepted reading is logged before it is processed, the storage manager
+// tells the log how far the sinks have made the readings durable every WAL_APPLY_MS
+#define WAL_DIR "wal"
+#ifndef WAL_APPLY_MS
+#define WAL_APPLY_MS 5000
+#endif
+static bool wal_enabled = false;
+
+// Readings can be thinned out per sensor before they are stored, see compress.h
+static bool compress_enabled = false;
+
+static bool add_sink(const char *name) {
+    const storage_sink_ops_t *sink = storage_sink_find(name);
+    if (sink == NULL) return false;
+    for (size_t i = 0; i < sink_count; i++) {
+        if (sinks[i] == sink) return true;
+    }
+    if (sink_count == MAX_SINKS) return false;
+    sinks[sink_count++] = sink;
+    return true;
+}
+
+// Add every sink of a comma separated list
+static bool add_sinks(char *names) {
+    char *save = NULL;
+    for (char *name = strtok_r(names, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+        if (!add_sink(name)) return false;
+    }
+    return true;
+}
+
+static long elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// Make everything the sinks were given durable and tell the write-ahead log, the first 'stored' readings taken from
+// the buffer are in the sinks or dropped by compression
+static void apply_wal(const storage_sink_ops_t *const *open_sinks, void *const *states, uint64_t stored) {
+    for (size_t i = 0; i < sink_count; i++) {
+        // A sink that cannot sync keeps its readings in the log, they are replayed after a crash
+        if (states[i] && open_sinks[i]->sync(states[i]) != 0) return;
+    }
+    wal_applied(stored);
+}
+
+static void store_batch(void *const *states, const sensor_data_t *readings, size_t count) {
+    for (size_t i = 0; i < sink_count; i++) {
+        if (states[i] && sinks[i]->write_batch(states[i], readings, count) != 0) {
+            char log_msg[128];
+            snprintf(log_msg, sizeof(log_msg), "Storage manager: The %s sink failed to store readings.", sinks[i]->name);
+            write_log(log_msg);
+        }
+    }
+}
+
+// Called by the data manager once its state is loaded, or when it gives up
+static void set_data_manager_ready(void) {
+    pthread_mutex_lock(&ready_lock);
+    data_manager_ready = true;
+    pthread_cond_broadcast(&ready_cond);
+    pthread_mutex_unlock(&ready_lock);
+}
+
+static void wait_for_data_manager(void) {
+    pthread_mutex_lock(&ready_lock);
+    while (!data_manager_ready) pthread_cond_wait(&ready_cond, &ready_lock);
+    pthread_mutex_unlock(&ready_lock);
+}
+
+static void replay_reading(const sensor_data_t *data, void *arg) {
+    sbuffer_insert(shared_buffer, data);
+}
+
+static void store_rollup(const rollup_record_t *record, void *arg) {
+    if (write_rollup_to_csv((FILE *)arg, record) != 0) {
+        write_log("Data manager: Failed to store rollup.");
+    }
+}
 
 void *data_manager_thread(void *arg) {
     if (shared_buffer == NULL) {
         write_log("Data manager: Received NULL buffer pointer. Exiting thread.");
+        atomic_store(&data_manager_running, false);
+        set_data_manager_ready();
         pthread_exit(NULL);
     }
 
     datamgr_init();
+    datamgr_load_alert_config("alerts.conf");
     FILE *room_sensor_map = fopen("room_sensor.map", "r");
     if (room_sensor_map == NULL) {
         write_log("Data manager: Failed to open room_sensor.map. Exiting.");
         datamgr_free();
+        atomic_store(&data_manager_running, false);
+        set_data_manager_ready();
         pthread_exit(NULL);
     }
 
     datamgr_parse_sensor_files(room_sensor_map, NULL);
     fclose(room_sensor_map);
 
-    while (program_running) {
-        sensor_data_t *data = NULL;
-        pthread_mutex_lock(&buffer_mutex);
-        int result = sbuffer_peek(shared_buffer, &data);
-        if (result == SBUFFER_SUCCESS && data) {
-            if (data->processed == 0) {
-                if (datamgr_process_data(data) == DATAMGR_SUCCESS) {
-                    data->processed = 1;
-                }
-            }
+    // Resume with the running averages, alarms and rollups of the previous run
+    datamgr_restore_checkpoint("datamgr.ckpt");
+    if (datamgr_start_checkpoints("datamgr.ckpt") != DATAMGR_SUCCESS) {
+        write_log("Data manager: Failed to start checkpoints, state is not saved.");
+    }
+    set_data_manager_ready();
+
+    if (datamgr_watch_sensor_map("room_sensor.map") != DATAMGR_SUCCESS) {
+        write_log("Data manager: Failed to watch room_sensor.map, hot reload disabled.");
+    }
+
+    FILE *rollup_csv = open_rollup_csv(false);
+    if (rollup_csv == NULL) {
+        write_log("Data manager: Failed to open rollups.csv, rollups are not stored.");
+    } else {
+        datamgr_set_rollup_sink(store_rollup, rollup_csv);
+    }
+
+    while (true) {
+        // Readings only arrive while the connection manager runs, after that an empty buffer stays empty
+        bool ingest_done = !atomic_load(&program_running);
+        sensor_data_t data;
+        int result = sbuffer_peek_unprocessed(shared_buffer, &data);
+        if (result == SBUFFER_SUCCESS) {
+            // Readings of unknown sensors are logged by the data manager and passed on,
+            // retrying them would stall the buffer until the sensor map is reloaded
+            datamgr_process_data(&data);
+            sbuffer_mark_processed(shared_buffer);
         }
-        pthread_mutex_unlock(&buffer_mutex);
 
         if (result == SBUFFER_EMPTY) {
+            if (ingest_done) break;
             nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 100000000}, NULL);
         } else if (result != SBUFFER_SUCCESS) {
             write_log("Data manager: Failed to peek data.");
             nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 100000000}, NULL);
         }
     }
+
+    datamgr_flush_rollups();
+    datamgr_set_rollup_sink(NULL, NULL);
+    close_rollup_csv(rollup_csv);
+    atomic_store(&data_manager_running, false);
     pthread_exit(NULL);
 }
 
@@ -64,54 +192,202 @@ void *storage_manager_thread(void *arg) {
         pthread_exit(NULL);
     }
 
-    FILE *csv_file = open_csv(false);
-    if (!csv_file) {
-        write_log("Storage manager: Failed to initialize CSV file.");
+    void *states[MAX_SINKS];
+    size_t open_sinks = 0;
+    for (size_t i = 0; i < sink_count; i++) {
+        if ((states[i] = sinks[i]->open()) == NULL) {
+            char log_msg[128];
+            snprintf(log_msg, sizeof(log_msg), "Storage manager: Failed to open the %s sink, readings do not go there.",
+                     sinks[i]->name);
+            write_log(log_msg);
+        } else {
+            open_sinks++;
+        }
+    }
+    if (open_sinks == 0) {
+        write_log("Storage manager: No storage sink could be opened.");
         pthread_exit(NULL);
     }
 
-    write_log("Storage manager: A new data.csv file has been created.");
-
-    while (program_running) {
-        sensor_data_t *data = NULL;
-        pthread_mutex_lock(&buffer_mutex);
-        int result = sbuffer_peek(shared_buffer, &data);
-        if (result == SBUFFER_SUCCESS && data) {
-            if (data->processed == 1) { // Processed by data manager
-                if (write_to_csv(csv_file, data->id, data->value, data->ts) == 0) {
-                    data->processed = 2;
-                }
-            }
-            if (data->processed == 2) {
-                if (sbuffer_remove(shared_buffer, &data) == SBUFFER_SUCCESS) {
-                    free(data);
-                    data = NULL;
-                } else {
-                    write_log("Storage manager: Failed to remove data from buffer.");
+    sensor_data_t batch[STORAGE_BATCH_READINGS];
+    sensor_data_t compressed[COMPRESS_OUT_MAX(STORAGE_BATCH_READINGS)];
+    uint64_t stored = 0;
+    uint64_t stored_at_apply = 0;
+    struct timespec last_apply;
+    clock_gettime(CLOCK_MONOTONIC, &last_apply);
+    while (true) {
+        for (size_t i = 0; i < sink_count; i++) {
+            if (states[i]) sinks[i]->flush(states[i], true);
+        }
+        if (wal_enabled && elapsed_ms(&last_apply) >= WAL_APPLY_MS) {
+            uint64_t applied = stored;
+            if (compress_enabled) {
+                // Readings a swinging door holds back are not stored yet. A door that was already open at the last
+                // apply is closed, a sensor that goes quiet would keep its readings in the log forever.
+                size_t closed;
+                while ((closed = compress_close_before(stored_at_apply, batch, STORAGE_BATCH_READINGS)) > 0) {
+                    store_batch(states, batch, closed);
                 }
+                applied = compress_pending_from();
             }
+            apply_wal(sinks, states, applied);
+            stored_at_apply = stored;
+            clock_gettime(CLOCK_MONOTONIC, &last_apply);
         }
-        pthread_mutex_unlock(&buffer_mutex);
 
-        if (result == SBUFFER_EMPTY) {
+        // The buffer has its own lock, storage never holds up the data manager
+        bool processing_done = !atomic_load(&data_manager_running);
+        size_t count = 0;
+        int result = sbuffer_remove_batch(shared_buffer, batch, STORAGE_BATCH_READINGS, &count);
+
+        if (result == SBUFFER_SUCCESS) { // Processed by data manager
+            if (compress_enabled) {
+                size_t kept = compress_batch(batch, count, compressed);
+                if (kept > 0) store_batch(states, compressed, kept);
+            } else {
+                store_batch(states, batch, count);
+            }
+            stored += count;
+        } else if (result == SBUFFER_EMPTY) {
+            if (processing_done) break;
             nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 100000000}, NULL);
-        } else if (result != SBUFFER_SUCCESS) {
+        } else if (result == SBUFFER_NO_DATA) {
+            // The data manager is still busy with the oldest reading, or stopped without processing it
+            if (processing_done) break;
+            nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 1000000}, NULL);
+        } else {
             write_log("Storage manager: Unexpected error.");
             nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 100000000}, NULL);
         }
     }
-    close_csv(csv_file);
+
+    if (compress_enabled) {
+        // The readings that a swinging door still holds back end the stored lines
+        size_t drained;
+        while ((drained = compress_drain(batch, STORAGE_BATCH_READINGS)) > 0) store_batch(states, batch, drained);
+
+        uint64_t readings, kept;
+        compress_counts(&readings, &kept);
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "Storage manager: Compression stored %" PRIu64 " of %" PRIu64 " readings.",
+                 kept, readings);
+        write_log(log_msg);
+        compress_free();
+    }
+    if (wal_enabled) apply_wal(sinks, states, stored);
+
+    // Every sink logs what it stored when it closes, only failures are added here
+    for (size_t i = 0; i < sink_count; i++) {
+        if (states[i] == NULL) continue;
+        storage_sink_stats_t stats;
+        sinks[i]->flush(states[i], false);
+        sinks[i]->stats(states[i], &stats);
+        sinks[i]->close(states[i]);
+
+        if (stats.failures > 0) {
+            char log_msg[160];
+            snprintf(log_msg, sizeof(log_msg), "Storage manager: The %s sink failed to store %" PRIu64 " of %" PRIu64 " readings.",
+                     sinks[i]->name, stats.failures, stats.failures + stats.readings);
+            write_log(log_msg);
+        }
+    }
     pthread_exit(NULL);
 }
 
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-o sinks] [-n readings] [-t ms] [-s] [-b] [-q] [-a hours] [-m MB] [-w ms] [-c rule] [-C file]\n"
+                    "       [-r prefix] [-R MB] <port> <max_clients>\n"
+                    "  -o sinks     comma separated storage sinks: csv, segments, sqlite or null (default csv)\n"
+                    "  -n readings  flush data.csv after this many readings (default %d, 1 flushes every reading)\n"
+                    "  -t ms        flush readings that waited this long (default %d, 0 disables the timer)\n"
+                    "  -s           fdatasync data.csv and the segments and commit data.db synchronously on every flush\n"
+                    "  -b           same as -o csv,segments: store the readings in data/ too, compressed per block in %d second segments\n"
+                    "  -q           same as -o csv,sqlite: insert the readings into data.db too, one transaction per flush\n"
+                    "  -a hours     delete segments once the newest reading is this long past their end (default: keep them)\n"
+                    "  -m MB        delete the oldest segments while they take more than this (default: no limit)\n"
+                    "  -w ms        log accepted readings to " WAL_DIR "/ and fdatasync it every ms (%d is a good start), readings\n"
+                    "               that were not stored when the gateway crashed are stored on the next start\n"
+                    "  -c rule      compress the readings of every sensor before they are stored, the rule is\n"
+                    "               off, deadband:epsilon or swing:epsilon, with :seconds for keep-alive readings (default %d)\n"
+                    "  -C file      per sensor compression rules, lines \"default <rule>\" or \"sensor <id> <rule>\"\n"
+                    "  -r prefix    capture the raw bytes of every connection to prefix.0000, prefix.0001, ... for sensor_replay\n"
+                    "  -R MB        start the next capture file after this many MB (default %d)\n",
+            program, STORAGE_FLUSH_READINGS, STORAGE_FLUSH_MS, SEGMENT_SECONDS, WAL_SYNC_MS, COMPRESS_KEEPALIVE,
+            CAPTURE_ROTATE_MB);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <port> <max_clients>\n", argv[0]);
-        exit(EXIT_FAILURE);
+    storage_policy_t policy = {.flush_readings = STORAGE_FLUSH_READINGS, .flush_ms = STORAGE_FLUSH_MS, .sync = false,
+                               .append = false, .max_age = 0, .max_bytes = 0};
+    unsigned int wal_sync_ms = 0;
+    const char *compress_path = NULL;
+    const char *capture_prefix = NULL;
+    unsigned int capture_rotate_mb = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:n:t:sbqa:m:w:c:C:r:R:")) != -1) {
+        switch (opt) {
+            case 'o':
+                if (!add_sinks(optarg)) usage(argv[0]);
+                break;
+            case 'n':
+                policy.flush_readings = strtoul(optarg, NULL, 10);
+                break;
+            case 't':
+                policy.flush_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                policy.sync = true;
+                break;
+            case 'b':
+                add_sink("csv");
+                add_sink("segments");
+                break;
+            case 'q':
+                add_sink("csv");
+                add_sink("sqlite");
+                break;
+            case 'a':
+                policy.max_age = (sensor_ts_t)strtoul(optarg, NULL, 10) * 3600;
+                break;
+            case 'm':
+                policy.max_bytes = (uint64_t)strtoull(optarg, NULL, 10) << 20;
+                break;
+            case 'w':
+                wal_sync_ms = strtoul(optarg, NULL, 10);
+                if (wal_sync_ms == 0) usage(argv[0]);
+                wal_enabled = true;
+                break;
+            case 'c': {
+                compress_rule_t rule;
+                if (compress_parse_rule(optarg, &rule) != COMPRESS_SUCCESS) usage(argv[0]);
+                compress_set_default(&rule);
+                compress_enabled = true;
+                break;
+            }
+            case 'C':
+                compress_path = optarg;
+                compress_enabled = true;
+                break;
+            case 'r':
+                capture_prefix = optarg;
+                break;
+            case 'R':
+                capture_rotate_mb = strtoul(optarg, NULL, 10);
+                if (capture_rotate_mb == 0) usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
     }
+    if (argc - optind < 2) usage(argv[0]);
+    if (sink_count == 0) add_sink("csv");
+    // Readings the write-ahead log marked as stored are only in data.csv, a clean start without it starts the file over
+    policy.append = wal_enabled || wal_exists(WAL_DIR);
+    set_storage_policy(&policy);
 
-    int port = atoi(argv[1]);
-    int max_clients = atoi(argv[2]);
+    int port = atoi(argv[optind]);
+    int max_clients = atoi(argv[optind + 1]);
 
     if (init_logging() != 0) {
         write_log("Failed to initialize logging\n");
@@ -120,11 +396,32 @@ int main(int argc, char *argv[]) {
 
     write_log("Server started");
 
+    // Loaded after the options, so that -c sets the default that the file can override
+    if (compress_path != NULL && compress_load_config(compress_path) != COMPRESS_SUCCESS) {
+        fprintf(stderr, "Failed to load the compression rules in %s\n", compress_path);
+        exit(EXIT_FAILURE);
+    }
+
     if (sbuffer_init(&shared_buffer) != SBUFFER_SUCCESS) {
         write_log("Failed to initialize shared buffer\n");
         exit(EXIT_FAILURE);
     }
 
+    // Replayed readings go in before the duplicate filter, they were accepted once already
+    if (wal_enabled) {
+        size_t replayed = 0;
+        if (wal_open(WAL_DIR, wal_sync_ms) != WAL_SUCCESS) {
+            write_log("Failed to open the write-ahead log, readings are not crash safe");
+            wal_enabled = false;
+        } else {
+            sbuffer_set_insert_hook(shared_buffer, wal_append);
+            wal_replay(replay_reading, NULL, &replayed);
+        }
+    }
+
+    // Resent readings are dropped at ingest, before they reach the data and storage managers
+    sbuffer_set_filter(shared_buffer, datamgr_is_duplicate);
+
     pthread_t data_manager_tid, storage_manager_tid;
 
     if (pthread_create(&data_manager_tid, NULL, data_manager_thread, NULL) != 0) {
@@ -137,22 +434,39 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    if (statesrv_start("gateway.sock") != STATESRV_SUCCESS) {
+        write_log("Failed to start the state server, live queries are disabled");
+    }
+
+    // Without the sensor map the duplicate filter would let every resent reading through
+    wait_for_data_manager();
     if (connmgr_init(port, max_clients, shared_buffer) != 0) {
         write_log("Failed to initialize connection manager\n");
         exit(EXIT_FAILURE);
     }
 
+    if (capture_prefix != NULL && capture_open(capture_prefix, capture_rotate_mb) != CAPTURE_SUCCESS) {
+        write_log("Failed to open the capture file, connections are not captured");
+        capture_prefix = NULL;
+    }
+
     connmgr_listen();
+    if (capture_prefix != NULL) capture_close();
 
     write_log("Server shutting down");
     connmgr_cleanup();
 
-    datamgr_free();
-
-    program_running = 0;
+    atomic_store(&program_running, false);
 
     pthread_join(data_manager_tid, NULL);
     pthread_join(storage_manager_tid, NULL);
+    if (wal_enabled) {
+        sbuffer_set_insert_hook(shared_buffer, NULL);
+        wal_close();
+    }
+
+    statesrv_stop();
+    datamgr_free();
 
     cleanup_logging();
     sbuffer_free(&shared_buffer);
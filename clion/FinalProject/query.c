@@ -0,0 +1,183 @@
+#define _POSIX_C_SOURCE 200809L
+#include "query.h"
+#include "colstore.h"
+#include "segstore.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Buffers that are reused from block to block
+typedef struct block_buffer {
+    uint8_t *data;
+    size_t size;
+    sensor_data_t *readings;
+    size_t count;
+} block_buffer_t;
+
+static bool range_overlaps(const query_t *query, sensor_ts_t min_ts, sensor_ts_t max_ts) {
+    return max_ts >= query->from && min_ts < query->to;
+}
+
+static bool block_may_match(const query_t *query, const segstore_index_entry_t *entry) {
+    if (entry->count == 0 || !range_overlaps(query, entry->min_ts, entry->max_ts)) return false;
+    if (query->all_sensors) return true;
+    return query->sensor_id >= entry->min_id && query->sensor_id <= entry->max_id &&
+           segstore_bloom_test(entry, query->sensor_id);
+}
+
+static int read_block(int fd, const segstore_index_entry_t *entry, block_buffer_t *buffer) {
+    if (entry->size > buffer->size) {
+        uint8_t *grown = realloc(buffer->data, entry->size);
+        if (grown == NULL) return QUERY_FAILURE;
+        buffer->data = grown;
+        buffer->size = entry->size;
+    }
+    if (entry->count > buffer->count) {
+        sensor_data_t *grown = realloc(buffer->readings, entry->count * sizeof(sensor_data_t));
+        if (grown == NULL) return QUERY_FAILURE;
+        buffer->readings = grown;
+        buffer->count = entry->count;
+    }
+
+    size_t done = 0;
+    while (done < entry->size) {
+        ssize_t n = pread(fd, buffer->data + done, entry->size - done, entry->offset + done);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return QUERY_FAILURE;
+        done += n;
+    }
+    // The index could be stale if the segment was recovered after it was written, so check the block itself too
+    if (colstore_check(buffer->data, entry->size) != entry->size) return QUERY_FAILURE;
+    colstore_block_header_t header;
+    memcpy(&header, buffer->data, sizeof(header));
+    if (header.count != entry->count || colstore_decode(buffer->data, buffer->readings) != COLSTORE_SUCCESS) {
+        return QUERY_FAILURE;
+    }
+    return QUERY_SUCCESS;
+}
+
+static int query_segment(const char *path, const query_t *query, query_callback_t callback, void *arg,
+                         block_buffer_t *buffer, query_stats_t *stats) {
+    // The name of a segment gives the period of its readings, one outside the query is not even opened
+    sensor_ts_t period = segstore_segment_period(path);
+    if (period >= 0 && (period >= query->to || (period > 0 && period + SEGMENT_SECONDS <= query->from))) {
+        return QUERY_SUCCESS;
+    }
+
+    // A sealed segment whose time span misses the query is ruled out on the index header alone
+    segstore_index_header_t header;
+    if (segstore_load_index_header(path, &header) == SEGSTORE_SUCCESS &&
+        (header.count == 0 || !range_overlaps(query, header.min_ts, header.max_ts))) {
+        return QUERY_SUCCESS;
+    }
+
+    segstore_index_entry_t *entries;
+    size_t count;
+    if (segstore_load_index(path, &entries, &count) != SEGSTORE_SUCCESS) return QUERY_FAILURE;
+    stats->segments_read++;
+    stats->blocks += count;
+
+    int fd = -1;
+    int result = QUERY_SUCCESS;
+    for (size_t i = 0; i < count && result == QUERY_SUCCESS; i++) {
+        if (!block_may_match(query, &entries[i])) continue;
+        if (fd == -1 && (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+            result = QUERY_FAILURE;
+            break;
+        }
+        if (read_block(fd, &entries[i], buffer) != QUERY_SUCCESS) {
+            result = QUERY_FAILURE;
+            break;
+        }
+        stats->blocks_read++;
+        stats->readings_decoded += entries[i].count;
+
+        const sensor_data_t *reading = buffer->readings;
+        const sensor_data_t *end = buffer->readings + entries[i].count;
+        if (!query->all_sensors) {
+            // Sorted on sensor id, so the readings of one sensor are a single run
+            while (reading < end && reading->id < query->sensor_id) reading++;
+        }
+        for (; reading < end; reading++) {
+            if (!query->all_sensors && reading->id != query->sensor_id) break;
+            if (reading->ts < query->from || reading->ts >= query->to) continue;
+            stats->readings_matched++;
+            if (callback(reading, arg) != 0) {
+                result = QUERY_STOPPED;
+                break;
+            }
+        }
+    }
+    if (fd != -1) close(fd);
+    free(entries);
+    return result;
+}
+
+int query_readings(const char *dir, const query_t *query, query_callback_t callback, void *arg, query_stats_t *stats) {
+    if (dir == NULL || query == NULL || callback == NULL) return QUERY_FAILURE;
+    query_stats_t local_stats;
+    if (stats == NULL) stats = &local_stats;
+    memset(stats, 0, sizeof(*stats));
+
+    char **paths;
+    size_t count;
+    if (segstore_list(dir, &paths, &count) != SEGSTORE_SUCCESS) return QUERY_FAILURE;
+    stats->segments = count;
+
+    block_buffer_t buffer = {0};
+    int result = QUERY_SUCCESS;
+    for (size_t i = 0; i < count && result == QUERY_SUCCESS; i++) {
+        result = query_segment(paths[i], query, callback, arg, &buffer, stats);
+    }
+    free(buffer.data);
+    free(buffer.readings);
+    segstore_free_list(paths, count);
+    return result;
+}
+
+static int aggregate_reading(const sensor_data_t *reading, void *arg) {
+    query_aggregate_t *aggregate = arg;
+    if (aggregate->count++ == 0) {
+        aggregate->min = aggregate->max = reading->value;
+        aggregate->first = aggregate->last = reading->ts;
+    } else {
+        if (reading->value < aggregate->min) aggregate->min = reading->value;
+        if (reading->value > aggregate->max) aggregate->max = reading->value;
+        if (reading->ts < aggregate->first) aggregate->first = reading->ts;
+        if (reading->ts > aggregate->last) aggregate->last = reading->ts;
+    }
+    aggregate->sum += reading->value;
+    return 0;
+}
+
+int query_aggregate(const char *dir, const query_t *query, query_aggregate_t *aggregate, query_stats_t *stats) {
+    if (aggregate == NULL) return QUERY_FAILURE;
+    memset(aggregate, 0, sizeof(*aggregate));
+    return query_readings(dir, query, aggregate_reading, aggregate, stats);
+}
+
+bool query_parse_time(const char *text, sensor_ts_t *ts) {
+    char *end;
+    long long seconds = strtoll(text, &end, 10);
+    if (end != text && *end == '\0') {
+        *ts = (sensor_ts_t)seconds;
+        return true;
+    }
+
+    struct tm tm = {0};
+    int consumed = 0;
+    if (sscanf(text, "%d-%d-%d %d:%d%n:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+               &consumed, &tm.tm_sec, &consumed) < 5 || text[consumed] != '\0') {
+        return false;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    tm.tm_isdst = -1;
+    time_t t = mktime(&tm);
+    if (t == (time_t)-1) return false;
+    *ts = t;
+    return true;
+}
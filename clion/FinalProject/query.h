@@ -0,0 +1,55 @@
+#ifndef _QUERY_H_
+#define _QUERY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+#define QUERY_SUCCESS 0
+#define QUERY_FAILURE -1
+#define QUERY_STOPPED 1         // the callback asked to stop
+
+// Readings with from <= ts < to, of one sensor or of all of them
+typedef struct query {
+    sensor_ts_t from;
+    sensor_ts_t to;
+    bool all_sensors;
+    sensor_id_t sensor_id;
+} query_t;
+
+// How much of the store a query had to touch
+typedef struct query_stats {
+    uint64_t segments;          // in the store
+    uint64_t segments_read;     // whose index did not rule them out
+    uint64_t blocks;            // in the segments that were read
+    uint64_t blocks_read;       // decoded, the others were skipped on their index entry
+    uint64_t readings_decoded;
+    uint64_t readings_matched;
+} query_stats_t;
+
+typedef struct query_aggregate {
+    uint64_t count;
+    sensor_value_t min;
+    sensor_value_t max;
+    double sum;
+    sensor_ts_t first;          // earliest and latest timestamp
+    sensor_ts_t last;
+} query_aggregate_t;
+
+// Called for every matching reading, a non-zero return stops the query
+typedef int (*query_callback_t)(const sensor_data_t *reading, void *arg);
+
+// Stream the readings in the segment store in 'dir' that match the query
+// Readings come segment by segment, and sorted on sensor id and timestamp inside a block (see colstore.h).
+// 'stats' may be NULL. Returns 0 on success, QUERY_STOPPED if the callback stopped it, -1 on failure.
+int query_readings(const char *dir, const query_t *query, query_callback_t callback, void *arg, query_stats_t *stats);
+
+// Count, minimum, maximum, sum and time span of the readings that match the query
+// 'aggregate->count' is 0 if nothing matched. Returns 0 on success, -1 on failure.
+int query_aggregate(const char *dir, const query_t *query, query_aggregate_t *aggregate, query_stats_t *stats);
+
+// Parse a time as seconds since the epoch or as "YYYY-MM-DD HH:MM[:SS]" local time, false if it is neither
+bool query_parse_time(const char *text, sensor_ts_t *ts);
+
+#endif /* _QUERY_H_ */
@@ -0,0 +1,136 @@
+#include "rollup.h"
+#include <stddef.h>
+
+const sensor_ts_t rollup_widths[ROLLUP_LEVELS] = {60, 3600};
+
+static sensor_ts_t window_start(sensor_ts_t ts, sensor_ts_t width) {
+    sensor_ts_t start = ts - ts % width;
+    return (ts % width < 0) ? start - width : start;
+}
+
+static void heap_swap(rollup_reorder_t *reorder, uint32_t i, uint32_t j) {
+    rollup_pending_t tmp = reorder->heap[i];
+    reorder->heap[i] = reorder->heap[j];
+    reorder->heap[j] = tmp;
+}
+
+void rollup_reorder_push(rollup_reorder_t *reorder, sensor_value_t value, sensor_ts_t ts) {
+    if (reorder->count == 0 || ts > reorder->max_ts) reorder->max_ts = ts;
+
+    uint32_t i = reorder->count++;
+    reorder->heap[i].ts = ts;
+    reorder->heap[i].value = value;
+    while (i > 0 && reorder->heap[(i - 1) / 2].ts > reorder->heap[i].ts) {
+        heap_swap(reorder, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+bool rollup_reorder_pop(rollup_reorder_t *reorder, sensor_value_t *value, sensor_ts_t *ts, bool drain) {
+    if (reorder->count == 0) return false;
+    if (!drain && reorder->count < ROLLUP_REORDER_SLOTS &&
+        reorder->heap[0].ts > reorder->max_ts - ROLLUP_REORDER_DELAY) {
+        return false;
+    }
+
+    *value = reorder->heap[0].value;
+    *ts = reorder->heap[0].ts;
+    reorder->heap[0] = reorder->heap[--reorder->count];
+
+    uint32_t i = 0;
+    while (1) {
+        uint32_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < reorder->count && reorder->heap[left].ts < reorder->heap[smallest].ts) smallest = left;
+        if (right < reorder->count && reorder->heap[right].ts < reorder->heap[smallest].ts) smallest = right;
+        if (smallest == i) break;
+        heap_swap(reorder, i, smallest);
+        i = smallest;
+    }
+    return true;
+}
+
+static void window_emit(rollup_window_t *window, rollup_scope_t scope, uint32_t id, sensor_ts_t width,
+                        rollup_emit_fn emit, void *arg) {
+    window->revision++;
+    if (emit != NULL) {
+        rollup_record_t record = {.scope = scope, .id = id, .width = width, .window = *window};
+        emit(&record, arg);
+    }
+}
+
+static void window_add(rollup_window_t *window, sensor_ts_t start, sensor_value_t value, sensor_ts_t ts) {
+    if (window->count == 0) {
+        *window = (rollup_window_t){.start = start, .count = 1, .sum = value, .min = value, .max = value,
+                                    .first = value, .last = value, .first_ts = ts, .last_ts = ts};
+        return;
+    }
+    window->count++;
+    window->sum += value;
+    if (value < window->min) window->min = value;
+    if (value > window->max) window->max = value;
+    // First and last follow the reading timestamps, not the arrival order
+    if (ts < window->first_ts) {
+        window->first = value;
+        window->first_ts = ts;
+    }
+    if (ts >= window->last_ts) {
+        window->last = value;
+        window->last_ts = ts;
+    }
+}
+
+void rollup_add(rollup_state_t *state, rollup_scope_t scope, uint32_t id,
+                sensor_value_t value, sensor_ts_t ts, rollup_emit_fn emit, void *arg) {
+    if (!state->started || ts > state->max_ts) state->max_ts = ts;
+    state->started = true;
+    sensor_ts_t watermark = state->max_ts - ROLLUP_REORDER_DELAY;
+
+    bool late = false, corrected = false;
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        sensor_ts_t width = rollup_widths[level];
+        sensor_ts_t start = window_start(ts, width);
+        rollup_window_t *window = &state->windows[level][(start / width % ROLLUP_SLOTS + ROLLUP_SLOTS) % ROLLUP_SLOTS];
+
+        if (start + width <= watermark - ROLLUP_ALLOWED_LATENESS || (window->count > 0 && window->start > start)) {
+            late = true;
+        } else {
+            if (window->count > 0 && window->start < start) {
+                // The slot is reused by a newer window, the old one is final
+                if (window->revision == 0) window_emit(window, scope, id, width, emit, arg);
+                *window = (rollup_window_t){0};
+            }
+            window_add(window, start, value, ts);
+            if (window->revision > 0) {
+                window_emit(window, scope, id, width, emit, arg);
+                corrected = true;
+            }
+        }
+
+        // Emit the windows the watermark has passed, oldest first
+        for (int n = 0; n < ROLLUP_SLOTS; n++) {
+            rollup_window_t *oldest = NULL;
+            for (int slot = 0; slot < ROLLUP_SLOTS; slot++) {
+                rollup_window_t *candidate = &state->windows[level][slot];
+                if (candidate->count > 0 && candidate->revision == 0 && candidate->start + width <= watermark &&
+                    (oldest == NULL || candidate->start < oldest->start)) {
+                    oldest = candidate;
+                }
+            }
+            if (oldest == NULL) break;
+            window_emit(oldest, scope, id, width, emit, arg);
+        }
+    }
+    if (late) state->late++;
+    if (corrected) state->corrections++;
+}
+
+void rollup_flush(rollup_state_t *state, rollup_scope_t scope, uint32_t id, rollup_emit_fn emit, void *arg) {
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        for (int slot = 0; slot < ROLLUP_SLOTS; slot++) {
+            rollup_window_t *window = &state->windows[level][slot];
+            if (window->count > 0 && window->revision == 0) {
+                window_emit(window, scope, id, rollup_widths[level], emit, arg);
+            }
+        }
+    }
+}
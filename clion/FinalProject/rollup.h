@@ -0,0 +1,91 @@
+#ifndef _ROLLUP_H_
+#define _ROLLUP_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "config.h"
+
+#define ROLLUP_LEVELS 2     // 1 minute and 1 hour tumbling windows
+
+// Seconds a reading may arrive after a reading with a later timestamp without being late,
+// the event-time watermark trails the largest timestamp seen by this much
+#ifndef ROLLUP_REORDER_DELAY
+#define ROLLUP_REORDER_DELAY 5
+#endif
+
+// Seconds after the watermark passed the end of a window during which late readings still correct it
+#ifndef ROLLUP_ALLOWED_LATENESS
+#define ROLLUP_ALLOWED_LATENESS 120
+#endif
+
+#define ROLLUP_REORDER_SLOTS 8
+#define ROLLUP_SLOTS ((ROLLUP_ALLOWED_LATENESS + ROLLUP_REORDER_DELAY) / 60 + 2)
+
+typedef enum {
+    ROLLUP_SENSOR, ROLLUP_ROOM
+} rollup_scope_t;
+
+// Aggregate of one tumbling window, count is 0 while the slot is unused
+typedef struct rollup_window {
+    sensor_ts_t start;
+    uint32_t count;
+    uint32_t revision;      // number of times the window was emitted, 2 and up are corrections
+    double sum;
+    sensor_value_t min;
+    sensor_value_t max;
+    sensor_value_t first;
+    sensor_value_t last;
+    sensor_ts_t first_ts;
+    sensor_ts_t last_ts;
+} rollup_window_t;
+
+// Windows of one sensor or room that are open or still accept corrections
+typedef struct rollup_state {
+    rollup_window_t windows[ROLLUP_LEVELS][ROLLUP_SLOTS];
+    bool started;
+    sensor_ts_t max_ts;     // largest timestamp added so far
+    uint32_t late;          // readings dropped because they were later than the allowed lateness
+    uint32_t corrections;   // emitted windows that were updated by a late reading
+} rollup_state_t;
+
+typedef struct rollup_pending {
+    sensor_ts_t ts;
+    sensor_value_t value;
+} rollup_pending_t;
+
+// Bounded per-sensor buffer that hands readings to the windows in timestamp order
+typedef struct rollup_reorder {
+    uint32_t count;
+    sensor_ts_t max_ts;
+    rollup_pending_t heap[ROLLUP_REORDER_SLOTS];    // min-heap on timestamp
+} rollup_reorder_t;
+
+// A window as handed to storage, a later record with the same scope, id, width and start replaces it
+typedef struct rollup_record {
+    rollup_scope_t scope;
+    uint32_t id;            // sensor id or room id, depending on the scope
+    sensor_ts_t width;      // window length in seconds
+    rollup_window_t window;
+} rollup_record_t;
+
+typedef void (*rollup_emit_fn)(const rollup_record_t *record, void *arg);
+
+// Window length in seconds of each granularity
+extern const sensor_ts_t rollup_widths[ROLLUP_LEVELS];
+
+// Queue a reading in the reorder buffer, call rollup_reorder_pop() until it returns false afterwards
+void rollup_reorder_push(rollup_reorder_t *reorder, sensor_value_t value, sensor_ts_t ts);
+
+// Take the oldest reading out of the buffer once the watermark passed it or the buffer is full
+// With 'drain' set every buffered reading is released.
+bool rollup_reorder_pop(rollup_reorder_t *reorder, sensor_value_t *value, sensor_ts_t *ts, bool drain);
+
+// Add a reading to its windows and emit the windows the watermark has passed
+// A reading for a window that was already emitted re-emits it as a correction.
+void rollup_add(rollup_state_t *state, rollup_scope_t scope, uint32_t id,
+                sensor_value_t value, sensor_ts_t ts, rollup_emit_fn emit, void *arg);
+
+// Emit the windows that have not been emitted yet, e.g. at shutdown
+void rollup_flush(rollup_state_t *state, rollup_scope_t scope, uint32_t id, rollup_emit_fn emit, void *arg);
+
+#endif /* _ROLLUP_H_ */
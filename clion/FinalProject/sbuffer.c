@@ -1,24 +1,45 @@
 #include <stdlib.h>
 #include <pthread.h>
+#include <time.h>
 #include "sbuffer.h"
 #include "config.h"
 #include "connmgr.h"
 #include <inttypes.h>
 #include <stdio.h>
 
+// Reading as it travels through the buffer, 16 bytes against 32 for sensor_data_t.
+// Timestamps are stored relative to the epoch of the buffer, the room id is looked up by the data manager
+// and whether a reading has been processed follows from its position in the buffer.
+typedef struct sensor_record {
+    uint32_t id;
+    int32_t ts_offset;
+    sensor_value_t value;
+} sensor_record_t;
+
+_Static_assert(sizeof(sensor_record_t) == 16, "in-flight readings should take 16 bytes");
+
 struct sbuffer_node {
-    sensor_data_t data;
+    sensor_record_t record;
     struct sbuffer_node *next;
 };
 
 struct sbuffer {
     struct sbuffer_node *head;
     struct sbuffer_node *tail;
+    struct sbuffer_node *unprocessed;   // oldest reading the data manager has not processed, NULL if none
     pthread_mutex_t buffer_lock;
-    pthread_cond_t buffer_not_empty;
     size_t size;
+    size_t processed;                   // readings at the head that the data manager is done with
+    sensor_ts_t epoch;
+    sbuffer_filter_t filter;
+    sbuffer_hook_t insert_hook;
 };
 
+static void record_to_data(const sbuffer_t *buffer, const sensor_record_t *record, sensor_data_t *data) {
+    *data = (sensor_data_t){.id = (sensor_id_t)record->id, .room_id = 0, .value = record->value,
+                            .ts = buffer->epoch + record->ts_offset};
+}
+
 int sbuffer_init(sbuffer_t **buffer) {
     if (buffer == NULL) return SBUFFER_FAILURE;
 
@@ -27,19 +48,18 @@ int sbuffer_init(sbuffer_t **buffer) {
 
     (*buffer)->head = NULL;
     (*buffer)->tail = NULL;
+    (*buffer)->unprocessed = NULL;
     (*buffer)->size = 0;
+    (*buffer)->processed = 0;
+    (*buffer)->epoch = time(NULL);
+    (*buffer)->filter = NULL;
+    (*buffer)->insert_hook = NULL;
 
     if (pthread_mutex_init(&((*buffer)->buffer_lock), NULL) != 0) {
         free(*buffer);
         return SBUFFER_FAILURE;
     }
 
-    if (pthread_cond_init(&((*buffer)->buffer_not_empty), NULL) != 0) {
-        pthread_mutex_destroy(&((*buffer)->buffer_lock));
-        free(*buffer);
-        return SBUFFER_FAILURE;
-    }
-
     return SBUFFER_SUCCESS;
 }
 
@@ -61,13 +81,12 @@ int sbuffer_free(sbuffer_t **buffer) {
 
     buf->head = NULL;
     buf->tail = NULL;
+    buf->unprocessed = NULL;
     buf->size = 0;
+    buf->processed = 0;
 
-    pthread_cond_broadcast(&(buf->buffer_not_empty));
     pthread_mutex_unlock(&(buf->buffer_lock));
-
     pthread_mutex_destroy(&(buf->buffer_lock));
-    pthread_cond_destroy(&(buf->buffer_not_empty));
 
     free(buf);
     *buffer = NULL;
@@ -76,25 +95,30 @@ int sbuffer_free(sbuffer_t **buffer) {
 }
 
 // Insert data into the shared buffer
-int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
+int sbuffer_insert(sbuffer_t *buffer, const sensor_data_t *data) {
     if (buffer == NULL || data == NULL) return SBUFFER_FAILURE;
 
-    pthread_mutex_lock(&(buffer->buffer_lock));
+    // A timestamp more than 68 years away from the start of the gateway does not fit the record
+    sensor_ts_t offset = data->ts - buffer->epoch;
+    if (offset < INT32_MIN || offset > INT32_MAX) {
+        write_log("sbuffer_insert: Timestamp out of range");
+        return SBUFFER_FAILURE;
+    }
 
-    // Deep copy the sensor data
     struct sbuffer_node *new_node = malloc(sizeof(struct sbuffer_node));
     if (new_node == NULL) {
-        pthread_mutex_unlock(&(buffer->buffer_lock));
         write_log("sbuffer_insert: Memory allocation failed");
         return SBUFFER_FAILURE;
     }
-
-    new_node->data.id = data->id;
-    new_node->data.value = data->value;
-    new_node->data.ts = data->ts;
-    new_node->data.processed = data->processed;
+    // The filter remembers what it let through, it only sees readings that are inserted for sure
+    if (buffer->filter != NULL && buffer->filter(data)) {
+        free(new_node);
+        return SBUFFER_DUPLICATE;
+    }
+    new_node->record = (sensor_record_t){.id = data->id, .ts_offset = (int32_t)offset, .value = data->value};
     new_node->next = NULL;
 
+    pthread_mutex_lock(&(buffer->buffer_lock));
     if (buffer->tail == NULL) {
         buffer->head = new_node;
         buffer->tail = new_node;
@@ -102,57 +126,110 @@ int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data) {
         buffer->tail->next = new_node;
         buffer->tail = new_node;
     }
-
+    if (buffer->unprocessed == NULL) buffer->unprocessed = new_node;
     buffer->size++;
-    pthread_cond_signal(&(buffer->buffer_not_empty));
-
+    // Under the lock, so that the hook sees the readings in buffer order
+    if (buffer->insert_hook != NULL) buffer->insert_hook(data);
     pthread_mutex_unlock(&(buffer->buffer_lock));
     return SBUFFER_SUCCESS;
 }
 
 
-// Remove data from the shared buffer
-int sbuffer_remove(sbuffer_t *buffer, sensor_data_t **data) {
+int sbuffer_set_filter(sbuffer_t *buffer, sbuffer_filter_t filter) {
+    if (buffer == NULL) return SBUFFER_FAILURE;
+    buffer->filter = filter;
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_set_insert_hook(sbuffer_t *buffer, sbuffer_hook_t hook) {
+    if (buffer == NULL) return SBUFFER_FAILURE;
+    buffer->insert_hook = hook;
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_peek_unprocessed(sbuffer_t *buffer, sensor_data_t *data) {
     if (buffer == NULL || data == NULL) return SBUFFER_FAILURE;
 
     pthread_mutex_lock(&(buffer->buffer_lock));
-
-    while (buffer->size == 0) {
-        if (pthread_cond_wait(&(buffer->buffer_not_empty), &(buffer->buffer_lock)) != 0) {
-            pthread_mutex_unlock(&(buffer->buffer_lock));
-            write_log("sbuffer_remove: Condition wait error");
-            return SBUFFER_FAILURE;
-        }
+    if (buffer->unprocessed == NULL) {
+        pthread_mutex_unlock(&(buffer->buffer_lock));
+        return SBUFFER_EMPTY;
     }
+    record_to_data(buffer, &buffer->unprocessed->record, data);
+    pthread_mutex_unlock(&(buffer->buffer_lock));
+    return SBUFFER_SUCCESS;
+}
 
-    struct sbuffer_node *node_to_remove = buffer->head;
+int sbuffer_mark_processed(sbuffer_t *buffer) {
+    if (buffer == NULL) return SBUFFER_FAILURE;
 
-    *data = malloc(sizeof(sensor_data_t));
-    if (*data == NULL) {
+    pthread_mutex_lock(&(buffer->buffer_lock));
+    if (buffer->unprocessed == NULL) {
         pthread_mutex_unlock(&(buffer->buffer_lock));
-        write_log("sbuffer_remove: Memory allocation failed");
+        return SBUFFER_EMPTY;
+    }
+    buffer->unprocessed = buffer->unprocessed->next;
+    buffer->processed++;
+    pthread_mutex_unlock(&(buffer->buffer_lock));
+    return SBUFFER_SUCCESS;
+}
+
+int sbuffer_peek(sbuffer_t *buffer, sensor_data_t *data) {
+    if (buffer == NULL || data == NULL) {
         return SBUFFER_FAILURE;
     }
 
-    **data = node_to_remove->data;
+    pthread_mutex_lock(&(buffer->buffer_lock));
+
+    if (buffer->size == 0) {
+        pthread_mutex_unlock(&(buffer->buffer_lock));
+        return SBUFFER_EMPTY;
+    }
+    if (buffer->processed == 0) {
+        pthread_mutex_unlock(&(buffer->buffer_lock));
+        return SBUFFER_NO_DATA;
+    }
+
+    record_to_data(buffer, &buffer->head->record, data);
+
+    pthread_mutex_unlock(&(buffer->buffer_lock));
+    return SBUFFER_SUCCESS;
+}
+
+// Remove data from the shared buffer
+int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data) {
+    if (buffer == NULL) return SBUFFER_FAILURE;
+
+    pthread_mutex_lock(&(buffer->buffer_lock));
+
+    if (buffer->size == 0) {
+        pthread_mutex_unlock(&(buffer->buffer_lock));
+        return SBUFFER_EMPTY;
+    }
+    if (buffer->processed == 0) {
+        pthread_mutex_unlock(&(buffer->buffer_lock));
+        return SBUFFER_NO_DATA;
+    }
+
+    struct sbuffer_node *node_to_remove = buffer->head;
+    if (data != NULL) record_to_data(buffer, &node_to_remove->record, data);
 
     buffer->head = node_to_remove->next;
     if (buffer->head == NULL) {
         buffer->tail = NULL;
     }
-
-    free(node_to_remove);
     buffer->size--;
+    buffer->processed--;
 
     pthread_mutex_unlock(&(buffer->buffer_lock));
 
+    free(node_to_remove);
     return SBUFFER_SUCCESS;
 }
 
-int sbuffer_peek(sbuffer_t *buffer, sensor_data_t **data) {
-    if (buffer == NULL || data == NULL) {
-        return SBUFFER_FAILURE;
-    }
+int sbuffer_remove_batch(sbuffer_t *buffer, sensor_data_t *data, size_t max, size_t *count) {
+    if (buffer == NULL || data == NULL || count == NULL) return SBUFFER_FAILURE;
+    *count = 0;
 
     pthread_mutex_lock(&(buffer->buffer_lock));
 
@@ -160,9 +237,32 @@ int sbuffer_peek(sbuffer_t *buffer, sensor_data_t **data) {
         pthread_mutex_unlock(&(buffer->buffer_lock));
         return SBUFFER_EMPTY;
     }
+    if (buffer->processed == 0) {
+        pthread_mutex_unlock(&(buffer->buffer_lock));
+        return SBUFFER_NO_DATA;
+    }
 
-    *data = &(buffer->head->data);
+    // Unlink the nodes under the lock and free them after it
+    struct sbuffer_node *first = buffer->head, *last = NULL;
+    size_t n = buffer->processed < max ? buffer->processed : max;
+    for (struct sbuffer_node *node = first; *count < n; node = node->next) {
+        record_to_data(buffer, &node->record, &data[(*count)++]);
+        last = node;
+    }
+    buffer->head = last->next;
+    if (buffer->head == NULL) {
+        buffer->tail = NULL;
+    }
+    last->next = NULL;
+    buffer->size -= n;
+    buffer->processed -= n;
 
     pthread_mutex_unlock(&(buffer->buffer_lock));
+
+    while (first != NULL) {
+        struct sbuffer_node *to_free = first;
+        first = first->next;
+        free(to_free);
+    }
     return SBUFFER_SUCCESS;
-}
\ No newline at end of file
+}
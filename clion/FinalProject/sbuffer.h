@@ -5,6 +5,8 @@
 #ifndef _SBUFFER_H_
 #define _SBUFFER_H_
 
+#include <stdbool.h>
+#include <stddef.h>
 #include "config.h"
 
 #define SBUFFER_FAILURE -1
@@ -15,14 +17,42 @@
 
 typedef struct sbuffer sbuffer_t;
 
+// Returns true for a reading that has to be rejected as a duplicate
+typedef bool (*sbuffer_filter_t)(const sensor_data_t *data);
+
+// Sees every reading that sbuffer_insert() accepts, in buffer order, while the buffer is locked
+typedef void (*sbuffer_hook_t)(const sensor_data_t *data);
+
 int sbuffer_init(sbuffer_t **buffer);
 
 int sbuffer_free(sbuffer_t **buffer);
 
-int sbuffer_remove(sbuffer_t *buffer, sensor_data_t **data);
+// Readings are stored in a packed 16 byte form and copied out as sensor_data_t, the room id is left 0
+// Returns SBUFFER_DUPLICATE, without taking buffer space, when the filter rejects the reading
+int sbuffer_insert(sbuffer_t *buffer, const sensor_data_t *data);
+
+// Set the duplicate filter that sbuffer_insert() applies, NULL disables it
+int sbuffer_set_filter(sbuffer_t *buffer, sbuffer_filter_t filter);
+
+// Set the hook that sbuffer_insert() calls for every accepted reading, NULL disables it
+int sbuffer_set_insert_hook(sbuffer_t *buffer, sbuffer_hook_t hook);
+
+// Copy the oldest reading that the data manager has not processed yet, SBUFFER_EMPTY if there is none
+int sbuffer_peek_unprocessed(sbuffer_t *buffer, sensor_data_t *data);
+
+// Mark the reading returned by sbuffer_peek_unprocessed() as processed, which hands it on to storage
+int sbuffer_mark_processed(sbuffer_t *buffer);
+
+// Copy the oldest reading once it has been processed
+// Returns SBUFFER_EMPTY for an empty buffer and SBUFFER_NO_DATA if the data manager is not done with it yet.
+int sbuffer_peek(sbuffer_t *buffer, sensor_data_t *data);
 
-int sbuffer_insert(sbuffer_t *buffer, sensor_data_t *data);
+// Remove the oldest reading once it has been processed and copy it into 'data' unless that is NULL
+// Returns the same codes as sbuffer_peek().
+int sbuffer_remove(sbuffer_t *buffer, sensor_data_t *data);
 
-int sbuffer_peek(sbuffer_t *buffer, sensor_data_t **data);
+// Remove up to 'max' processed readings from the head in one go and copy them into 'data'
+// '*count' is set to the number removed. Returns the same codes as sbuffer_peek().
+int sbuffer_remove_batch(sbuffer_t *buffer, sensor_data_t *data, size_t max, size_t *count);
 
 #endif  //_SBUFFER_H_
@@ -0,0 +1,678 @@
+#define _POSIX_C_SOURCE 200809L
+#include "segstore.h"
+#include "colstore.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A segment that is handed to the sealer thread, 'entries' is NULL if the index has to be rebuilt from the file
+typedef struct seal_job {
+    char *path;
+    segstore_index_entry_t *entries;
+    size_t count;
+    struct seal_job *next;
+} seal_job_t;
+
+// A segment that is being written, every reading in it has a timestamp in [start, start + SEGMENT_SECONDS)
+typedef struct segment {
+    int fd;
+    char *path;
+    sensor_ts_t start;
+    uint64_t offset;
+    segstore_index_entry_t *entries;
+    size_t count;
+    size_t capacity;
+} segment_t;
+
+struct segstore {
+    segstore_options_t options;
+    char *dir;
+
+    // Open segments, only used by the writing thread
+    segment_t open[SEGSTORE_OPEN_SEGMENTS];
+    size_t open_count;
+    segment_t late[SEGSTORE_LATE_SEGMENTS];    // most recently written first
+    size_t late_count;
+
+    // Sealing, rotation only queues the segment so the writer never waits for it
+    pthread_t sealer;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    seal_job_t *jobs;
+    seal_job_t *jobs_tail;
+    sensor_ts_t newest_ts;      // largest timestamp written, retention measures age against it
+    bool sealing;               // the sealer is working on a job
+    bool stopping;
+};
+
+static void log_message(const segstore_t *store, const char *msg) {
+    if (store->options.log != NULL) store->options.log(msg);
+}
+
+static void log_error(const segstore_t *store, const char *what, const char *path) {
+    char log_msg[320];
+    snprintf(log_msg, sizeof(log_msg), "Segment store: %s %s (%s)", what, path, strerror(errno));
+    log_message(store, log_msg);
+}
+
+static char *path_join(const char *dir, const char *name) {
+    size_t size = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(size);
+    if (path != NULL) snprintf(path, size, "%s/%s", dir, name);
+    return path;
+}
+
+// The .idx file that belongs to a .bin segment
+static char *index_path(const char *path) {
+    size_t len = strlen(path);
+    char *idx = malloc(len + 1);
+    if (idx == NULL) return NULL;
+    memcpy(idx, path, len + 1);
+    if (len >= 4 && strcmp(idx + len - 4, ".bin") == 0) memcpy(idx + len - 4, ".idx", 4);
+    return idx;
+}
+
+// Start time of a segment from its name "seg-<start>.bin", -1 if it is not a segment
+static sensor_ts_t segment_start(const char *name) {
+    long long start;
+    int end = 0;
+    if (sscanf(name, "seg-%lld.bin%n", &start, &end) != 1 || name[end] != '\0' || start < 0) return -1;
+    return (sensor_ts_t)start;
+}
+
+// Start of the period a reading belongs to, readings from before 1970 go to the first one
+static sensor_ts_t period_of(sensor_ts_t ts) {
+    return ts > 0 ? ts - ts % SEGMENT_SECONDS : 0;
+}
+
+sensor_ts_t segstore_segment_period(const char *path) {
+    const char *name = strrchr(path, '/');
+    sensor_ts_t start = segment_start(name != NULL ? name + 1 : path);
+    return start < 0 ? -1 : period_of(start);
+}
+
+static void bloom_add(uint64_t *bloom, sensor_id_t id) {
+    uint32_t h = (uint32_t)id * 0x9E3779B1u;
+    bloom[(h & 0xFF) >> 6] |= 1ULL << (h & 63);
+    bloom[((h >> 8) & 0xFF) >> 6] |= 1ULL << ((h >> 8) & 63);
+}
+
+bool segstore_bloom_test(const segstore_index_entry_t *entry, sensor_id_t id) {
+    uint32_t h = (uint32_t)id * 0x9E3779B1u;
+    return (entry->id_bloom[(h & 0xFF) >> 6] & (1ULL << (h & 63))) &&
+           (entry->id_bloom[((h >> 8) & 0xFF) >> 6] & (1ULL << ((h >> 8) & 63)));
+}
+
+static void entry_fill(segstore_index_entry_t *entry, uint64_t offset, size_t size,
+                       const sensor_data_t *readings, size_t count) {
+    memset(entry, 0, sizeof(*entry));
+    entry->offset = offset;
+    entry->size = (uint32_t)size;
+    entry->count = (uint32_t)count;
+    entry->min_ts = entry->max_ts = readings[0].ts;
+    entry->min_id = entry->max_id = readings[0].id;
+    for (size_t i = 0; i < count; i++) {
+        if (readings[i].ts < entry->min_ts) entry->min_ts = readings[i].ts;
+        if (readings[i].ts > entry->max_ts) entry->max_ts = readings[i].ts;
+        if (readings[i].id < entry->min_id) entry->min_id = readings[i].id;
+        if (readings[i].id > entry->max_id) entry->max_id = readings[i].id;
+        bloom_add(entry->id_bloom, readings[i].id);
+    }
+}
+
+// Build the index of a segment from its blocks, '*valid' is set to the length of the blocks that check out
+static int scan_segment(const char *path, segstore_index_entry_t **entries, size_t *count, uint64_t *valid) {
+    *entries = NULL;
+    *count = 0;
+    *valid = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) close(fd);
+        return SEGSTORE_FAILURE;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return SEGSTORE_SUCCESS;
+    }
+    const uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return SEGSTORE_FAILURE;
+
+    int result = SEGSTORE_SUCCESS;
+    size_t capacity = 0, size;
+    sensor_data_t *readings = NULL;
+    size_t readings_capacity = 0;
+    uint64_t offset = 0;
+    while ((size = colstore_check(data + offset, st.st_size - offset)) > 0) {
+        colstore_block_header_t header;
+        memcpy(&header, data + offset, sizeof(header));
+        if (header.count > readings_capacity) {
+            sensor_data_t *grown = realloc(readings, header.count * sizeof(sensor_data_t));
+            if (grown == NULL) {
+                result = SEGSTORE_FAILURE;
+                break;
+            }
+            readings = grown;
+            readings_capacity = header.count;
+        }
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            segstore_index_entry_t *grown = realloc(*entries, capacity * sizeof(segstore_index_entry_t));
+            if (grown == NULL) {
+                result = SEGSTORE_FAILURE;
+                break;
+            }
+            *entries = grown;
+        }
+        if (colstore_decode(data + offset, readings) != COLSTORE_SUCCESS) break;
+        entry_fill(&(*entries)[(*count)++], offset, size, readings, header.count);
+        offset += size;
+    }
+    *valid = offset;
+    free(readings);
+    munmap((void *)data, st.st_size);
+    if (result != SEGSTORE_SUCCESS) {
+        free(*entries);
+        *entries = NULL;
+        *count = 0;
+    }
+    return result;
+}
+
+static int write_index(const segstore_t *store, const char *path, const segstore_index_entry_t *entries, size_t count) {
+    char *idx = index_path(path);
+    size_t tmp_size = idx ? strlen(idx) + 5 : 0;
+    char *tmp = idx ? malloc(tmp_size) : NULL;
+    if (tmp == NULL) {
+        free(idx);
+        return SEGSTORE_FAILURE;
+    }
+    snprintf(tmp, tmp_size, "%s.tmp", idx);
+
+    segstore_index_header_t header = {.magic = SEGSTORE_INDEX_MAGIC, .version = SEGSTORE_INDEX_VERSION, .count = count};
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || entries[i].min_ts < header.min_ts) header.min_ts = entries[i].min_ts;
+        if (i == 0 || entries[i].max_ts > header.max_ts) header.max_ts = entries[i].max_ts;
+    }
+
+    int result = SEGSTORE_FAILURE;
+    FILE *f = fopen(tmp, "wb");
+    if (f != NULL) {
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+                  (count == 0 || fwrite(entries, sizeof(segstore_index_entry_t), count, f) == count) &&
+                  fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+        ok = (fclose(f) == 0) && ok;
+        if (ok && rename(tmp, idx) == 0) result = SEGSTORE_SUCCESS;
+    }
+    if (result != SEGSTORE_SUCCESS) {
+        log_error(store, "could not write the index", idx);
+        unlink(tmp);
+    }
+    free(tmp);
+    free(idx);
+    return result;
+}
+
+// Open the .idx file of a segment and read its header, NULL if there is no valid index
+static FILE *open_index(const char *path, segstore_index_header_t *header) {
+    char *idx = index_path(path);
+    FILE *f = idx ? fopen(idx, "rb") : NULL;
+    free(idx);
+    if (f == NULL) return NULL;
+    if (fread(header, sizeof(*header), 1, f) != 1 || header->magic != SEGSTORE_INDEX_MAGIC ||
+        header->version != SEGSTORE_INDEX_VERSION || header->count >= SIZE_MAX / sizeof(segstore_index_entry_t)) {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+int segstore_load_index_header(const char *path, segstore_index_header_t *header) {
+    FILE *f = open_index(path, header);
+    if (f == NULL) return SEGSTORE_FAILURE;
+    fclose(f);
+    return SEGSTORE_SUCCESS;
+}
+
+int segstore_load_index(const char *path, segstore_index_entry_t **entries, size_t *count) {
+    segstore_index_header_t header;
+    FILE *f = open_index(path, &header);
+    if (f != NULL) {
+        *entries = malloc((header.count ? header.count : 1) * sizeof(segstore_index_entry_t));
+        if (*entries != NULL && fread(*entries, sizeof(segstore_index_entry_t), header.count, f) == header.count) {
+            *count = header.count;
+            fclose(f);
+            return SEGSTORE_SUCCESS;
+        }
+        free(*entries);
+        fclose(f);
+    }
+
+    // No usable index, the segment is still being written or was never sealed
+    uint64_t valid;
+    return scan_segment(path, entries, count, &valid);
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+int segstore_list(const char *dir_path, char ***paths, size_t *count) {
+    *paths = NULL;
+    *count = 0;
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) return SEGSTORE_FAILURE;
+
+    int result = SEGSTORE_SUCCESS;
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (segment_start(entry->d_name) < 0) continue;
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            char **grown = realloc(*paths, capacity * sizeof(char *));
+            if (grown == NULL) {
+                result = SEGSTORE_FAILURE;
+                break;
+            }
+            *paths = grown;
+        }
+        if (((*paths)[*count] = path_join(dir_path, entry->d_name)) == NULL) {
+            result = SEGSTORE_FAILURE;
+            break;
+        }
+        (*count)++;
+    }
+    closedir(dir);
+
+    if (result != SEGSTORE_SUCCESS) {
+        segstore_free_list(*paths, *count);
+        *paths = NULL;
+        *count = 0;
+        return result;
+    }
+    // Names sort on start time, they all have the same number of digits
+    if (*count > 1) qsort(*paths, *count, sizeof(char *), compare_paths);
+    return SEGSTORE_SUCCESS;
+}
+
+void segstore_free_list(char **paths, size_t count) {
+    for (size_t i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+}
+
+// Delete the oldest segments that are past the age limit or do not fit the size limit
+static void apply_retention(segstore_t *store) {
+    if (store->options.max_age == 0 && store->options.max_bytes == 0) return;
+
+    char **paths;
+    size_t count;
+    if (segstore_list(store->dir, &paths, &count) != SEGSTORE_SUCCESS) return;
+
+    uint64_t *sizes = calloc(count ? count : 1, sizeof(uint64_t));
+    if (sizes == NULL) {
+        segstore_free_list(paths, count);
+        return;
+    }
+    uint64_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        char *idx = index_path(paths[i]);
+        struct stat st;
+        if (stat(paths[i], &st) == 0) sizes[i] += st.st_size;
+        if (idx && stat(idx, &st) == 0) sizes[i] += st.st_size;
+        free(idx);
+        total += sizes[i];
+    }
+
+    // Age is measured in reading time, a backfill of old readings is not deleted as it is written
+    pthread_mutex_lock(&store->lock);
+    sensor_ts_t now = store->newest_ts;
+    pthread_mutex_unlock(&store->lock);
+    if (count > 0) {
+        sensor_ts_t newest = period_of(segment_start(strrchr(paths[count - 1], '/') + 1)) + SEGMENT_SECONDS;
+        if (newest > now) now = newest;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const char *name = strrchr(paths[i], '/') + 1;
+        // Retention runs on the sealer thread, a segment without an index is open, queued or being recovered
+        char *idx = index_path(paths[i]);
+        bool sealed = idx != NULL && access(idx, F_OK) == 0;
+        free(idx);
+
+        sensor_ts_t end = period_of(segment_start(name)) + SEGMENT_SECONDS;
+        bool too_old = store->options.max_age > 0 && end + store->options.max_age < now;
+        bool too_big = store->options.max_bytes > 0 && total > store->options.max_bytes;
+        if (sealed && (too_old || too_big)) {
+            char *idx = index_path(paths[i]);
+            if (idx != NULL) unlink(idx);
+            free(idx);
+            if (unlink(paths[i]) == 0) {
+                total -= sizes[i];
+                char log_msg[320];
+                snprintf(log_msg, sizeof(log_msg), "Segment store: dropped %s (%s)", name, too_old ? "age" : "size");
+                log_message(store, log_msg);
+            }
+        }
+    }
+    free(sizes);
+    segstore_free_list(paths, count);
+}
+
+static void seal(segstore_t *store, seal_job_t *job) {
+    if (job->entries == NULL) {
+        // Left behind by a run that did not close its store, cut off a block that was half written
+        uint64_t valid;
+        if (scan_segment(job->path, &job->entries, &job->count, &valid) != SEGSTORE_SUCCESS) {
+            log_error(store, "could not recover", job->path);
+            return;
+        }
+        if (truncate(job->path, valid) == -1) log_error(store, "could not truncate", job->path);
+        char log_msg[320];
+        snprintf(log_msg, sizeof(log_msg), "Segment store: recovered %zu blocks of %s", job->count, job->path);
+        log_message(store, log_msg);
+    }
+
+    int fd = open(job->path, O_WRONLY | O_CLOEXEC);
+    if (fd != -1) {
+        fdatasync(fd);
+        close(fd);
+    }
+    write_index(store, job->path, job->entries, job->count);
+}
+
+static void *sealer_thread(void *arg) {
+    segstore_t *store = arg;
+    apply_retention(store);
+
+    pthread_mutex_lock(&store->lock);
+    while (true) {
+        while (store->jobs == NULL && !store->stopping) pthread_cond_wait(&store->cond, &store->lock);
+        seal_job_t *job = store->jobs;
+        if (job == NULL) break;
+        store->jobs = job->next;
+        if (store->jobs == NULL) store->jobs_tail = NULL;
+        store->sealing = true;
+        pthread_mutex_unlock(&store->lock);
+
+        seal(store, job);
+        free(job->path);
+        free(job->entries);
+        free(job);
+
+        pthread_mutex_lock(&store->lock);
+        store->sealing = false;
+        pthread_cond_broadcast(&store->cond);
+        pthread_mutex_unlock(&store->lock);
+
+        apply_retention(store);
+        pthread_mutex_lock(&store->lock);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return NULL;
+}
+
+static void queue_seal(segstore_t *store, char *path, segstore_index_entry_t *entries, size_t count) {
+    seal_job_t *job = malloc(sizeof(seal_job_t));
+    if (job == NULL) {
+        // The segment stays unsealed, the next start recovers it
+        free(path);
+        free(entries);
+        return;
+    }
+    *job = (seal_job_t){.path = path, .entries = entries, .count = count, .next = NULL};
+    pthread_mutex_lock(&store->lock);
+    if (store->jobs_tail != NULL) {
+        store->jobs_tail->next = job;
+    } else {
+        store->jobs = job;
+    }
+    store->jobs_tail = job;
+    pthread_cond_signal(&store->cond);
+    pthread_mutex_unlock(&store->lock);
+}
+
+// Hand a segment to the sealer, an empty one is removed instead
+static void segment_finish(segstore_t *store, segment_t *segment) {
+    close(segment->fd);
+    segment->fd = -1;
+    if (segment->count == 0) {
+        unlink(segment->path);
+        free(segment->path);
+        free(segment->entries);
+    } else {
+        queue_seal(store, segment->path, segment->entries, segment->count);
+    }
+    segment->path = NULL;
+    segment->entries = NULL;
+    segment->count = segment->capacity = 0;
+}
+
+// Create a segment for the period that starts at 'start'
+static int segment_create(segstore_t *store, segment_t *segment, sensor_ts_t start) {
+    *segment = (segment_t){.fd = -1, .start = start};
+
+    // A period that already has a segment, from a restart or late readings, gets the next free name in it
+    for (sensor_ts_t name_ts = start; name_ts < start + SEGMENT_SECONDS; name_ts++) {
+        char name[64];
+        snprintf(name, sizeof(name), "seg-%010lld.bin", (long long)name_ts);
+        char *path = path_join(store->dir, name);
+        if (path == NULL) return SEGSTORE_FAILURE;
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd != -1) {
+            segment->fd = fd;
+            segment->path = path;
+            return SEGSTORE_SUCCESS;
+        }
+        free(path);
+        if (errno != EEXIST) break;
+    }
+    log_error(store, "could not create a segment in", store->dir);
+    return SEGSTORE_FAILURE;
+}
+
+// The open segment of the period that starts at 'start', opened if needed. Opening one for a newer period
+// seals the oldest open segment. NULL if the period is older than every open one and no slot is free.
+static segment_t *segment_for(segstore_t *store, sensor_ts_t start) {
+    size_t oldest = 0;
+    for (size_t i = 0; i < store->open_count; i++) {
+        if (store->open[i].start == start) return &store->open[i];
+        if (store->open[i].start < store->open[oldest].start) oldest = i;
+    }
+    if (store->open_count == SEGSTORE_OPEN_SEGMENTS) {
+        if (start < store->open[oldest].start) return NULL;
+        segment_finish(store, &store->open[oldest]);
+        store->open[oldest] = store->open[--store->open_count];
+    }
+    segment_t *segment = &store->open[store->open_count];
+    if (segment_create(store, segment, start) != SEGSTORE_SUCCESS) return NULL;
+    store->open_count++;
+    return segment;
+}
+
+static int segment_append(segstore_t *store, segment_t *segment, sensor_data_t *readings, size_t count) {
+    if (segment->count == segment->capacity) {
+        size_t capacity = segment->capacity ? segment->capacity * 2 : 64;
+        segstore_index_entry_t *entries = realloc(segment->entries, capacity * sizeof(segstore_index_entry_t));
+        if (entries == NULL) return SEGSTORE_FAILURE;
+        segment->entries = entries;
+        segment->capacity = capacity;
+    }
+
+    uint8_t *block;
+    size_t size;
+    if (colstore_encode(readings, count, &block, &size) != COLSTORE_SUCCESS) return SEGSTORE_FAILURE;
+
+    size_t written = 0;
+    while (written < size) {
+        ssize_t n = write(segment->fd, block + written, size - written);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += n;
+    }
+    free(block);
+    if (written != size || (store->options.sync && fdatasync(segment->fd) == -1)) {
+        // Keep the segment a sequence of whole blocks
+        log_error(store, "could not write to", segment->path);
+        if (ftruncate(segment->fd, segment->offset) == -1 || lseek(segment->fd, segment->offset, SEEK_SET) == -1) {
+            log_error(store, "could not truncate", segment->path);
+        }
+        return SEGSTORE_FAILURE;
+    }
+
+    entry_fill(&segment->entries[segment->count++], segment->offset, size, readings, count);
+    segment->offset += size;
+    return SEGSTORE_SUCCESS;
+}
+
+// Readings of a period that is older than every open segment, they are appended to the late segment of that
+// period. A steady trickle of them would otherwise create a file per block and run out of names for the period.
+static int write_late(segstore_t *store, sensor_ts_t start, sensor_data_t *readings, size_t count) {
+    size_t i = 0;
+    while (i < store->late_count && store->late[i].start != start) i++;
+    if (i == store->late_count) {
+        if (store->late_count == SEGSTORE_LATE_SEGMENTS) segment_finish(store, &store->late[--i]);
+        if (segment_create(store, &store->late[i], start) != SEGSTORE_SUCCESS) {
+            store->late_count = i;
+            return SEGSTORE_FAILURE;
+        }
+        store->late_count = i + 1;
+    }
+    segment_t segment = store->late[i];
+    memmove(&store->late[1], &store->late[0], i * sizeof(segment_t));
+    store->late[0] = segment;
+    return segment_append(store, &store->late[0], readings, count);
+}
+
+static int period_compare(const void *x, const void *y) {
+    sensor_ts_t period_x = period_of(((const sensor_data_t *)x)->ts);
+    sensor_ts_t period_y = period_of(((const sensor_data_t *)y)->ts);
+    return (period_x > period_y) - (period_x < period_y);
+}
+
+segstore_t *segstore_open(const segstore_options_t *options) {
+    if (options == NULL || options->dir == NULL) return NULL;
+    segstore_t *store = calloc(1, sizeof(segstore_t));
+    if (store == NULL) return NULL;
+    store->options = *options;
+    if (mkdir(options->dir, 0755) == -1 && errno != EEXIST) {
+        log_error(store, "could not create", options->dir);
+        free(store);
+        return NULL;
+    }
+
+    store->dir = strdup(options->dir);
+    store->options.dir = store->dir;
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->cond, NULL);
+
+    // Segments without an index were still open when the previous run stopped
+    DIR *dir = store->dir ? opendir(store->dir) : NULL;
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        if (segment_start(entry->d_name) < 0) continue;
+        char *path = path_join(store->dir, entry->d_name);
+        char *idx = path ? index_path(path) : NULL;
+        if (idx != NULL && access(idx, F_OK) == -1) {
+            queue_seal(store, path, NULL, 0);
+            path = NULL;
+        }
+        free(path);
+        free(idx);
+    }
+    if (dir != NULL) closedir(dir);
+
+    if (store->dir == NULL || pthread_create(&store->sealer, NULL, sealer_thread, store) != 0) {
+        while (store->jobs != NULL) {
+            seal_job_t *job = store->jobs;
+            store->jobs = job->next;
+            free(job->path);
+            free(job);
+        }
+        pthread_mutex_destroy(&store->lock);
+        pthread_cond_destroy(&store->cond);
+        free(store->dir);
+        free(store);
+        return NULL;
+    }
+    return store;
+}
+
+int segstore_write(segstore_t *store, sensor_data_t *readings, size_t count) {
+    if (store == NULL || readings == NULL || count == 0) return SEGSTORE_FAILURE;
+
+    // Segments are cut on the timestamps of the readings, a block that spans periods is split
+    sensor_ts_t first = period_of(readings[0].ts), newest = readings[0].ts;
+    bool split = false;
+    for (size_t i = 1; i < count; i++) {
+        if (period_of(readings[i].ts) != first) split = true;
+        if (readings[i].ts > newest) newest = readings[i].ts;
+    }
+    if (split) qsort(readings, count, sizeof(sensor_data_t), period_compare);
+
+    int result = SEGSTORE_SUCCESS;
+    for (size_t begin = 0, end; begin < count; begin = end) {
+        sensor_ts_t start = period_of(readings[begin].ts);
+        for (end = begin + 1; end < count && period_of(readings[end].ts) == start; end++);
+        segment_t *segment = segment_for(store, start);
+        int written = segment != NULL ? segment_append(store, segment, readings + begin, end - begin)
+                                      : write_late(store, start, readings + begin, end - begin);
+        if (written != SEGSTORE_SUCCESS) result = SEGSTORE_FAILURE;
+    }
+
+    pthread_mutex_lock(&store->lock);
+    if (newest > store->newest_ts) store->newest_ts = newest;
+    pthread_mutex_unlock(&store->lock);
+    return result;
+}
+
+int segstore_sync(segstore_t *store) {
+    if (store == NULL) return SEGSTORE_FAILURE;
+    int result = SEGSTORE_SUCCESS;
+    for (size_t i = 0; i < store->open_count; i++) {
+        if (fdatasync(store->open[i].fd) == -1) {
+            log_error(store, "could not sync", store->open[i].path);
+            result = SEGSTORE_FAILURE;
+        }
+    }
+    for (size_t i = 0; i < store->late_count; i++) {
+        if (fdatasync(store->late[i].fd) == -1) {
+            log_error(store, "could not sync", store->late[i].path);
+            result = SEGSTORE_FAILURE;
+        }
+    }
+
+    // Sealing syncs a rotated segment
+    pthread_mutex_lock(&store->lock);
+    while (store->jobs != NULL || store->sealing) pthread_cond_wait(&store->cond, &store->lock);
+    pthread_mutex_unlock(&store->lock);
+    return result;
+}
+
+void segstore_close(segstore_t **store) {
+    if (store == NULL || *store == NULL) return;
+    segstore_t *s = *store;
+
+    while (s->open_count > 0) segment_finish(s, &s->open[--s->open_count]);
+    while (s->late_count > 0) segment_finish(s, &s->late[--s->late_count]);
+    pthread_mutex_lock(&s->lock);
+    s->stopping = true;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->sealer, NULL);
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->dir);
+    free(s);
+    *store = NULL;
+}
@@ -0,0 +1,97 @@
+#ifndef _SEGSTORE_H_
+#define _SEGSTORE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+#define SEGSTORE_SUCCESS 0
+#define SEGSTORE_FAILURE -1
+
+// Seconds of reading time covered by one segment file, segments start on a multiple of it and only hold
+// readings with a timestamp in their period
+#ifndef SEGMENT_SECONDS
+#define SEGMENT_SECONDS 3600
+#endif
+
+// Periods that have a segment open at once, readings that are later than that go to a late segment
+#ifndef SEGSTORE_OPEN_SEGMENTS
+#define SEGSTORE_OPEN_SEGMENTS 2
+#endif
+
+// Older periods that keep a late segment open, a late block for another one seals the least recently written
+#ifndef SEGSTORE_LATE_SEGMENTS
+#define SEGSTORE_LATE_SEGMENTS 4
+#endif
+
+#define SEGSTORE_INDEX_MAGIC 0x58444953u   // "SIDX"
+#define SEGSTORE_INDEX_VERSION 1
+#define SEGSTORE_BLOOM_WORDS 4             // 256 bit filter of the sensor ids in a block
+
+// Where the segments go and how long they are kept, a limit of 0 keeps everything
+typedef struct segstore_options {
+    const char *dir;
+    sensor_ts_t max_age;        // seconds between the end of a segment and the newest reading before it is deleted
+    uint64_t max_bytes;         // total size of the segments, the oldest are deleted first
+    bool sync;                  // fdatasync every block
+    void (*log)(const char *msg);   // receives rotation, retention and error messages, may be NULL
+} segstore_options_t;
+
+// Index entry of one block of a segment, the .idx file is a header followed by these
+typedef struct segstore_index_entry {
+    uint64_t offset;            // of the block in the segment
+    uint32_t size;
+    uint32_t count;
+    int64_t min_ts;
+    int64_t max_ts;
+    uint32_t min_id;
+    uint32_t max_id;
+    uint64_t id_bloom[SEGSTORE_BLOOM_WORDS];
+} segstore_index_entry_t;
+
+typedef struct segstore_index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;             // entries
+    int64_t min_ts;             // of all blocks in the segment
+    int64_t max_ts;
+} segstore_index_header_t;
+
+typedef struct segstore segstore_t;
+
+// Open the segment store in options->dir, the directory is created if needed
+// Segments that were not sealed by the previous run are recovered and sealed in the background.
+segstore_t *segstore_open(const segstore_options_t *options);
+
+// Encode the readings into one block per period they fall in and append it to the segment of that period, the
+// readings are sorted in place. A reading for a newer period seals the oldest open segment in the background,
+// readings for a period older than every open segment are appended to the late segment of that period.
+int segstore_write(segstore_t *store, sensor_data_t *readings, size_t count);
+
+// Make every block written so far durable, also those of segments that are still waiting to be sealed
+int segstore_sync(segstore_t *store);
+
+// Seal the open and late segments, wait for the background work and free the store
+void segstore_close(segstore_t **store);
+
+// Whether a block may hold readings of 'id', false means it certainly does not
+bool segstore_bloom_test(const segstore_index_entry_t *entry, sensor_id_t id);
+
+// List the segments in 'dir', oldest first. '*paths' has to be freed with segstore_free_list.
+int segstore_list(const char *dir, char ***paths, size_t *count);
+
+void segstore_free_list(char **paths, size_t count);
+
+// Start of the period of the segment at 'path', from its name, -1 if it is not a segment
+// The readings in it have a timestamp in [start, start + SEGMENT_SECONDS), those of period 0 also earlier ones.
+sensor_ts_t segstore_segment_period(const char *path);
+
+// Read only the header of the .idx file of the segment at 'path', fails if the segment is not sealed
+int segstore_load_index_header(const char *path, segstore_index_header_t *header);
+
+// Read the index of the segment at 'path', from its .idx file or, for a segment that is still open
+// or was never sealed, by scanning its blocks. '*entries' has to be freed by the caller.
+int segstore_load_index(const char *path, segstore_index_entry_t **entries, size_t *count);
+
+#endif /* _SEGSTORE_H_ */
@@ -1,47 +1,564 @@
+#define _POSIX_C_SOURCE 200809L
 #include "sensor_db.h"
 #include "connmgr.h"
+#include "colstore.h"
+#include "iowriter.h"
+#include "csvfmt.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <inttypes.h>
+#include <time.h>
 
 
 #define CSV_FILENAME "data.csv"
+#define ROLLUP_CSV_FILENAME "rollups.csv"
+#define SEGMENT_DIR "data"
+#define DB_FILENAME "data.db"
+#define CSV_BUFFER_SIZE (1 << 20)
+#define DB_BUSY_MS 1000             // how long a commit or checkpoint waits for the lock of another connection
 
-FILE* open_csv(bool append) {
-    FILE *f = fopen(CSV_FILENAME, append ? "a" : "w");
-    if (!f) {
+// Group commit of data.csv: readings collect in a buffer and are written out together
+static storage_policy_t policy = {.flush_readings = STORAGE_FLUSH_READINGS, .flush_ms = STORAGE_FLUSH_MS, .sync = false,
+                                  .append = false, .max_age = 0, .max_bytes = 0};
+static size_t pending = 0;                 // readings written since the last flush
+static struct timespec oldest_pending;     // when the first of them was written
+static uint64_t total_readings = 0;
+static uint64_t total_flushes = 0;
+static uint64_t csv_failures = 0;
+static bool csv_open = false;               // the state above belongs to one open file
+
+// Readings that wait for their block to be written to the current segment
+static sensor_data_t *bin_block = NULL;
+static size_t bin_pending = 0;
+static struct timespec bin_oldest_pending;
+static uint64_t bin_readings = 0;
+static uint64_t bin_blocks = 0;
+static uint64_t bin_failures = 0;
+
+// Readings of data.db in the transaction that is still open
+static sqlite3_stmt *db_insert = NULL;
+static sqlite3_stmt *db_begin = NULL;
+static sqlite3_stmt *db_commit = NULL;
+static bool db_in_transaction = false;
+static bool db_full_sync = false;          // commits run with synchronous=FULL and are durable
+static bool db_unsynced = false;           // a commit with synchronous=NORMAL that nothing synced yet
+static size_t db_pending = 0;
+static struct timespec db_oldest_pending;
+static uint64_t db_readings = 0;
+static uint64_t db_commits = 0;
+static uint64_t db_failures = 0;
+
+static long elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+void set_storage_policy(const storage_policy_t *new_policy) {
+    policy = *new_policy;
+    if (policy.flush_readings == 0) policy.flush_readings = 1;
+}
+
+iowriter_t *open_csv(bool append) {
+    if (csv_open) {
+        write_log("Storage manager: data.csv is already open.");
+        return NULL;
+    }
+    int fd = open(CSV_FILENAME, O_WRONLY | O_CREAT | O_CLOEXEC | (append ? O_APPEND : O_TRUNC), 0644);
+    if (fd == -1) {
         perror("Failed to open data.csv");
         return NULL;
     }
 
-    if (!append) {
-        fprintf(f, "SensorID,Value,Timestamp\n");
+    // Readings are formatted into one buffer while the I/O thread writes the other
+    iowriter_t *csv_file = iowriter_open(fd, CSV_BUFFER_SIZE, policy.sync);
+    if (csv_file == NULL) {
+        close(fd);
+        return NULL;
+    }
+    pending = 0;
+    total_readings = 0;
+    total_flushes = 0;
+    csv_failures = 0;
+    csv_open = true;
+
+    // An appended file gets the header too if it is new or empty
+    struct stat st;
+    if (!append || (fstat(fd, &st) == 0 && st.st_size == 0)) {
+        static const char header[] = "SensorID,Value,Timestamp\n";
+        memcpy(iowriter_reserve(csv_file, sizeof(header) - 1), header, sizeof(header) - 1);
+        iowriter_commit(csv_file, sizeof(header) - 1);
         write_log("A new data.csv file has been created.");
     }
 
-    return f;
+    return csv_file;
 }
 
-int write_to_csv(FILE *csv_file, sensor_id_t id, sensor_value_t value, sensor_ts_t timestamp) {
-    if (fprintf(csv_file, "%d,%.2f,%ld\n", id, value, timestamp) < 0) {
+int write_to_csv(iowriter_t *csv_file, sensor_id_t id, sensor_value_t value, sensor_ts_t timestamp) {
+    // A full buffer is handed over early, the flush policy does not count on it being large enough
+    char *line = iowriter_reserve(csv_file, CSVFMT_LINE_MAX);
+    if (line == NULL) {
+        flush_csv(csv_file);
+        line = iowriter_reserve(csv_file, CSVFMT_LINE_MAX);
+        if (line == NULL) {
+            write_log("Storage manager: No room in the data.csv buffer, a reading is lost.");
+            return -1;
+        }
+    }
+    // Same bytes as "%u,%.2f,%ld\n", without the format parsing and locale handling of printf
+    iowriter_commit(csv_file, csvfmt_reading(line, id, value, timestamp));
+    if (pending++ == 0) clock_gettime(CLOCK_MONOTONIC, &oldest_pending);
+    total_readings++;
+
+    // The reading is buffered either way, a failing flush lost readings of an earlier one
+    if (pending >= policy.flush_readings) return flush_csv(csv_file);
+    return 0;
+}
+
+int flush_csv(iowriter_t *csv_file) {
+    if (iowriter_pending(csv_file) == 0) return 0;
+    pending = 0;
+    total_flushes++;
+    // Only waits if the previous flush is still being written, an error is that of an earlier flush
+    if (iowriter_swap(csv_file) != IOWRITER_SUCCESS) {
         perror("Failed to write to data.csv");
+        write_log("Storage manager: Failed to write to data.csv, readings of an earlier flush are lost.");
         return -1;
     }
-    fflush(csv_file);
+    return 0;
+}
+
+int flush_csv_if_due(iowriter_t *csv_file) {
+    if (pending == 0 || policy.flush_ms == 0 || elapsed_ms(&oldest_pending) < (long)policy.flush_ms) return 0;
+    return flush_csv(csv_file);
+}
+
+int sync_csv(iowriter_t *csv_file) {
+    if (flush_csv(csv_file) != 0) return -1;
+    if (iowriter_sync(csv_file) != IOWRITER_SUCCESS) {
+        perror("Failed to sync data.csv");
+        write_log("Storage manager: Failed to sync data.csv.");
+        return -1;
+    }
+    return 0;
+}
+
+void close_csv(iowriter_t *csv_file) {
+    if (csv_file) {
+        pending = 0;
+        csv_open = false;
+        if (iowriter_close(&csv_file) != IOWRITER_SUCCESS) {
+            perror("Failed to write to data.csv");
+            write_log("Storage manager: Failed to write the last readings to data.csv.");
+        }
+
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "The data.csv file has been closed, %" PRIu64 " readings written in %" PRIu64 " flushes",
+                 total_readings, total_flushes);
+        write_log(log_msg);
+    }
+}
+
+sqlite3 *open_sqlite(void) {
+    if (db_insert != NULL) {
+        write_log("Storage manager: data.db is already open.");
+        return NULL;
+    }
+    sqlite3 *db;
+    if (sqlite3_open(DB_FILENAME, &db) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open data.db: %s\n", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return NULL;
+    }
+
+    // WAL lets analysts read while readings are committed, and a commit is one append to the log
+    // Only time is indexed: it grows with every insert, an index on sensor would cost six times the insert rate
+    char sql[512];
+    snprintf(sql, sizeof(sql),
+             "PRAGMA journal_mode=WAL;"
+             "PRAGMA synchronous=%s;"
+             "CREATE TABLE IF NOT EXISTS readings (sensor_id INTEGER NOT NULL, value REAL NOT NULL, ts INTEGER NOT NULL);"
+             "CREATE INDEX IF NOT EXISTS readings_ts ON readings (ts);",
+             policy.sync ? "FULL" : "NORMAL");
+    char *error = NULL;
+    sqlite3_busy_timeout(db, DB_BUSY_MS);
+    if (sqlite3_exec(db, sql, NULL, NULL, &error) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "INSERT INTO readings (sensor_id, value, ts) VALUES (?, ?, ?)", -1, &db_insert, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "BEGIN", -1, &db_begin, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "COMMIT", -1, &db_commit, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to set up data.db: %s\n", error ? error : sqlite3_errmsg(db));
+        sqlite3_free(error);
+        sqlite3_finalize(db_insert);
+        sqlite3_finalize(db_begin);
+        sqlite3_finalize(db_commit);
+        db_insert = db_begin = db_commit = NULL;
+        sqlite3_close(db);
+        return NULL;
+    }
+    db_pending = 0;
+    db_full_sync = policy.sync;
+    db_unsynced = false;
+    db_readings = 0;
+    db_commits = 0;
+    db_failures = 0;
+    write_log("The data.db database has been opened.");
+    return db;
+}
+
+static int db_step(sqlite3_stmt *statement) {
+    int result = sqlite3_step(statement);
+    sqlite3_reset(statement);
+    return result == SQLITE_DONE ? 0 : -1;
+}
+
+int write_to_sqlite(sqlite3 *db, sensor_id_t id, sensor_value_t value, sensor_ts_t timestamp) {
+    if (db_insert == NULL) return -1;
+    // A batch is one transaction, it is committed when the storage policy flushes
+    if (!db_in_transaction) {
+        if (db_step(db_begin) != 0) {
+            write_log("Storage manager: Failed to start a data.db transaction.");
+            return -1;
+        }
+        db_in_transaction = true;
+    }
+
+    sqlite3_bind_int64(db_insert, 1, id);
+    sqlite3_bind_double(db_insert, 2, value);
+    sqlite3_bind_int64(db_insert, 3, timestamp);
+    if (db_step(db_insert) != 0) {
+        fprintf(stderr, "Failed to write to data.db: %s\n", sqlite3_errmsg(db));
+        return -1;
+    }
+    if (db_pending++ == 0) clock_gettime(CLOCK_MONOTONIC, &db_oldest_pending);
+    db_readings++;
+
+    // A failing commit keeps the transaction open, it is retried with the next reading
+    if (db_pending >= policy.flush_readings) flush_sqlite(db);
+    return 0;
+}
+
+int flush_sqlite(sqlite3 *db) {
+    if (!db_in_transaction) return 0;
+    if (db_step(db_commit) != 0) {
+        fprintf(stderr, "Failed to commit to data.db: %s\n", sqlite3_errmsg(db));
+        write_log("Storage manager: Failed to commit to data.db.");
+        return -1;
+    }
+    db_in_transaction = false;
+    db_unsynced = !db_full_sync;
+    db_pending = 0;
+    db_commits++;
+    return 0;
+}
+
+int flush_sqlite_if_due(sqlite3 *db) {
+    if (db_pending == 0 || policy.flush_ms == 0 || elapsed_ms(&db_oldest_pending) < (long)policy.flush_ms) return 0;
+    return flush_sqlite(db);
+}
+
+int sync_sqlite(sqlite3 *db) {
+    if (flush_sqlite(db) != 0) return -1;
+    // A commit with synchronous=FULL syncs the SQLite WAL and with it every commit before, the first sync switches to
+    // it. The commits made before the switch are synced by a checkpoint that copies all of them, while a reader
+    // holds it up they wait for the next commit.
+    if (!db_full_sync) {
+        if (sqlite3_exec(db, "PRAGMA synchronous=FULL", NULL, NULL, NULL) != SQLITE_OK) {
+            fprintf(stderr, "Failed to switch data.db to synchronous commits: %s\n", sqlite3_errmsg(db));
+            write_log("Storage manager: Failed to sync data.db.");
+            return -1;
+        }
+        db_full_sync = true;
+    }
+    if (!db_unsynced) return 0;
+    int log_frames = 0, copied_frames = 0;
+    if (sqlite3_wal_checkpoint_v2(db, NULL, SQLITE_CHECKPOINT_PASSIVE, &log_frames, &copied_frames) != SQLITE_OK ||
+        copied_frames != log_frames) {
+        write_log("Storage manager: data.db is not synced yet, a reader holds up its checkpoint.");
+        return -1;
+    }
+    db_unsynced = false;
+    return 0;
+}
+
+void close_sqlite(sqlite3 *db) {
+    if (db) {
+        flush_sqlite(db);
+        sqlite3_finalize(db_insert);
+        sqlite3_finalize(db_begin);
+        sqlite3_finalize(db_commit);
+        db_insert = db_begin = db_commit = NULL;
+        sqlite3_close(db);
+
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "The data.db database has been closed, %" PRIu64 " readings in %" PRIu64 " commits",
+                 db_readings, db_commits);
+        write_log(log_msg);
+    }
+}
+
+// Storage sinks on top of the functions above, each backend has one open instance at most and a second open fails
+
+static void *csv_sink_open(void) {
+    return open_csv(policy.append);
+}
+
+static int csv_sink_write(void *sink, const sensor_data_t *readings, size_t count) {
+    int result = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (write_to_csv(sink, readings[i].id, readings[i].value, readings[i].ts) != 0) {
+            csv_failures++;
+            result = -1;
+        }
+    }
+    return result;
+}
+
+static int csv_sink_flush(void *sink, bool only_if_due) {
+    return only_if_due ? flush_csv_if_due(sink) : flush_csv(sink);
+}
+
+static int csv_sink_sync(void *sink) {
+    return sync_csv(sink);
+}
+
+static void csv_sink_close(void *sink) {
+    close_csv(sink);
+}
+
+static void csv_sink_stats(void *sink, storage_sink_stats_t *stats) {
+    *stats = (storage_sink_stats_t){.readings = total_readings, .flushes = total_flushes, .failures = csv_failures};
+}
+
+static void *segments_sink_open(void) {
+    return open_segments();
+}
 
+static int segments_sink_write(void *sink, const sensor_data_t *readings, size_t count) {
+    int result = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (write_to_segments(sink, readings[i].id, readings[i].value, readings[i].ts) != 0) {
+            bin_failures++;
+            result = -1;
+        }
+    }
+    return result;
+}
+
+static int segments_sink_flush(void *sink, bool only_if_due) {
+    return only_if_due ? flush_segments_if_due(sink) : flush_segments(sink);
+}
+
+static int segments_sink_sync(void *sink) {
+    return sync_segments(sink);
+}
+
+static void segments_sink_close(void *sink) {
+    close_segments(sink);
+}
+
+static void segments_sink_stats(void *sink, storage_sink_stats_t *stats) {
+    *stats = (storage_sink_stats_t){.readings = bin_readings, .flushes = bin_blocks, .failures = bin_failures};
+}
+
+static void *sqlite_sink_open(void) {
+    return open_sqlite();
+}
+
+static int sqlite_sink_write(void *sink, const sensor_data_t *readings, size_t count) {
+    int result = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (write_to_sqlite(sink, readings[i].id, readings[i].value, readings[i].ts) != 0) {
+            db_failures++;
+            result = -1;
+        }
+    }
+    return result;
+}
+
+static int sqlite_sink_flush(void *sink, bool only_if_due) {
+    return only_if_due ? flush_sqlite_if_due(sink) : flush_sqlite(sink);
+}
+
+static int sqlite_sink_sync(void *sink) {
+    return sync_sqlite(sink);
+}
+
+static void sqlite_sink_close(void *sink) {
+    close_sqlite(sink);
+}
+
+static void sqlite_sink_stats(void *sink, storage_sink_stats_t *stats) {
+    *stats = (storage_sink_stats_t){.readings = db_readings, .flushes = db_commits, .failures = db_failures};
+}
+
+// Takes storage out of the pipeline, for benchmarks
+static storage_sink_stats_t null_stats;
+static bool null_open = false;
+
+static void *null_sink_open(void) {
+    if (null_open) return NULL;
+    memset(&null_stats, 0, sizeof(null_stats));
+    null_open = true;
+    return &null_stats;
+}
+
+static int null_sink_write(void *sink, const sensor_data_t *readings, size_t count) {
+    ((storage_sink_stats_t *)sink)->readings += count;
+    return 0;
+}
+
+static int null_sink_flush(void *sink, bool only_if_due) {
+    return 0;
+}
+
+static int null_sink_sync(void *sink) {
+    return 0;
+}
+
+static void null_sink_close(void *sink) {
     char log_msg[128];
-    snprintf(log_msg, sizeof(log_msg), "Data insertion from sensor %" PRIu16, id);
+    snprintf(log_msg, sizeof(log_msg), "The null sink has been closed, %" PRIu64 " readings dropped",
+             ((storage_sink_stats_t *)sink)->readings);
     write_log(log_msg);
+    null_open = false;
+}
+
+static void null_sink_stats(void *sink, storage_sink_stats_t *stats) {
+    *stats = *(storage_sink_stats_t *)sink;
+}
 
+static const storage_sink_ops_t storage_sinks[] = {
+    {"csv", csv_sink_open, csv_sink_write, csv_sink_flush, csv_sink_sync, csv_sink_close, csv_sink_stats},
+    {"segments", segments_sink_open, segments_sink_write, segments_sink_flush, segments_sink_sync, segments_sink_close,
+     segments_sink_stats},
+    {"sqlite", sqlite_sink_open, sqlite_sink_write, sqlite_sink_flush, sqlite_sink_sync, sqlite_sink_close,
+     sqlite_sink_stats},
+    {"null", null_sink_open, null_sink_write, null_sink_flush, null_sink_sync, null_sink_close, null_sink_stats},
+};
+
+const storage_sink_ops_t *storage_sink_find(const char *name) {
+    for (size_t i = 0; i < sizeof(storage_sinks) / sizeof(storage_sinks[0]); i++) {
+        if (strcmp(storage_sinks[i].name, name) == 0) return &storage_sinks[i];
+    }
+    return NULL;
+}
+
+FILE *open_rollup_csv(bool append) {
+    FILE *f = fopen(ROLLUP_CSV_FILENAME, append ? "a" : "w");
+    if (!f) {
+        perror("Failed to open rollups.csv");
+        return NULL;
+    }
+
+    if (!append) {
+        fprintf(f, "Scope,ID,WindowStart,Width,Count,Sum,Min,Max,First,Last,Revision\n");
+        write_log("A new rollups.csv file has been created.");
+    }
+
+    return f;
+}
+
+int write_rollup_to_csv(FILE *csv_file, const rollup_record_t *record) {
+    const rollup_window_t *window = &record->window;
+    if (fprintf(csv_file, "%s,%" PRIu32 ",%ld,%ld,%" PRIu32 ",%.2f,%.2f,%.2f,%.2f,%.2f,%" PRIu32 "\n",
+                record->scope == ROLLUP_ROOM ? "room" : "sensor", record->id,
+                (long)window->start, (long)record->width, window->count,
+                window->sum, window->min, window->max, window->first, window->last, window->revision) < 0) {
+        perror("Failed to write to rollups.csv");
+        return -1;
+    }
+    fflush(csv_file);
     return 0;
 }
 
-void close_csv(FILE *csv_file) {
+void close_rollup_csv(FILE *csv_file) {
     if (csv_file) {
         fclose(csv_file);
-        write_log("The data.csv file has been closed.");
+        write_log("The rollups.csv file has been closed.");
+    }
+}
+
+segstore_t *open_segments(void) {
+    if (bin_block != NULL) {
+        write_log("Storage manager: The segment store is already open.");
+        return NULL;
+    }
+    segstore_options_t options = {.dir = SEGMENT_DIR, .max_age = policy.max_age, .max_bytes = policy.max_bytes,
+                                  .sync = policy.sync, .log = write_log};
+    segstore_t *store = segstore_open(&options);
+    if (store == NULL) {
+        perror("Failed to open the segment store");
+        return NULL;
+    }
+
+    bin_block = malloc(COLSTORE_BLOCK_READINGS * sizeof(sensor_data_t));
+    if (bin_block == NULL) {
+        segstore_close(&store);
+        return NULL;
+    }
+    bin_pending = 0;
+    bin_readings = 0;
+    bin_blocks = 0;
+    bin_failures = 0;
+    write_log("The segment store in " SEGMENT_DIR "/ has been opened.");
+    return store;
+}
+
+int write_to_segments(segstore_t *store, sensor_id_t id, sensor_value_t value, sensor_ts_t timestamp) {
+    if (bin_block == NULL) return -1;
+    if (bin_pending == COLSTORE_BLOCK_READINGS && flush_segments(store) != 0) return -1;
+
+    if (bin_pending == 0) clock_gettime(CLOCK_MONOTONIC, &bin_oldest_pending);
+    bin_block[bin_pending++] = (sensor_data_t){.id = id, .value = value, .ts = timestamp};
+    bin_readings++;
+
+    // A failing flush keeps the block, it is retried with the next reading
+    if (bin_pending == COLSTORE_BLOCK_READINGS) flush_segments(store);
+    return 0;
+}
+
+int flush_segments(segstore_t *store) {
+    if (bin_pending == 0) return 0;
+
+    // The block is written whole or not at all, the segment store cuts off a block that is cut short
+    if (segstore_write(store, bin_block, bin_pending) != SEGSTORE_SUCCESS) {
+        write_log("Storage manager: Failed to write a block to the current segment.");
+        return -1;
+    }
+    bin_blocks++;
+    bin_pending = 0;
+    return 0;
+}
+
+int flush_segments_if_due(segstore_t *store) {
+    if (bin_pending == 0 || policy.flush_ms == 0 || elapsed_ms(&bin_oldest_pending) < (long)policy.flush_ms) return 0;
+    return flush_segments(store);
+}
+
+int sync_segments(segstore_t *store) {
+    if (flush_segments(store) != 0) return -1;
+    if (segstore_sync(store) != SEGSTORE_SUCCESS) {
+        write_log("Storage manager: Failed to sync the segment store.");
+        return -1;
+    }
+    return 0;
+}
+
+void close_segments(segstore_t *store) {
+    if (store) {
+        flush_segments(store);
+        segstore_close(&store);
+        free(bin_block);
+        bin_block = NULL;
+
+        char log_msg[160];
+        snprintf(log_msg, sizeof(log_msg), "The segment store has been closed, %" PRIu64 " readings in %" PRIu64 " blocks",
+                 bin_readings, bin_blocks);
+        write_log(log_msg);
     }
 }
@@ -2,18 +2,136 @@
 #define _SENSOR_DB_H_
 
 #include "config.h"
+#include "rollup.h"
+#include "segstore.h"
+#include "iowriter.h"
 #include <stdbool.h>
 #include <stdio.h>
+#include <sqlite3.h>
 
-// Opens the CSV file
+// Default group commit of data.csv, flush after this many readings or once the oldest unflushed one is this old
+#ifndef STORAGE_FLUSH_READINGS
+#define STORAGE_FLUSH_READINGS 1000
+#endif
+#ifndef STORAGE_FLUSH_MS
+#define STORAGE_FLUSH_MS 1000
+#endif
+
+// When buffered readings are written to data.csv and the segments, how far they are pushed and how long segments are kept
+typedef struct storage_policy {
+    size_t flush_readings;      // flush after this many readings, 1 flushes every reading
+    unsigned int flush_ms;      // flush readings that waited this long, 0 only flushes on count and close
+    bool sync;                  // fdatasync after every flush, so that a power loss cannot lose flushed readings
+    bool append;                // keep the readings already in data.csv, the write-ahead log counts them as stored
+    sensor_ts_t max_age;        // segments go once the newest reading is this many seconds past their end, 0 keeps them
+    uint64_t max_bytes;         // the oldest segments are deleted while all of them take more, 0 for no limit
+} storage_policy_t;
+
+// Set the storage policy, the flush settings take effect with the next reading and retention when the segments are opened
+void set_storage_policy(const storage_policy_t *policy);
+
+// What a storage sink did since it was opened
+typedef struct storage_sink_stats {
+    uint64_t readings;          // stored, or buffered to be stored on the next flush
+    uint64_t flushes;           // flushes, blocks or commits that reached the backend
+    uint64_t failures;          // readings the sink could not store
+} storage_sink_stats_t;
+
+// A storage backend as the storage manager sees it, several sinks can be open at once
+// 'open' returns the state that the other functions take, or NULL on failure. The state of a backend is kept
+// in sensor_db.c, a sink that is already open fails to open again.
+typedef struct storage_sink_ops {
+    const char *name;
+    void *(*open)(void);
+    int (*write_batch)(void *sink, const sensor_data_t *readings, size_t count);   // -1 if a reading failed
+    int (*flush)(void *sink, bool only_if_due);                                    // only_if_due follows the policy timer
+    int (*sync)(void *sink);                                                       // flush and wait until durable
+    void (*close)(void *sink);                                                     // flushes first
+    void (*stats)(void *sink, storage_sink_stats_t *stats);
+} storage_sink_ops_t;
+
+// The sink called 'name': "csv" (data.csv), "segments" (data/), "sqlite" (data.db) or "null", which drops
+// the readings and only counts them. NULL if there is no such sink.
+const storage_sink_ops_t *storage_sink_find(const char *name);
+
+// Opens the CSV file, which is written by a background thread (see iowriter.h)
+// If `append` is true, opens the file in append mode and writes the header only to an empty file; otherwise,
+// truncates it. Fails if it is already open.
+iowriter_t *open_csv(bool append);
+
+// Writes a sensor reading to the CSV file, it reaches the file when the storage policy flushes
+// Returns 0 on success, -1 when a flush it started failed, see flush_csv().
+int write_to_csv(iowriter_t *csv_file, sensor_id_t id, sensor_value_t value, sensor_ts_t timestamp);
+
+// Hands the buffered readings to the I/O thread, which writes them and syncs them if the policy asks for it
+// Waits only while the previous flush is still being written. Returns -1 if writing an earlier flush failed.
+int flush_csv(iowriter_t *csv_file);
+
+// Flushes the buffered readings if the oldest one waited longer than the policy allows
+// Call it regularly, also when no readings arrive. Returns 0 on success, -1 on failure.
+int flush_csv_if_due(iowriter_t *csv_file);
+
+// Flushes the buffered readings and waits until they, and all earlier ones, are on disk
+// Returns 0 on success, -1 on failure.
+int sync_csv(iowriter_t *csv_file);
+
+// Flushes the CSV file, waits until everything is written and closes it
+void close_csv(iowriter_t *csv_file);
+
+// Opens the segment store in data/, which holds the readings as compressed column blocks (see colstore.h)
+// in one file per SEGMENT_SECONDS. Segments are kept as long as the storage policy allows.
+segstore_t *open_segments(void);
+
+// Adds a reading to the current block, the block is written when it is full or flushed
+// Returns 0 on success, -1 on failure.
+int write_to_segments(segstore_t *store, sensor_id_t id, sensor_value_t value, sensor_ts_t timestamp);
+
+// Writes the readings of the current block, even if it is not full, and syncs them if the policy asks for it
+// Returns 0 on success, -1 on failure.
+int flush_segments(segstore_t *store);
+
+// Writes the current block if its oldest reading waited longer than the storage policy allows
+int flush_segments_if_due(segstore_t *store);
+
+// Writes the current block and waits until every block written so far is on disk
+// Returns 0 on success, -1 on failure.
+int sync_segments(segstore_t *store);
+
+// Writes the last block and seals the current segment
+void close_segments(segstore_t *store);
+
+// Opens the SQLite database data.db in WAL mode, readings are added to its 'readings' table
+// (sensor_id, value, ts), which is created if needed and indexed on time.
+sqlite3 *open_sqlite(void);
+
+// Inserts a reading with a prepared statement, readings are committed as one transaction when the storage policy flushes
+// Returns 0 on success, -1 on failure.
+int write_to_sqlite(sqlite3 *db, sensor_id_t id, sensor_value_t value, sensor_ts_t timestamp);
+
+// Commits the open transaction, synchronously if the policy asks for it
+// Returns 0 on success, -1 on failure.
+int flush_sqlite(sqlite3 *db);
+
+// Commits the open transaction if its oldest reading waited longer than the storage policy allows
+int flush_sqlite_if_due(sqlite3 *db);
+
+// Commits the open transaction and makes it and every earlier commit durable, data.db commits synchronously from then on
+// Returns 0 on success, -1 on failure.
+int sync_sqlite(sqlite3 *db);
+
+// Commits the last readings and closes data.db
+void close_sqlite(sqlite3 *db);
+
+// Opens the rollup CSV file that receives the closed 1 minute and 1 hour windows
 // If `append` is true, opens the file in append mode; otherwise, truncates it.
-FILE *open_csv(bool append);
+FILE *open_rollup_csv(bool append);
 
-// Writes a sensor reading to the CSV file
+// Writes a rollup window to the rollup CSV file, a revision above 1 marks a correction
+// of the row with the same scope, id, start and width
 // Returns 0 on success, -1 on failure.
-int write_to_csv(FILE *csv_file, sensor_id_t id, sensor_value_t value, sensor_ts_t timestamp);
+int write_rollup_to_csv(FILE *csv_file, const rollup_record_t *record);
 
-// Closes the CSV file
-void close_csv(FILE *csv_file);
+// Closes the rollup CSV file
+void close_rollup_csv(FILE *csv_file);
 
 #endif /* _SENSOR_DB_H_ */
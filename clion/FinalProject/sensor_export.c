@@ -0,0 +1,205 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "config.h"
+#include "query.h"
+#include "arrowfile.h"
+#include "csvload.h"
+
+#define DEFAULT_DIR "data"
+
+// Sensor to room, sorted on sensor id
+typedef struct room_entry {
+    sensor_id_t sensor_id;
+    uint16_t room_id;
+} room_entry_t;
+
+typedef struct export {
+    arrowfile_t *file;
+    const query_t *query;
+    room_entry_t *rooms;
+    size_t room_count;
+} export_t;
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-c csv | -d dir] [-m map] [-s sensor] [-f from] [-t to] [-b rows] [-j threads] <output.arrow>\n"
+                    "  -c csv     read the readings from a file in the format of data.csv\n"
+                    "  -d dir     read the readings from the segment store in dir (default " DEFAULT_DIR ")\n"
+                    "  -m map     fill in the room ids from a room_sensor.map, other sensors get room 0\n"
+                    "  -s sensor  only readings of this sensor (default: all sensors)\n"
+                    "  -f from    first timestamp, as seconds since the epoch or \"YYYY-MM-DD HH:MM[:SS]\" local time\n"
+                    "  -t to      end of the range, readings at 'to' or later are left out\n"
+                    "  -b rows    rows per Arrow record batch (default %d)\n"
+                    "  -j threads threads that parse the csv (default: one per CPU)\n",
+            program, ARROWFILE_BATCH_ROWS);
+    exit(EXIT_FAILURE);
+}
+
+static int room_compare(const void *x, const void *y) {
+    const room_entry_t *room_x = x;
+    const room_entry_t *room_y = y;
+    if (room_x->sensor_id < room_y->sensor_id) return -1;
+    if (room_x->sensor_id > room_y->sensor_id) return 1;
+    return 0;
+}
+
+// Lines "<room id> <sensor id>", as the gateway reads them
+static bool load_rooms(const char *path, export_t *export) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return false;
+    }
+    size_t capacity = 0;
+    char line[128];
+    int line_nr = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line_nr++;
+        unsigned long room_id, sensor_id;
+        char extra;
+        int fields = sscanf(line, "%lu %lu %c", &room_id, &sensor_id, &extra);
+        if (fields == EOF) continue;
+        if (fields != 2 || room_id > UINT16_MAX || sensor_id > SENSOR_ID_MAX) {
+            fprintf(stderr, "%s:%d: expected \"<room id> <sensor id>\"\n", path, line_nr);
+            fclose(fp);
+            return false;
+        }
+        if (export->room_count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            room_entry_t *grown = realloc(export->rooms, capacity * sizeof(room_entry_t));
+            if (grown == NULL) {
+                fclose(fp);
+                return false;
+            }
+            export->rooms = grown;
+        }
+        export->rooms[export->room_count++] = (room_entry_t){.sensor_id = (sensor_id_t)sensor_id,
+                                                              .room_id = (uint16_t)room_id};
+    }
+    fclose(fp);
+    qsort(export->rooms, export->room_count, sizeof(room_entry_t), room_compare);
+    return true;
+}
+
+static int export_reading(const sensor_data_t *reading, void *arg) {
+    export_t *export = arg;
+    sensor_data_t row = *reading;
+    room_entry_t key = {.sensor_id = reading->id};
+    room_entry_t *room = export->room_count ? bsearch(&key, export->rooms, export->room_count, sizeof(room_entry_t),
+                                                      room_compare) : NULL;
+    row.room_id = room ? room->room_id : 0;
+    return arrowfile_append(export->file, &row) != ARROWFILE_SUCCESS;
+}
+
+static bool matches(const query_t *query, const sensor_data_t *reading) {
+    return reading->ts >= query->from && reading->ts < query->to &&
+           (query->all_sensors || reading->id == query->sensor_id);
+}
+
+static int export_readings(const sensor_data_t *readings, size_t count, void *arg) {
+    export_t *export = arg;
+    for (size_t i = 0; i < count; i++) {
+        if (matches(export->query, &readings[i]) && export_reading(&readings[i], export) != 0) return -1;
+    }
+    return 0;
+}
+
+// Lines "<id>,<value>,<ts>" after an optional header line, parsed by 'threads' threads and exported in file order
+static int export_csv(const char *path, unsigned int threads, export_t *export) {
+    csvload_stats_t stats;
+    int result = csvload_file(path, threads, export_readings, export, &stats);
+    if (result == CSVLOAD_FAILURE) {
+        perror(path);
+        return -1;
+    }
+    if (stats.malformed > 0) {
+        fprintf(stderr, "%s: skipped %" PRIu64 " lines that are not \"<sensor id>,<value>,<timestamp>\"\n", path,
+                stats.malformed);
+    }
+    return result == CSVLOAD_SUCCESS ? 0 : -1;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = DEFAULT_DIR, *csv = NULL, *map = NULL;
+    query_t query = {.from = INT64_MIN, .to = INT64_MAX, .all_sensors = true};
+    size_t batch_rows = 0;
+    unsigned int threads = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:d:m:s:f:t:b:j:")) != -1) {
+        switch (opt) {
+            case 'c':
+                csv = optarg;
+                break;
+            case 'd':
+                dir = optarg;
+                break;
+            case 'm':
+                map = optarg;
+                break;
+            case 's': {
+                char *end;
+                unsigned long id = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || id > SENSOR_ID_MAX) usage(argv[0]);
+                query.all_sensors = false;
+                query.sensor_id = (sensor_id_t)id;
+                break;
+            }
+            case 'f':
+                if (!query_parse_time(optarg, &query.from)) usage(argv[0]);
+                break;
+            case 't':
+                if (!query_parse_time(optarg, &query.to)) usage(argv[0]);
+                break;
+            case 'b':
+                batch_rows = strtoul(optarg, NULL, 10);
+                if (batch_rows == 0) usage(argv[0]);
+                break;
+            case 'j': {
+                char *end;
+                unsigned long count = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || count == 0 || count > 1024) usage(argv[0]);
+                threads = (unsigned int)count;
+                break;
+            }
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) usage(argv[0]);
+    const char *output = argv[optind];
+
+    export_t export = {.query = &query};
+    if (map != NULL && !load_rooms(map, &export)) return EXIT_FAILURE;
+
+    export.file = arrowfile_create(output, batch_rows);
+    if (export.file == NULL) {
+        perror(output);
+        free(export.rooms);
+        return EXIT_FAILURE;
+    }
+
+    int result;
+    if (csv != NULL) {
+        result = export_csv(csv, threads, &export);
+    } else {
+        result = query_readings(dir, &query, export_reading, &export, NULL) == QUERY_SUCCESS ? 0 : -1;
+        if (result != 0) fprintf(stderr, "Failed to export the segment store in %s\n", dir);
+    }
+
+    uint64_t rows = arrowfile_rows(export.file);
+    if (arrowfile_close(&export.file) != ARROWFILE_SUCCESS && result == 0) {
+        perror(output);
+        result = -1;
+    }
+    free(export.rooms);
+    if (result != 0) {
+        // Half an Arrow file is of no use to anyone
+        unlink(output);
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "%" PRIu64 " readings written to %s\n", rows, output);
+    return EXIT_SUCCESS;
+}
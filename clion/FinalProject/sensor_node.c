@@ -37,7 +37,7 @@
 
 #define LOG_PRINTF(sensor_id,temperature,timestamp)							\
       do { 												\
-    fprintf(fp_log, "%" PRIu16 " %g %ld\n", (sensor_id), (temperature), (long int)(timestamp));	\
+    fprintf(fp_log, "%" PRIsensor " %g %ld\n", (sensor_id), (temperature), (long int)(timestamp));	\
     fflush(fp_log);											\
       } while(0)
 
@@ -0,0 +1,94 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include "config.h"
+#include "query.h"
+
+#define DEFAULT_DIR "data"
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-d dir] [-s sensor] [-f from] [-t to] [-a] [-v]\n"
+                    "  -d dir     segment store to read (default " DEFAULT_DIR ")\n"
+                    "  -s sensor  only readings of this sensor (default: all sensors)\n"
+                    "  -f from    first timestamp, as seconds since the epoch or \"YYYY-MM-DD HH:MM[:SS]\" local time\n"
+                    "  -t to      end of the range, readings at 'to' or later are left out\n"
+                    "  -a         print count, min, max, average, first and last timestamp instead of the readings\n"
+                    "  -v         print how many segments and blocks were read to stderr\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+static int print_reading(const sensor_data_t *reading, void *arg) {
+    // Same format as data.csv
+    return printf("%" PRIsensor ",%.2f,%ld\n", reading->id, reading->value, (long)reading->ts) < 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *dir = DEFAULT_DIR;
+    query_t query = {.from = INT64_MIN, .to = INT64_MAX, .all_sensors = true};
+    bool aggregate = false, verbose = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:s:f:t:av")) != -1) {
+        switch (opt) {
+            case 'd':
+                dir = optarg;
+                break;
+            case 's': {
+                char *end;
+                unsigned long id = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || id > SENSOR_ID_MAX) usage(argv[0]);
+                query.all_sensors = false;
+                query.sensor_id = (sensor_id_t)id;
+                break;
+            }
+            case 'f':
+                if (!query_parse_time(optarg, &query.from)) usage(argv[0]);
+                break;
+            case 't':
+                if (!query_parse_time(optarg, &query.to)) usage(argv[0]);
+                break;
+            case 'a':
+                aggregate = true;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc) usage(argv[0]);
+
+    query_stats_t stats;
+    int result;
+    if (aggregate) {
+        query_aggregate_t total;
+        result = query_aggregate(dir, &query, &total, &stats);
+        if (result == QUERY_SUCCESS) {
+            if (total.count > 0) {
+                printf("%" PRIu64 " readings, min %.2f, max %.2f, avg %.2f, from %ld to %ld\n", total.count,
+                       total.min, total.max, total.sum / total.count, (long)total.first, (long)total.last);
+            } else {
+                printf("0 readings\n");
+            }
+        }
+    } else {
+        result = query_readings(dir, &query, print_reading, NULL, &stats);
+    }
+
+    if (result == QUERY_FAILURE) {
+        fprintf(stderr, "Failed to query the segment store in %s\n", dir);
+        return EXIT_FAILURE;
+    }
+    if (verbose) {
+        fprintf(stderr, "%" PRIu64 " of %" PRIu64 " segments, %" PRIu64 " of %" PRIu64 " blocks, "
+                        "%" PRIu64 " readings decoded, %" PRIu64 " matched\n",
+                stats.segments_read, stats.segments, stats.blocks_read, stats.blocks,
+                stats.readings_decoded, stats.readings_matched);
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,412 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "config.h"
+#include "csvload.h"
+#include "capture.h"
+#include "lib/tcpsock.h"
+
+// Bytes a connection collects before they are sent, everything pending is also sent before every wait
+#define SEND_BUFFER_BYTES 65536
+// A reading on the wire and in sensor_data: <sensor id><value><timestamp>, no padding
+#define WIRE_BYTES (sizeof(sensor_id_t) + sizeof(sensor_value_t) + sizeof(sensor_ts_t))
+#define FILE_RECORDS 4096           // records read from sensor_data at a time
+
+typedef enum replay_format {
+    FORMAT_AUTO,
+    FORMAT_CSV,
+    FORMAT_BINARY,
+    FORMAT_CAPTURE
+} replay_format_t;
+
+// One connection per sensor, or per connection in a capture, opened when it sends its first bytes
+typedef struct connection {
+    uint64_t key;
+    tcpsock_t *socket;          // NULL once a capture shows it was closed
+    size_t pending;
+    bool dirty;                 // listed in replay_t.dirty
+    char buffer[SEND_BUFFER_BYTES];
+} connection_t;
+
+typedef struct replay {
+    char *server_ip;
+    int server_port;
+    double speed;               // 0 for as fast as possible
+    const char *key_name;       // what the connections are per, for messages
+
+    connection_t **connections; // open addressing on the key
+    size_t mask;
+    size_t count;
+    connection_t **dirty;       // connections with pending bytes
+    size_t dirty_count;
+
+    bool started;
+    struct timespec start;
+    int64_t first_ns;           // time in the trace of the first reading
+    int64_t last_ns;
+    uint64_t readings;
+    uint64_t bytes;
+    int64_t max_lag_ns;
+} replay_t;
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-x speed] [-t csv|bin|cap] <file>... <server ip> <server port>\n"
+                    "  -x speed   replay the gaps between readings this many times faster, 0 for as fast as possible\n"
+                    "             (default 1)\n"
+                    "  -t format  csv for a data.csv, bin for a sensor_data file of file_creator, cap for the files of\n"
+                    "             sensor_gateway -r (default: from the start of the first file, or csv if it ends in .csv)\n"
+                    "The files are replayed one after the other. Every sensor, or every connection in a capture, gets\n"
+                    "its own connection, the gateway has to accept that many clients.\n",
+            program);
+    exit(EXIT_FAILURE);
+}
+
+static int64_t timespec_ns(const struct timespec *t) {
+    return (int64_t)t->tv_sec * 1000000000 + t->tv_nsec;
+}
+
+static size_t key_hash(uint64_t key) {
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (size_t)(key ^ (key >> 32));
+}
+
+static int send_pending(connection_t *connection) {
+    char *p = connection->buffer;
+    while (connection->pending > 0) {
+        int bytes = (int)connection->pending;
+        if (tcp_send(connection->socket, p, &bytes) != TCP_NO_ERROR) return -1;
+        p += bytes;
+        connection->pending -= bytes;
+    }
+    return 0;
+}
+
+static int send_all_pending(replay_t *replay) {
+    for (size_t i = 0; i < replay->dirty_count; i++) {
+        replay->dirty[i]->dirty = false;
+        if (send_pending(replay->dirty[i]) != 0) {
+            fprintf(stderr, "Connection of %s %" PRIu64 " was closed by the gateway\n", replay->key_name,
+                    replay->dirty[i]->key);
+            return -1;
+        }
+    }
+    replay->dirty_count = 0;
+    return 0;
+}
+
+static int grow_connections(replay_t *replay) {
+    size_t capacity = replay->connections ? (replay->mask + 1) * 2 : 64;
+    connection_t **grown = calloc(capacity, sizeof(connection_t *));
+    connection_t **dirty = realloc(replay->dirty, capacity * sizeof(connection_t *));
+    if (grown == NULL || dirty == NULL) {
+        free(grown);
+        if (dirty != NULL) replay->dirty = dirty;
+        return -1;
+    }
+    for (size_t i = 0; replay->connections != NULL && i <= replay->mask; i++) {
+        if (replay->connections[i] == NULL) continue;
+        size_t s = key_hash(replay->connections[i]->key) & (capacity - 1);
+        while (grown[s] != NULL) s = (s + 1) & (capacity - 1);
+        grown[s] = replay->connections[i];
+    }
+    free(replay->connections);
+    replay->connections = grown;
+    replay->dirty = dirty;
+    replay->mask = capacity - 1;
+    return 0;
+}
+
+// Connection of a key, opened on first use. NULL if it cannot be opened.
+static connection_t *find_connection(replay_t *replay, uint64_t key) {
+    if (replay->connections == NULL || 2 * (replay->count + 1) > replay->mask + 1) {
+        if (grow_connections(replay) != 0) return NULL;
+    }
+    size_t s = key_hash(key) & replay->mask;
+    while (replay->connections[s] != NULL && replay->connections[s]->key != key) s = (s + 1) & replay->mask;
+    connection_t *connection = replay->connections[s];
+    if (connection != NULL && connection->socket != NULL) return connection;
+
+    if (connection == NULL) {
+        connection = malloc(sizeof(connection_t));
+        if (connection == NULL) return NULL;
+        connection->key = key;
+        connection->dirty = false;
+        replay->connections[s] = connection;
+        replay->count++;
+    }
+    if (tcp_active_open(&connection->socket, replay->server_port, replay->server_ip) != TCP_NO_ERROR) {
+        fprintf(stderr, "Failed to connect to %s:%d for %s %" PRIu64 "\n", replay->server_ip, replay->server_port,
+                replay->key_name, key);
+        connection->socket = NULL;
+        return NULL;
+    }
+    // Readings go out at their own time, not when Nagle's algorithm sees fit
+    int sd, on = 1;
+    if (tcp_get_sd(connection->socket, &sd) == TCP_NO_ERROR) setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    connection->pending = 0;
+    return connection;
+}
+
+// Wait until a reading at 'at_ns' in the trace is due. All pending bytes are sent before a wait.
+static int wait_until(replay_t *replay, int64_t at_ns) {
+    if (!replay->started) {
+        clock_gettime(CLOCK_MONOTONIC, &replay->start);
+        replay->first_ns = at_ns;
+        replay->last_ns = at_ns;
+        replay->started = true;
+    }
+    if (replay->speed == 0 || at_ns == replay->last_ns) return 0;
+    replay->last_ns = at_ns;
+
+    // A trace that goes back in time is sent on right away
+    int64_t due = timespec_ns(&replay->start) + (int64_t)((double)(at_ns - replay->first_ns) / replay->speed);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (due <= timespec_ns(&now)) {
+        if (timespec_ns(&now) - due > replay->max_lag_ns) replay->max_lag_ns = timespec_ns(&now) - due;
+        return 0;
+    }
+    if (send_all_pending(replay) != 0) return -1;
+    struct timespec wake = {.tv_sec = due / 1000000000, .tv_nsec = due % 1000000000};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) != 0) continue;
+    return 0;
+}
+
+// Queue 'length' bytes on the connection of 'key' once 'at_ns' is due
+static int replay_bytes(replay_t *replay, uint64_t key, int64_t at_ns, const void *bytes, size_t length) {
+    if (wait_until(replay, at_ns) != 0) return -1;
+    connection_t *connection = find_connection(replay, key);
+    if (connection == NULL) return -1;
+    if (connection->pending + length > SEND_BUFFER_BYTES && send_pending(connection) != 0) {
+        fprintf(stderr, "Connection of %s %" PRIu64 " was closed by the gateway\n", replay->key_name, key);
+        return -1;
+    }
+    replay->bytes += length;
+    if (length > SEND_BUFFER_BYTES) {
+        // Too big to collect, it goes out as it is
+        for (const char *p = bytes; length > 0;) {
+            int sent = length > INT32_MAX ? INT32_MAX : (int)length;
+            if (tcp_send(connection->socket, (void *)p, &sent) != TCP_NO_ERROR) return -1;
+            p += sent;
+            length -= sent;
+        }
+        return 0;
+    }
+    memcpy(connection->buffer + connection->pending, bytes, length);
+    connection->pending += length;
+    if (!connection->dirty) {
+        connection->dirty = true;
+        replay->dirty[replay->dirty_count++] = connection;
+    }
+    return 0;
+}
+
+static int replay_reading(replay_t *replay, const sensor_data_t *reading) {
+    // Field by field, in the order the sensor nodes send them
+    char wire[WIRE_BYTES];
+    memcpy(wire, &reading->id, sizeof(sensor_id_t));
+    memcpy(wire + sizeof(sensor_id_t), &reading->value, sizeof(sensor_value_t));
+    memcpy(wire + sizeof(sensor_id_t) + sizeof(sensor_value_t), &reading->ts, sizeof(sensor_ts_t));
+    replay->readings++;
+    return replay_bytes(replay, reading->id, (int64_t)reading->ts * 1000000000, wire, WIRE_BYTES);
+}
+
+static int replay_readings(const sensor_data_t *readings, size_t count, void *arg) {
+    for (size_t i = 0; i < count; i++) {
+        if (replay_reading(arg, &readings[i]) != 0) return -1;
+    }
+    return 0;
+}
+
+static int replay_csv(replay_t *replay, const char *path) {
+    csvload_stats_t stats;
+    int result = csvload_file(path, 0, replay_readings, replay, &stats);
+    if (result == CSVLOAD_FAILURE) {
+        perror(path);
+        return -1;
+    }
+    if (stats.malformed > 0) fprintf(stderr, "%s: skipped %" PRIu64 " malformed lines\n", path, stats.malformed);
+    return result == CSVLOAD_SUCCESS ? 0 : -1;
+}
+
+static int replay_binary(replay_t *replay, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    char *records = malloc(FILE_RECORDS * WIRE_BYTES);
+    int result = records ? 0 : -1;
+    size_t count;
+    while (result == 0 && (count = fread(records, WIRE_BYTES, FILE_RECORDS, fp)) > 0) {
+        for (size_t i = 0; i < count && result == 0; i++) {
+            sensor_data_t reading = {0};
+            const char *record = records + i * WIRE_BYTES;
+            memcpy(&reading.id, record, sizeof(sensor_id_t));
+            memcpy(&reading.value, record + sizeof(sensor_id_t), sizeof(sensor_value_t));
+            memcpy(&reading.ts, record + sizeof(sensor_id_t) + sizeof(sensor_value_t), sizeof(sensor_ts_t));
+            result = replay_reading(replay, &reading);
+        }
+    }
+    if (result == 0 && ferror(fp)) {
+        perror(path);
+        result = -1;
+    }
+    free(records);
+    fclose(fp);
+    return result;
+}
+
+// Close the connection of 'key' once 'at_ns' is due, as the capture recorded it
+static int replay_close(replay_t *replay, uint64_t key, int64_t at_ns) {
+    if (wait_until(replay, at_ns) != 0) return -1;
+    for (size_t s = key_hash(key) & replay->mask; replay->connections != NULL && replay->connections[s] != NULL;
+         s = (s + 1) & replay->mask) {
+        connection_t *connection = replay->connections[s];
+        if (connection->key != key) continue;
+        if (connection->socket == NULL) return 0;
+        int result = send_pending(connection);
+        tcp_close(&connection->socket);
+        return result;
+    }
+    return 0;
+}
+
+static int replay_capture(replay_t *replay, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    capture_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+        header.byte_order != 0x01020304) {
+        fprintf(stderr, "%s: not a capture of a gateway on this kind of machine\n", path);
+        fclose(fp);
+        return -1;
+    }
+    if (header.sensor_id_bytes != sizeof(sensor_id_t) || header.ts_bytes != sizeof(sensor_ts_t)) {
+        fprintf(stderr, "%s: captured with %d bit sensor ids and %d bit timestamps, this build has %d and %d\n", path,
+                8 * header.sensor_id_bytes, 8 * header.ts_bytes, SENSOR_ID_BITS, (int)(8 * sizeof(sensor_ts_t)));
+        fclose(fp);
+        return -1;
+    }
+
+    char *data = NULL;
+    size_t capacity = 0;
+    capture_chunk_t chunk;
+    int result = 0;
+    while (result == 0 && fread(&chunk, sizeof(chunk), 1, fp) == 1) {
+        if (chunk.length == 0) {
+            result = replay_close(replay, chunk.connection, chunk.received_ns);
+            continue;
+        }
+        if (chunk.length > capacity) {
+            char *grown = realloc(data, chunk.length);
+            if (grown == NULL) {
+                result = -1;
+                break;
+            }
+            data = grown;
+            capacity = chunk.length;
+        }
+        if (fread(data, 1, chunk.length, fp) != chunk.length) {
+            fprintf(stderr, "%s: the last chunk is cut off\n", path);
+            break;
+        }
+        result = replay_bytes(replay, chunk.connection, chunk.received_ns, data, chunk.length);
+    }
+    if (result == 0 && ferror(fp)) {
+        perror(path);
+        result = -1;
+    }
+    free(data);
+    fclose(fp);
+    return result;
+}
+
+static replay_format_t detect_format(const char *path) {
+    size_t length = strlen(path);
+    if (length >= 4 && strcmp(path + length - 4, ".csv") == 0) return FORMAT_CSV;
+    FILE *fp = fopen(path, "rb");
+    char header[9] = {0};
+    if (fp != NULL) {
+        if (fread(header, 1, sizeof(header), fp) != sizeof(header)) header[0] = '\0';
+        fclose(fp);
+    }
+    if (memcmp(header, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) == 0) return FORMAT_CAPTURE;
+    return memcmp(header, "SensorID,", sizeof(header)) == 0 ? FORMAT_CSV : FORMAT_BINARY;
+}
+
+int main(int argc, char *argv[]) {
+    replay_t replay = {.speed = 1};
+    replay_format_t format = FORMAT_AUTO;
+    int opt;
+    while ((opt = getopt(argc, argv, "x:t:")) != -1) {
+        switch (opt) {
+            case 'x': {
+                char *end;
+                replay.speed = strtod(optarg, &end);
+                if (end == optarg || *end != '\0' || !(replay.speed >= 0)) usage(argv[0]);
+                break;
+            }
+            case 't':
+                if (strcmp(optarg, "csv") == 0) {
+                    format = FORMAT_CSV;
+                } else if (strcmp(optarg, "bin") == 0) {
+                    format = FORMAT_BINARY;
+                } else if (strcmp(optarg, "cap") == 0) {
+                    format = FORMAT_CAPTURE;
+                } else {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind < 3) usage(argv[0]);
+    replay.server_ip = argv[argc - 2];
+    replay.server_port = atoi(argv[argc - 1]);
+    if (format == FORMAT_AUTO) format = detect_format(argv[optind]);
+    replay.key_name = format == FORMAT_CAPTURE ? "connection" : "sensor";
+
+    int result = 0;
+    for (int i = optind; i < argc - 2 && result == 0; i++) {
+        if (format == FORMAT_CSV) {
+            result = replay_csv(&replay, argv[i]);
+        } else if (format == FORMAT_BINARY) {
+            result = replay_binary(&replay, argv[i]);
+        } else {
+            result = replay_capture(&replay, argv[i]);
+        }
+    }
+    if (result == 0) result = send_all_pending(&replay);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (size_t i = 0; replay.connections != NULL && i <= replay.mask; i++) {
+        if (replay.connections[i] == NULL) continue;
+        if (replay.connections[i]->socket != NULL) tcp_close(&replay.connections[i]->socket);
+        free(replay.connections[i]);
+    }
+    free(replay.connections);
+    free(replay.dirty);
+
+    double seconds = replay.started ? (double)(timespec_ns(&end) - timespec_ns(&replay.start)) / 1e9 : 0;
+    // A capture holds bytes, the readings in them are not counted one by one
+    uint64_t readings = format == FORMAT_CAPTURE ? replay.bytes / WIRE_BYTES : replay.readings;
+    printf("Replayed %" PRIu64 " readings over %zu connections in %.3f s (%.0f readings/s)", readings, replay.count,
+           seconds, seconds > 0 ? readings / seconds : 0);
+    if (replay.speed > 0) printf(", at most %.1f ms behind schedule", replay.max_lag_ns / 1e6);
+    printf("\n");
+    return result == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,249 @@
+#define _POSIX_C_SOURCE 200809L
+#include "statesrv.h"
+#include "datamgr.h"
+#include "connmgr.h"
+#include "alert.h"
+#include "anomaly.h"
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define STATESRV_POLL_MS 500
+#define STATESRV_CLIENT_TIMEOUT_MS 1000
+#define STATESRV_MAX_REQUEST 128
+
+typedef struct reply {
+    char *data;
+    size_t len;
+    size_t cap;
+} reply_t;
+
+typedef struct snapshot_list {
+    datamgr_snapshot_t *items;
+    size_t count;
+    size_t cap;
+} snapshot_list_t;
+
+static int server_fd = -1;
+static char *socket_path = NULL;
+static pthread_t server_tid;
+static atomic_int server_running = 0;
+
+static void reply_printf(reply_t *reply, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (needed < 0) return;
+
+    if (reply->len + needed + 1 > reply->cap) {
+        size_t cap = reply->cap ? reply->cap : 4096;
+        while (cap < reply->len + needed + 1) cap *= 2;
+        char *data = realloc(reply->data, cap);
+        if (data == NULL) return;
+        reply->data = data;
+        reply->cap = cap;
+    }
+    va_start(args, format);
+    vsnprintf(reply->data + reply->len, reply->cap - reply->len, format, args);
+    va_end(args);
+    reply->len += needed;
+}
+
+static const char *alarm_name(int alarm) {
+    switch (alarm) {
+        case ALERT_TOO_COLD: return "cold";
+        case ALERT_TOO_HOT: return "hot";
+        default: return "ok";
+    }
+}
+
+static void reply_sensor(reply_t *reply, const datamgr_snapshot_t *snapshot) {
+    char anomalies[32] = "none";
+    if (snapshot->anomalies != 0) {
+        snprintf(anomalies, sizeof(anomalies), "%s%s%s",
+                 (snapshot->anomalies & ANOMALY_OUTLIER) ? ",outlier" : "",
+                 (snapshot->anomalies & ANOMALY_SPIKE) ? ",spike" : "",
+                 (snapshot->anomalies & ANOMALY_STUCK) ? ",stuck" : "");
+        memmove(anomalies, anomalies + 1, strlen(anomalies));
+    }
+    reply_printf(reply, "sensor=%" PRIsensor " room=%" PRIu16 " value=%.2f avg=%.2f ts=%ld alarm=%s anomalies=%s duplicates=%" PRIu32 "\n",
+                 snapshot->id, snapshot->room_id, snapshot->last_value, snapshot->avg, (long)snapshot->last_ts,
+                 alarm_name(snapshot->alarm), anomalies, snapshot->duplicates);
+}
+
+static void collect_snapshot(const datamgr_snapshot_t *snapshot, void *arg) {
+    snapshot_list_t *list = arg;
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 256;
+        datamgr_snapshot_t *items = realloc(list->items, cap * sizeof(datamgr_snapshot_t));
+        if (items == NULL) return;
+        list->items = items;
+        list->cap = cap;
+    }
+    list->items[list->count++] = *snapshot;
+}
+
+static int room_compare(const void *x, const void *y) {
+    const datamgr_snapshot_t *snapshot_x = x;
+    const datamgr_snapshot_t *snapshot_y = y;
+    if (snapshot_x->room_id != snapshot_y->room_id) return snapshot_x->room_id < snapshot_y->room_id ? -1 : 1;
+    if (snapshot_x->id != snapshot_y->id) return snapshot_x->id < snapshot_y->id ? -1 : 1;
+    return 0;
+}
+
+// Room state is derived from the sensors in it: the newest value, the mean of the averages and the worst alarm
+static void reply_rooms(reply_t *reply, bool all, unsigned long room_id) {
+    snapshot_list_t list = {0};
+    datamgr_for_each_snapshot(collect_snapshot, &list);
+    qsort(list.items, list.count, sizeof(datamgr_snapshot_t), room_compare);
+
+    bool found = false;
+    for (size_t i = 0; i < list.count;) {
+        size_t end = i;
+        while (end < list.count && list.items[end].room_id == list.items[i].room_id) end++;
+
+        if (all || list.items[i].room_id == room_id) {
+            const datamgr_snapshot_t *newest = &list.items[i];
+            double avg_sum = 0.0;
+            size_t reporting = 0;
+            int alarm = ALERT_NORMAL;
+            for (size_t j = i; j < end; j++) {
+                if (list.items[j].last_ts > newest->last_ts) newest = &list.items[j];
+                if (list.items[j].last_ts != 0) {
+                    avg_sum += list.items[j].avg;
+                    reporting++;
+                }
+                if (list.items[j].alarm != ALERT_NORMAL) alarm = list.items[j].alarm;
+            }
+            reply_printf(reply, "room=%" PRIu16 " sensors=%zu value=%.2f avg=%.2f ts=%ld alarm=%s\n",
+                         list.items[i].room_id, end - i, newest->last_value,
+                         reporting ? avg_sum / reporting : 0.0, (long)newest->last_ts, alarm_name(alarm));
+            found = true;
+        }
+        i = end;
+    }
+    if (!all && !found) reply_printf(reply, "error unknown room %lu\n", room_id);
+    free(list.items);
+}
+
+static void reply_each_sensor(const datamgr_snapshot_t *snapshot, void *arg) {
+    reply_sensor(arg, snapshot);
+}
+
+static void handle_request(char *request, reply_t *reply) {
+    char *save = NULL;
+    char *command = strtok_r(request, " \t\r\n", &save);
+    char *argument = strtok_r(NULL, " \t\r\n", &save);
+    char *end = NULL;
+    unsigned long id = argument ? strtoul(argument, &end, 10) : 0;
+    bool valid_id = argument != NULL && *end == '\0';
+
+    if (command != NULL && strcmp(command, "sensors") == 0 && argument == NULL) {
+        datamgr_for_each_snapshot(reply_each_sensor, reply);
+    } else if (command != NULL && strcmp(command, "sensor") == 0 && valid_id && id <= SENSOR_ID_MAX) {
+        datamgr_snapshot_t snapshot;
+        if (datamgr_get_snapshot((sensor_id_t)id, &snapshot) == DATAMGR_SUCCESS) {
+            reply_sensor(reply, &snapshot);
+        } else {
+            reply_printf(reply, "error unknown sensor %lu\n", id);
+        }
+    } else if (command != NULL && strcmp(command, "rooms") == 0 && argument == NULL) {
+        reply_rooms(reply, true, 0);
+    } else if (command != NULL && strcmp(command, "room") == 0 && valid_id && id <= UINT16_MAX) {
+        reply_rooms(reply, false, id);
+    } else {
+        reply_printf(reply, "error usage: sensors | sensor <id> | rooms | room <id>\n");
+    }
+}
+
+static void serve_client(int client_fd) {
+    char request[STATESRV_MAX_REQUEST];
+    size_t len = 0;
+    while (len < sizeof(request) - 1 && memchr(request, '\n', len) == NULL) {
+        struct pollfd pfd = {.fd = client_fd, .events = POLLIN};
+        if (poll(&pfd, 1, STATESRV_CLIENT_TIMEOUT_MS) <= 0) break;
+        ssize_t n = read(client_fd, request + len, sizeof(request) - 1 - len);
+        if (n <= 0) break;
+        len += n;
+    }
+    request[len] = '\0';
+
+    reply_t reply = {0};
+    handle_request(request, &reply);
+    for (size_t sent = 0; sent < reply.len;) {
+        // A client that hangs up early must not take the gateway down with SIGPIPE
+        ssize_t n = send(client_fd, reply.data + sent, reply.len - sent, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        sent += n;
+    }
+    free(reply.data);
+}
+
+static void *statesrv_thread(void *arg) {
+    while (atomic_load(&server_running)) {
+        struct pollfd pfd = {.fd = server_fd, .events = POLLIN};
+        if (poll(&pfd, 1, STATESRV_POLL_MS) <= 0) continue;
+
+        int client_fd = accept(server_fd, NULL, NULL);
+        if (client_fd == -1) continue;
+        serve_client(client_fd);
+        close(client_fd);
+    }
+    return NULL;
+}
+
+int statesrv_start(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path) || atomic_load(&server_running)) {
+        return STATESRV_FAILURE;
+    }
+    strcpy(addr.sun_path, path);
+
+    server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd == -1) return STATESRV_FAILURE;
+
+    unlink(path);
+    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(server_fd, 8) == -1) {
+        close(server_fd);
+        server_fd = -1;
+        return STATESRV_FAILURE;
+    }
+
+    socket_path = strdup(path);
+    atomic_store(&server_running, 1);
+    if (socket_path == NULL || pthread_create(&server_tid, NULL, statesrv_thread, NULL) != 0) {
+        atomic_store(&server_running, 0);
+        close(server_fd);
+        server_fd = -1;
+        unlink(path);
+        free(socket_path);
+        socket_path = NULL;
+        return STATESRV_FAILURE;
+    }
+
+    char log_msg[160];
+    snprintf(log_msg, sizeof(log_msg), "State server listening on %s", path);
+    write_log(log_msg);
+    return STATESRV_SUCCESS;
+}
+
+void statesrv_stop(void) {
+    if (!atomic_exchange(&server_running, 0)) return;
+
+    pthread_join(server_tid, NULL);
+    close(server_fd);
+    server_fd = -1;
+    unlink(socket_path);
+    free(socket_path);
+    socket_path = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef _STATESRV_H_
+#define _STATESRV_H_
+
+#define STATESRV_FAILURE -1
+#define STATESRV_SUCCESS 0
+
+/**
+ * Starts the live state server on a Unix socket at 'path'.
+ * A client connects, sends one command line and receives the answer, one line per sensor or room:
+ *   sensors | sensor <id> | rooms | room <id>
+ * The answers are built from seqlock snapshots of the data manager, so ingest never waits on a query.
+ * @param path The path of the Unix socket, an existing socket file is replaced.
+ * @return 0 on success, -1 on failure.
+ */
+int statesrv_start(const char *path);
+
+/**
+ * Stops the live state server and removes its socket file.
+ */
+void statesrv_stop(void);
+
+#endif /* _STATESRV_H_ */
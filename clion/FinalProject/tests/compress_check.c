@@ -0,0 +1,239 @@
+#define _POSIX_C_SOURCE 200809L
+#include "compress.h"
+#include "connmgr.h"
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Deadband and swinging door compression against their promise: every reading that goes in is within epsilon of
+// the stored readings, held flat for deadband and interpolated for swinging door, and no reading is further than
+// the keep-alive from a stored one before it. Also checks that compress_pending_from() never passes a reading
+// that is not stored yet. Returns 1 if any check fails.
+
+#define SERIES_READINGS 400000
+#define SENSORS 5
+#define BATCH_MAX 64
+#define APPLY_BATCHES 50        // batches between the compress_close_before() calls of the storage manager
+
+typedef struct series {
+    sensor_id_t id;
+    const char *rule;
+    compress_rule_t parsed;
+    sensor_data_t *in;
+    size_t in_count;
+    sensor_data_t *out;
+    size_t out_count;
+} series_t;
+
+static series_t series[SENSORS] = {
+    {.id = 11, .rule = "deadband:0.5"},
+    {.id = 12, .rule = "deadband:0:0"},
+    {.id = 21, .rule = "swing:0.25"},
+    {.id = 22, .rule = "swing:0:0"},
+    {.id = 31, .rule = "off"},
+};
+
+static int failures = 0;
+static uint64_t rng_state = 88172645463325252ULL;
+
+void write_log(const char *message) {
+    (void)message;
+}
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static uint64_t next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static series_t *series_of(sensor_id_t id) {
+    for (int s = 0; s < SENSORS; s++) {
+        if (series[s].id == id) return &series[s];
+    }
+    return NULL;
+}
+
+static void check_rules(void) {
+    const char *valid[] = {"off", "deadband:0.5", "swing:0.1:60", "swing:0:0", "deadband"};
+    const char *invalid[] = {"", "on", "deadband:", "deadband:-1", "swing:0.1:", "swing:0.1:-5", "swing:x",
+                             "deadband:0.5:60:1", "swingdoor:1"};
+    compress_rule_t rule;
+    for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+        check(compress_parse_rule(valid[i], &rule) == COMPRESS_SUCCESS, valid[i]);
+    }
+    for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+        check(compress_parse_rule(invalid[i], &rule) == COMPRESS_FAILURE, invalid[i]);
+    }
+    check(compress_parse_rule("swing:0.25", &rule) == COMPRESS_SUCCESS && rule.mode == COMPRESS_SWINGING_DOOR &&
+          rule.epsilon == 0.25 && rule.keepalive == COMPRESS_KEEPALIVE, "swing:0.25 takes the default keep-alive");
+}
+
+// The same rules through a config file, a bad line rejects the whole file
+static void load_config(void) {
+    char path[] = "/tmp/compress_check.XXXXXX";
+    int fd = mkstemp(path);
+    FILE *fp = fd == -1 ? NULL : fdopen(fd, "w");
+    if (fp == NULL) exit(2);
+    fprintf(fp, "sensor 11 swing:1\nsensor 12 nonsense\n");
+    fclose(fp);
+    check(compress_load_config(path) == COMPRESS_FAILURE, "a config with a bad line should be rejected");
+
+    fp = fopen(path, "w");
+    if (fp == NULL) exit(2);
+    fprintf(fp, "# default for the sensors that are not listed\ndefault swing:9\n");
+    for (int s = 0; s < SENSORS; s++) {
+        compress_parse_rule(series[s].rule, &series[s].parsed);
+        fprintf(fp, "sensor %" PRIsensor " %s\n", series[s].id, series[s].rule);
+    }
+    fclose(fp);
+    check(compress_load_config(path) == COMPRESS_SUCCESS, "compress_load_config");
+    unlink(path);
+}
+
+// Random walks with ramps, steps and gaps past the keep-alive, interleaved over the sensors
+static sensor_data_t *make_readings(void) {
+    sensor_data_t *readings = malloc(SERIES_READINGS * sizeof(sensor_data_t));
+    double value[SENSORS], slope[SENSORS] = {0};
+    sensor_ts_t ts[SENSORS];
+    for (int s = 0; s < SENSORS; s++) {
+        value[s] = 20;
+        ts[s] = 1800000000;
+        series[s].in = malloc(SERIES_READINGS * sizeof(sensor_data_t));
+        series[s].out = malloc(COMPRESS_OUT_MAX(SERIES_READINGS) * sizeof(sensor_data_t));
+        if (series[s].in == NULL || series[s].out == NULL) exit(2);
+    }
+    if (readings == NULL) exit(2);
+
+    for (int i = 0; i < SERIES_READINGS; i++) {
+        int s = next_random() % SENSORS;
+        uint64_t r = next_random();
+        switch (r % 16) {
+            case 0: slope[s] = ((double)(r >> 8 & 0xFF) - 128) / 2048; break;
+            case 1: slope[s] = 0; break;
+            case 2: value[s] += ((double)(r >> 8 & 0xFF) - 128) / 32; break;
+            default: break;
+        }
+        sensor_ts_t step = (r >> 16) % 64 == 0 ? COMPRESS_KEEPALIVE + (r >> 24) % 100 : 1 + (r >> 24) % 30;
+        ts[s] += step;
+        value[s] += slope[s] * step + ((double)(r >> 32 & 0xFF) - 128) / 1024;
+        readings[i] = (sensor_data_t){.id = series[s].id, .value = round(value[s] * 100) / 100, .ts = ts[s]};
+        series[s].in[series[s].in_count++] = readings[i];
+    }
+    return readings;
+}
+
+static void collect(const sensor_data_t *out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        series_t *s = series_of(out[i].id);
+        if (s == NULL) {
+            check(false, "a stored reading of an unknown sensor");
+            continue;
+        }
+        s->out[s->out_count++] = out[i];
+    }
+}
+
+// Every reading of a swinging door before compress_pending_from() has to be at or before the last stored reading
+// of its sensor, deadband drops the readings after it for good
+static uint64_t passed = 0;
+
+static uint64_t check_pending(const sensor_data_t *readings, uint64_t checked, uint64_t pending) {
+    for (uint64_t p = checked; p < pending; p++) {
+        series_t *s = series_of(readings[p].id);
+        if (s->parsed.mode == COMPRESS_SWINGING_DOOR &&
+            (s->out_count == 0 || s->out[s->out_count - 1].ts < readings[p].ts)) {
+            passed++;
+        }
+    }
+    return pending > checked ? pending : checked;
+}
+
+static void check_series(series_t *s) {
+    double epsilon = s->parsed.epsilon * (1 + 1e-12) + 1e-9;
+    size_t far = 0, late = 0, moved = 0;
+    size_t o = 0;
+    for (size_t i = 0; i < s->in_count; i++) {
+        const sensor_data_t *in = &s->in[i];
+        while (o + 1 < s->out_count && s->out[o + 1].ts <= in->ts) o++;
+        const sensor_data_t *before = &s->out[o];
+        if (s->out_count == 0 || before->ts > in->ts) {
+            far++;
+            continue;
+        }
+        if (s->parsed.keepalive > 0 && in->ts - before->ts >= s->parsed.keepalive) late++;
+
+        double reconstructed = before->value;
+        if (s->parsed.mode == COMPRESS_SWINGING_DOOR && before->ts < in->ts) {
+            if (o + 1 >= s->out_count) {
+                far++;
+                continue;
+            }
+            const sensor_data_t *after = &s->out[o + 1];
+            reconstructed += (after->value - before->value) * (double)(in->ts - before->ts) /
+                             (double)(after->ts - before->ts);
+        }
+        if (fabs(reconstructed - in->value) > epsilon) far++;
+    }
+    for (size_t i = 1; i < s->out_count; i++) {
+        if (s->out[i].ts <= s->out[i - 1].ts) moved++;
+    }
+    printf("%-13s sensor %" PRIsensor ": %zu readings stored as %zu, %zu off by more than epsilon, %zu past the "
+           "keep-alive, %zu out of order\n", s->rule, s->id, s->in_count, s->out_count, far, late, moved);
+    char what[128];
+    snprintf(what, sizeof(what), "%s should keep every reading within epsilon and the keep-alive", s->rule);
+    check(far == 0 && late == 0 && moved == 0, what);
+    if (s->parsed.mode == COMPRESS_OFF) check(s->out_count == s->in_count, "off should store every reading");
+}
+
+int main(void) {
+    check_rules();
+    load_config();
+    sensor_data_t *readings = make_readings();
+    sensor_data_t out[COMPRESS_OUT_MAX(BATCH_MAX)];
+
+    // Batches as the storage manager takes them from the buffer, with its closing of long open doors
+    uint64_t position = 0, checked = 0, at_apply = 0;
+    for (int batch = 0; position < SERIES_READINGS; batch++) {
+        size_t count = 1 + next_random() % BATCH_MAX;
+        if (count > SERIES_READINGS - position) count = SERIES_READINGS - position;
+        collect(out, compress_batch(readings + position, count, out));
+        position += count;
+        if (batch % APPLY_BATCHES == 0) {
+            size_t closed;
+            while ((closed = compress_close_before(at_apply, out, BATCH_MAX)) > 0) collect(out, closed);
+            at_apply = position;
+        }
+        checked = check_pending(readings, checked, compress_pending_from());
+    }
+    size_t drained;
+    while ((drained = compress_drain(out, BATCH_MAX)) > 0) collect(out, drained);
+    printf("compress_pending_from() passed %" PRIu64 " readings that were not stored yet\n", passed);
+    check(passed == 0, "compress_pending_from() should stop at the oldest reading an open door covers");
+    check(compress_pending_from() == SERIES_READINGS, "nothing should be pending after the drain");
+
+    uint64_t in_total, out_total;
+    compress_counts(&in_total, &out_total);
+    size_t collected = 0;
+    for (int s = 0; s < SENSORS; s++) {
+        check_series(&series[s]);
+        collected += series[s].out_count;
+        free(series[s].in);
+        free(series[s].out);
+    }
+    check(in_total == SERIES_READINGS && out_total == collected, "compress_counts() does not add up");
+    free(readings);
+    compress_free();
+    printf("compress: %d checks failed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,124 @@
+#define _POSIX_C_SOURCE 200809L
+#include "csvfmt.h"
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// csvfmt_reading() against "%u,%.2f,%ld\n" over fuzzed readings, with -b also how much faster it is
+// Returns 1 if any line differs.
+
+#define FUZZ_READINGS 4000000
+#define BENCH_READINGS 5000000
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t checked = 0, mismatches = 0;
+
+static void check(sensor_id_t id, double value, long ts) {
+    char line[CSVFMT_LINE_MAX], expected[CSVFMT_LINE_MAX];
+    size_t length = csvfmt_reading(line, id, value, ts);
+    int expected_length = snprintf(expected, sizeof(expected), "%" PRIsensor ",%.2f,%ld\n", id, value, ts);
+    checked++;
+    if ((int)length != expected_length || memcmp(line, expected, length) != 0) {
+        if (mismatches++ < 10) printf("MISMATCH %.17g: '%.*s' instead of '%s'\n", value, (int)length, line, expected);
+    }
+}
+
+// Values from every range the formatter treats differently, most of them close to a tie between two cents
+static double fuzz_value(uint64_t i) {
+    uint64_t r = next_random();
+    double value;
+    switch (i % 5) {
+        case 0:
+            return (double)(int64_t)(r % 2000001 - 1000000) / 1000;
+        case 1:
+            return (double)(int64_t)(r % 200001 - 100000) / 100 + (double)((int)(next_random() % 3) - 1) * 0.005;
+        case 2:
+            memcpy(&value, &r, sizeof(value));      // any bit pattern, NaN and infinities included
+            return value;
+        case 3:
+            return ldexp((double)(r >> 11), -(int)(next_random() % 90));
+        default:
+            return 15 + (double)(r % 1000000) / 100000;
+    }
+}
+
+static void bench(void) {
+    sensor_data_t *readings = malloc(BENCH_READINGS * sizeof(sensor_data_t));
+    char *buffer = malloc(CSVFMT_LINE_MAX * 1024);
+    if (readings == NULL || buffer == NULL) exit(2);
+    for (int i = 0; i < BENCH_READINGS; i++) {
+        readings[i] = (sensor_data_t){.id = next_random() % 1000, .value = 10 + (double)(next_random() % 200000) / 10000,
+                                      .ts = 1792387183 + i / 1000};
+    }
+
+    // Best of a few runs, the machine may be busy with other things
+    double best_printf = 1e9, best_csvfmt = 1e9;
+    size_t printf_bytes = 0, csvfmt_bytes = 0;
+    for (int run = 0; run < 5; run++) {
+        double start = now();
+        printf_bytes = 0;
+        for (int i = 0; i < BENCH_READINGS; i++) {
+            printf_bytes += snprintf(buffer + (i & 1023) * CSVFMT_LINE_MAX, CSVFMT_LINE_MAX, "%" PRIsensor ",%.2f,%ld\n",
+                                     readings[i].id, readings[i].value, (long)readings[i].ts);
+        }
+        double middle = now();
+        csvfmt_bytes = 0;
+        for (int i = 0; i < BENCH_READINGS; i++) {
+            csvfmt_bytes += csvfmt_reading(buffer + (i & 1023) * CSVFMT_LINE_MAX, readings[i].id, readings[i].value,
+                                           readings[i].ts);
+        }
+        double end = now();
+        if (middle - start < best_printf) best_printf = middle - start;
+        if (end - middle < best_csvfmt) best_csvfmt = end - middle;
+    }
+    printf("snprintf %.1f ns/line, csvfmt_reading %.1f ns/line, %.1fx faster (%zu and %zu bytes)\n",
+           best_printf * 1e9 / BENCH_READINGS, best_csvfmt * 1e9 / BENCH_READINGS, best_printf / best_csvfmt,
+           printf_bytes, csvfmt_bytes);
+    free(readings);
+    free(buffer);
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    int benchmark = 0;
+    while ((option = getopt(argc, argv, "b")) != -1) {
+        if (option != 'b') {
+            fprintf(stderr, "Usage: %s [-b]\n", argv[0]);
+            return 2;
+        }
+        benchmark = 1;
+    }
+
+    double special[] = {0, -0.0, 0.005, 0.015, 0.125, -0.125, 0.375, 1.005, 2.675, -0.001, -0.004999, 1e13, 9.99e12,
+                        1e300, -1e300, INFINITY, -INFINITY, NAN, 5e-324, 19.995, 20.005, 99.995, 0.995, -0.995,
+                        1e12 + 0.005};
+    for (size_t i = 0; i < sizeof(special) / sizeof(special[0]); i++) check(SENSOR_ID_MAX, special[i], -1);
+    for (uint64_t i = 0; i < FUZZ_READINGS; i++) {
+        double value = fuzz_value(i);
+        check((sensor_id_t)next_random(), value, (long)((int64_t)next_random() >> (next_random() % 64)));
+    }
+    check(0, 1, INT64_MIN);
+    check(1, 1, INT64_MAX);
+    printf("csvfmt: %" PRIu64 " lines checked against printf, %" PRIu64 " differ\n", checked, mismatches);
+
+    if (benchmark) bench();
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,248 @@
+#define _POSIX_C_SOURCE 200809L
+#include "csvload.h"
+#include <float.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// csvload_file() against strtod() and strtoll() over a generated file of awkward values, with -b also how fast
+// it loads a file shaped like data.csv. Returns 1 if any reading differs.
+
+#define CHECK_LINES 300000
+#define BENCH_LINES 2000000
+#define BENCH_SENSORS 100
+
+// Lines that are skipped as malformed, strtod() would take some of them
+static const char *malformed_lines[] = {
+    "1,,3", "1,e5,3", "1,1e,3", "1,1e+,3", "1,.,3", "1,-,3", "1,0x10,3", "1, 2,3", "1,nan(1),3", "1,1.2.3,3",
+    "1,infinit,3", "1,2,3,4", "1,2", "x,1,2", "1,2,x", "1,2,", ",1,2", "-1,2,3", "1,2,99999999999999999999",
+};
+
+// Values that are hard to round or that take the slow paths
+static const char *special_values[] = {
+    "0", "-0", "0.00", "-0.00", ".5", "5.", "+1.50", "0e999", "1e-400", "1e400", "-1e400", "inf", "-Infinity",
+    "INF", "nan", "-nan", "NaN", "2.2250738585072011e-308", "2.2250738585072014e-308", "4.9406564584124654e-324",
+    "2.4703282292062327e-324", "2.4703282292062328e-324", "1.7976931348623157e308", "1.7976931348623158e308",
+    "1.7976931348623159e308", "9007199254740993", "9007199254740992.5", "9007199254740995",
+    "123456789012345678901234567890", "0.1000000000000000055511151231257827021181583404541015625",
+    "0.10000000000000000555111512312578270211815834045410156250000000000000000001", "1e22", "1e23", "607e-22",
+    "00000000000000000000000000000000012.5", "12.50000000000000000000000000000000000000000000000000000000000",
+};
+
+typedef struct expected {
+    FILE *fp;
+    uint64_t compared;
+    uint64_t mismatches;
+} expected_t;
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double random_double(void) {
+    uint64_t bits = next_random();
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void write_value(FILE *fp, uint64_t i) {
+    double value = random_double();
+    switch (i % 8) {
+        case 0:
+        case 1:
+            fprintf(fp, "%.2f", (double)(int64_t)(next_random() % 200001 - 100000) / 100);
+            break;
+        case 2:
+            fprintf(fp, "%.17g", value);
+            break;
+        case 3:
+            fprintf(fp, "%.*e", (int)(next_random() % 40), value);
+            break;
+        case 4:
+            fprintf(fp, "%" PRId64 "e%d", (int64_t)(next_random() % 2000000) - 1000000, (int)(next_random() % 700) - 350);
+            break;
+        case 5:
+            fprintf(fp, "%.25f", (double)(next_random() % 1000000) / 1000);
+            break;
+        case 6:
+            fprintf(fp, "%" PRIu64 ".%" PRIu64, next_random() >> (next_random() % 64), next_random() % 1000000000);
+            break;
+        default:
+#if LDBL_MANT_DIG >= 64
+        {
+            // Exactly halfway between two doubles, then just above it with a digit past the ones that are kept
+            double x = fabs(value);
+            if (isnan(x) || isinf(x) || x == DBL_MAX) x = 1.5;
+            long double middle = ((long double)x + (long double)nextafter(x, INFINITY)) / 2;
+            char text[1000];
+            snprintf(text, sizeof(text), "%.820Le", middle);
+            if (next_random() % 2 == 0) {
+                char *e = strchr(text, 'e');
+                memmove(e + 1, e, strlen(e) + 1);
+                *e = '1';
+            }
+            fputs(text, fp);
+        }
+#else
+            fprintf(fp, "%.40e", value);
+#endif
+            break;
+    }
+}
+
+// Compare with the next valid line of the file, as the C library reads it
+static int compare(const sensor_data_t *readings, size_t count, void *arg) {
+    expected_t *expected = arg;
+    char line[1200];
+    for (size_t i = 0; i < count; i++) {
+        char *value_text = NULL, *ts_text = NULL;
+        while (value_text == NULL && fgets(line, sizeof(line), expected->fp) != NULL) {
+            char *first = strchr(line, ',');
+            char *second = first ? strchr(first + 1, ',') : NULL;
+            if (second == NULL || strchr(second + 1, ',') != NULL) continue;
+            if (strncmp(line, "SensorID", 8) == 0) continue;
+            bool known_bad = false;
+            for (size_t k = 0; k < sizeof(malformed_lines) / sizeof(malformed_lines[0]); k++) {
+                known_bad |= strncmp(line, malformed_lines[k], strlen(malformed_lines[k])) == 0 &&
+                             (line[strlen(malformed_lines[k])] == '\n');
+            }
+            if (known_bad) continue;
+            *first = *second = '\0';
+            value_text = first + 1;
+            ts_text = second + 1;
+        }
+        if (value_text == NULL) {
+            expected->mismatches++;
+            return 1;
+        }
+        unsigned long id = strtoul(line, NULL, 10);
+        double value = strtod(value_text, NULL);
+        long long ts = strtoll(ts_text, NULL, 10);
+        if (readings[i].id != id || memcmp(&readings[i].value, &value, sizeof(value)) != 0 || readings[i].ts != ts ||
+            readings[i].room_id != 0) {
+            if (expected->mismatches++ < 10) {
+                printf("MISMATCH %s: %.17g instead of %.17g\n", value_text, readings[i].value, value);
+            }
+        }
+        expected->compared++;
+    }
+    return 0;
+}
+
+static int check(const char *path, uint64_t lines) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) return 2;
+    fprintf(fp, "SensorID,Value,Timestamp\n");
+    size_t malformed_count = sizeof(malformed_lines) / sizeof(malformed_lines[0]);
+    size_t special_count = sizeof(special_values) / sizeof(special_values[0]);
+    uint64_t malformed = 0;
+    for (uint64_t i = 0; i < lines; i++) {
+        if (i % 1000 == 500) {
+            fprintf(fp, "%s\n", malformed_lines[(i / 1000) % malformed_count]);
+            malformed++;
+            continue;
+        }
+        if (i % 1000 == 999) {
+            fprintf(fp, "\n");      // empty lines are not counted
+            continue;
+        }
+        fprintf(fp, "%" PRIu64 ",", next_random() % ((uint64_t)SENSOR_ID_MAX + 1));
+        if (i % 100 == 7) {
+            fputs(special_values[(i / 100) % special_count], fp);
+        } else {
+            write_value(fp, i);
+        }
+        int64_t ts = (int64_t)next_random() >> (next_random() % 64);
+        fprintf(fp, ",%" PRId64 "%s", ts, i % 50 == 3 ? "\r\n" : "\n");
+    }
+    fprintf(fp, "7,-12.50,1792000000");  // no newline at the end
+    fclose(fp);
+
+    int failed = 0;
+    unsigned int thread_counts[] = {1, 4};
+    for (int t = 0; t < 2; t++) {
+        expected_t expected = {.fp = fopen(path, "r")};
+        csvload_stats_t stats;
+        int result = csvload_file(path, thread_counts[t], compare, &expected, &stats);
+        printf("csvload with %u threads: %" PRIu64 " readings checked against strtod, %" PRIu64 " differ, %" PRIu64
+               " malformed lines\n", thread_counts[t], expected.compared, expected.mismatches, stats.malformed);
+        if (result != CSVLOAD_SUCCESS || expected.mismatches != 0 || stats.malformed != malformed ||
+            stats.readings != expected.compared) {
+            printf("FAILED: result %d, %" PRIu64 " malformed lines expected\n", result, malformed);
+            failed = 1;
+        }
+        fclose(expected.fp);
+    }
+    return failed;
+}
+
+static int count_readings(const sensor_data_t *readings, size_t count, void *arg) {
+    (void)readings;
+    *(uint64_t *)arg += count;
+    return 0;
+}
+
+static int bench(const char *path) {
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) return 2;
+    fprintf(fp, "SensorID,Value,Timestamp\n");
+    for (uint64_t i = 0; i < BENCH_LINES; i++) {
+        fprintf(fp, "%" PRIu64 ",%.2f,%" PRId64 "\n", 100 + i % BENCH_SENSORS,
+                10 + (double)(next_random() % 2000) / 100, (int64_t)1792000000 + (int64_t)(i / BENCH_SENSORS));
+    }
+    fclose(fp);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (unsigned int threads = 1; threads <= (cpus > 1 ? (unsigned int)cpus : 1); threads *= 2) {
+        // Best of a few runs, the machine may be busy with other things
+        double best = 1e9;
+        csvload_stats_t stats;
+        for (int run = 0; run < 10; run++) {
+            uint64_t readings = 0;
+            double start = now();
+            if (csvload_file(path, threads, count_readings, &readings, &stats) != CSVLOAD_SUCCESS) return 1;
+            double elapsed = now() - start;
+            if (elapsed < best) best = elapsed;
+        }
+        printf("csvload_file (%s) with %u threads: %.2f GB/s, %.1f ns per line, %.2f GB/s per thread\n", csvload_simd(),
+               threads, stats.bytes / best / 1e9, best * 1e9 / stats.lines, stats.bytes / best / 1e9 / threads);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int option;
+    int benchmark = 0;
+    while ((option = getopt(argc, argv, "b")) != -1) {
+        if (option != 'b') {
+            fprintf(stderr, "Usage: %s [-b]\n", argv[0]);
+            return 2;
+        }
+        benchmark = 1;
+    }
+
+    char path[] = "/tmp/csvload_check.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) return 2;
+    close(fd);
+    int result = benchmark ? bench(path) : check(path, CHECK_LINES);
+    unlink(path);
+    return result;
+}
@@ -0,0 +1,241 @@
+#define _POSIX_C_SOURCE 200809L
+#include "datamgr.h"
+#include "sbuffer.h"
+#include "connmgr.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The duplicate filter of the data manager, on its own and as the filter of the shared buffer, and the
+// checkpoint of the sensor state across a restart. Returns 1 if any check fails.
+
+#define RESEND_THREADS 4
+#define RESEND_READINGS 5000
+#define CHECKPOINT_THREADS 3
+#define CHECKPOINT_ROUNDS 50
+
+static const sensor_id_t sensors[] = {15, 21, 37};
+static int failures = 0;
+
+void write_log(const char *message) {
+    (void)message;
+}
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+// Start over with a map of 'count' sensors, sensor i in room i + 1
+static void load_map(const sensor_id_t *ids, int count) {
+    FILE *map = tmpfile();
+    if (map == NULL) exit(2);
+    for (int i = 0; i < count; i++) fprintf(map, "%d %" PRIsensor "\n", i + 1, ids[i]);
+    rewind(map);
+    datamgr_free();
+    datamgr_init();
+    datamgr_parse_sensor_files(map, NULL);
+    fclose(map);
+}
+
+static sensor_data_t reading(sensor_id_t id, double value, sensor_ts_t ts) {
+    return (sensor_data_t){.id = id, .value = value, .ts = ts};
+}
+
+static void check_filter(void) {
+    sensor_data_t first = reading(15, 20.5, 1000);
+    check(!datamgr_is_duplicate(&first), "a new reading is a duplicate");
+    check(datamgr_is_duplicate(&first), "a resent reading is not a duplicate");
+
+    sensor_data_t same_value = reading(15, 20.5, 1001);
+    check(!datamgr_is_duplicate(&same_value), "a later reading with the same value is a duplicate");
+    sensor_data_t same_ts = reading(15, 20.75, 1001);
+    check(!datamgr_is_duplicate(&same_ts), "a reading with the same timestamp and another value is a duplicate");
+    sensor_data_t late = reading(15, 19.0, 900);
+    check(!datamgr_is_duplicate(&late), "a late reading that was not seen before is a duplicate");
+    check(datamgr_is_duplicate(&late), "a resent late reading is not a duplicate");
+
+    sensor_data_t other_sensor = reading(21, 20.5, 1000);
+    check(!datamgr_is_duplicate(&other_sensor), "the same reading of another sensor is a duplicate");
+    sensor_data_t unknown = reading(99, 20.5, 1000);
+    check(!datamgr_is_duplicate(&unknown) && !datamgr_is_duplicate(&unknown),
+          "a reading of a sensor outside the map is a duplicate");
+
+    datamgr_snapshot_t snapshot;
+    check(datamgr_get_snapshot(15, &snapshot) == DATAMGR_SUCCESS && snapshot.duplicates == 2,
+          "the snapshot does not count the 2 duplicates of sensor 15");
+}
+
+typedef struct resend {
+    sbuffer_t *buffer;
+    pthread_barrier_t *barrier;
+    unsigned int accepted;
+    unsigned int rejected;
+} resend_t;
+
+// Every thread sends the same readings at the same time, as a node that resends before its ack arrived would.
+// A resend is only caught while the reading is among the last DEDUP_SLOTS of its sensor, the barrier keeps it there.
+static void *resend_thread(void *arg) {
+    resend_t *resend = arg;
+    for (int i = 0; i < RESEND_READINGS; i++) {
+        pthread_barrier_wait(resend->barrier);
+        sensor_data_t data = reading(sensors[i % 3], 15 + i % 100 / 10.0, 2000 + i / 3);
+        int result = sbuffer_insert(resend->buffer, &data);
+        resend->accepted += result == SBUFFER_SUCCESS;
+        resend->rejected += result == SBUFFER_DUPLICATE;
+    }
+    return NULL;
+}
+
+static void check_buffer(void) {
+    sbuffer_t *buffer;
+    if (sbuffer_init(&buffer) != SBUFFER_SUCCESS) {
+        check(false, "sbuffer_init");
+        return;
+    }
+    sbuffer_set_filter(buffer, datamgr_is_duplicate);
+
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, RESEND_THREADS);
+    pthread_t tids[RESEND_THREADS];
+    resend_t resends[RESEND_THREADS];
+    for (int t = 0; t < RESEND_THREADS; t++) {
+        resends[t] = (resend_t){.buffer = buffer, .barrier = &barrier};
+        pthread_create(&tids[t], NULL, resend_thread, &resends[t]);
+    }
+    unsigned int accepted = 0, rejected = 0;
+    for (int t = 0; t < RESEND_THREADS; t++) {
+        pthread_join(tids[t], NULL);
+        accepted += resends[t].accepted;
+        rejected += resends[t].rejected;
+    }
+    pthread_barrier_destroy(&barrier);
+
+    size_t buffered = 0;
+    sensor_data_t data;
+    while (sbuffer_peek_unprocessed(buffer, &data) == SBUFFER_SUCCESS) {
+        sbuffer_mark_processed(buffer);
+        buffered++;
+    }
+    printf("sbuffer with the duplicate filter: %u readings from %d threads, %u accepted, %u rejected, %zu buffered\n",
+           RESEND_THREADS * RESEND_READINGS, RESEND_THREADS, accepted, rejected, buffered);
+    check(accepted == RESEND_READINGS && rejected == (RESEND_THREADS - 1) * RESEND_READINGS,
+          "every reading should be accepted once and rejected for every resend");
+    check(buffered == accepted, "the buffer should hold the accepted readings only");
+    sbuffer_free(&buffer);
+}
+
+static bool same_snapshot(const datamgr_snapshot_t *a, const datamgr_snapshot_t *b) {
+    return a->id == b->id && a->room_id == b->room_id && a->last_value == b->last_value && a->avg == b->avg &&
+           a->last_ts == b->last_ts && a->alarm == b->alarm && a->anomalies == b->anomalies &&
+           a->duplicates == b->duplicates;
+}
+
+// Checkpoints from several threads at once while readings are processed, the last file written has to be whole
+static void *checkpoint_thread(void *arg) {
+    for (int i = 0; i < CHECKPOINT_ROUNDS; i++) {
+        if (datamgr_checkpoint(arg) != DATAMGR_SUCCESS) return arg;
+    }
+    return NULL;
+}
+
+static void check_concurrent_checkpoints(const char *path) {
+    pthread_t tids[CHECKPOINT_THREADS];
+    for (int t = 0; t < CHECKPOINT_THREADS; t++) pthread_create(&tids[t], NULL, checkpoint_thread, (void *)path);
+    for (int i = 0; i < CHECKPOINT_ROUNDS * 100; i++) {
+        sensor_data_t data = reading(sensors[i % 3], 18 + i % 7 * 0.5, 5000 + i);
+        datamgr_process_data(&data);
+    }
+    bool written = true;
+    for (int t = 0; t < CHECKPOINT_THREADS; t++) {
+        void *result;
+        pthread_join(tids[t], &result);
+        written = written && result == NULL;
+    }
+    check(written, "concurrent checkpoints should all be written");
+    datamgr_snapshot_t saved;
+    datamgr_get_snapshot(21, &saved);
+    check(datamgr_checkpoint(path) == DATAMGR_SUCCESS, "datamgr_checkpoint after the concurrent ones");
+    load_map(sensors, 3);
+    datamgr_snapshot_t restored;
+    check(datamgr_restore_checkpoint(path) == DATAMGR_SUCCESS &&
+          datamgr_get_snapshot(21, &restored) == DATAMGR_SUCCESS && same_snapshot(&restored, &saved),
+          "the checkpoint after the concurrent ones does not restore the last state");
+}
+
+static void check_checkpoint(void) {
+    char path[] = "/tmp/datamgr_check.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) exit(2);
+    close(fd);
+
+    // Enough readings to fill the running average, sensor 15 ends up too hot and 21 too cold
+    load_map(sensors, 3);
+    for (int i = 0; i < 12; i++) {
+        sensor_data_t hot = reading(15, 22 + i % 3, 3000 + i * 10);
+        sensor_data_t cold = reading(21, 8 - i % 4 * 0.25, 3000 + i * 10);
+        datamgr_is_duplicate(&hot);
+        datamgr_process_data(&hot);
+        datamgr_process_data(&cold);
+    }
+    sensor_data_t resent = reading(15, 22 + 11 % 3, 3000 + 11 * 10);
+    datamgr_is_duplicate(&resent);
+    datamgr_snapshot_t saved[2], next[2];
+    datamgr_get_snapshot(15, &saved[0]);
+    datamgr_get_snapshot(21, &saved[1]);
+    check(saved[0].alarm != 0 && saved[1].alarm != 0 && saved[0].duplicates == 1,
+          "the readings before the checkpoint should raise alarms and count a duplicate");
+    check(datamgr_checkpoint(path) == DATAMGR_SUCCESS, "datamgr_checkpoint");
+
+    // What the next reading does to the state that was saved
+    sensor_data_t after = reading(15, 10, 4000);
+    datamgr_process_data(&after);
+    datamgr_get_snapshot(15, &next[0]);
+
+    // Restart with sensor 37 gone and 49 new
+    sensor_id_t restarted[] = {15, 21, 49};
+    load_map(restarted, 3);
+    check(datamgr_restore_checkpoint(path) == DATAMGR_SUCCESS, "datamgr_restore_checkpoint");
+    datamgr_snapshot_t restored;
+    check(datamgr_get_snapshot(15, &restored) == DATAMGR_SUCCESS && same_snapshot(&restored, &saved[0]),
+          "sensor 15 does not have the state it had at the checkpoint");
+    check(datamgr_get_snapshot(21, &restored) == DATAMGR_SUCCESS && same_snapshot(&restored, &saved[1]),
+          "sensor 21 does not have the state it had at the checkpoint");
+    check(datamgr_get_snapshot(49, &restored) == DATAMGR_SUCCESS && restored.last_ts == 0 && restored.avg == 0,
+          "sensor 49 was not in the checkpoint and should start cold");
+    datamgr_process_data(&after);
+    check(datamgr_get_snapshot(15, &restored) == DATAMGR_SUCCESS && same_snapshot(&restored, &next[0]),
+          "the running average should carry on from the checkpoint");
+    check(datamgr_is_duplicate(&resent), "the duplicate filter should remember the readings of the checkpoint");
+
+    check_concurrent_checkpoints(path);
+
+    // A checkpoint with a flipped byte is not used
+    FILE *fp = fopen(path, "r+b");
+    if (fp == NULL || fseek(fp, -1, SEEK_END) != 0) exit(2);
+    int last = fgetc(fp);
+    fseek(fp, -1, SEEK_END);
+    fputc(last ^ 0x01, fp);
+    fclose(fp);
+    load_map(sensors, 3);
+    check(datamgr_restore_checkpoint(path) == DATAMGR_FAILURE, "a damaged checkpoint should be rejected");
+    check(datamgr_get_snapshot(15, &restored) == DATAMGR_SUCCESS && restored.last_ts == 0,
+          "a rejected checkpoint should leave the sensors cold");
+    unlink(path);
+    check(datamgr_restore_checkpoint(path) == DATAMGR_FAILURE, "a missing checkpoint should be a failure");
+}
+
+int main(void) {
+    load_map(sensors, 3);
+    check_filter();
+    check_buffer();
+    check_checkpoint();
+    datamgr_free();
+    printf("datamgr: %d checks failed\n", failures);
+    return failures != 0;
+}
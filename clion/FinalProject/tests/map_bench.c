@@ -0,0 +1,96 @@
+#define _POSIX_C_SOURCE 200809L
+#include "datamgr.h"
+#include "connmgr.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Memory and lookup time of a sensor map with a million 32 bit sensor ids
+
+#define MAP_SENSORS 1000000
+#define MAP_ROOMS 1000
+#define LOOKUPS 10000000
+
+#if SENSOR_ID_BITS != 32
+#error "build with -DSENSOR_ID_BITS=32"
+#endif
+
+void write_log(const char *message) {
+    fprintf(stderr, "%s\n", message);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static long rss_kb(void) {
+    FILE *fp = fopen("/proc/self/status", "r");
+    char line[256];
+    long kb = -1;
+    while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, "VmRSS:", 6) == 0) kb = strtol(line + 6, NULL, 10);
+    }
+    if (fp != NULL) fclose(fp);
+    return kb;
+}
+
+// Distinct ids spread over the whole 32 bit range, multiplying by an odd number is a bijection
+static sensor_id_t sensor_at(uint32_t i) {
+    return (sensor_id_t)((i + 1) * 2654435761u);
+}
+
+int main(void) {
+    FILE *map = tmpfile();
+    if (map == NULL) return 2;
+    for (uint32_t i = 0; i < MAP_SENSORS; i++) fprintf(map, "%u %" PRIsensor "\n", i % MAP_ROOMS + 1, sensor_at(i));
+    rewind(map);
+
+    datamgr_init();
+    long rss_before = rss_kb();
+    double start = now();
+    datamgr_parse_sensor_files(map, NULL);
+    double loaded = now();
+    long rss_after = rss_kb();
+    fclose(map);
+    printf("map of %d sensors loaded in %.0f ms, RSS +%ld MB, %ld bytes per sensor\n", MAP_SENSORS,
+           (loaded - start) * 1e3, (rss_after - rss_before) >> 10, (rss_after - rss_before) * 1024 / MAP_SENSORS);
+
+    // Lookups in a random order, so that most of them miss the caches as they would with many connections
+    uint32_t *order = malloc(LOOKUPS * sizeof(uint32_t));
+    if (order == NULL) return 2;
+    uint64_t x = 88172645463325252ULL;
+    for (int i = 0; i < LOOKUPS; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        order[i] = (uint32_t)(x % MAP_SENSORS);
+    }
+
+    datamgr_snapshot_t snapshot;
+    int found = 0;
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++) found += datamgr_get_snapshot(sensor_at(order[i]), &snapshot) == DATAMGR_SUCCESS;
+    double hits = now() - start;
+
+    int missing = 0;
+    start = now();
+    for (int i = 0; i < LOOKUPS; i++) {
+        missing += datamgr_get_snapshot(sensor_at(order[i] + MAP_SENSORS), &snapshot) != DATAMGR_SUCCESS;
+    }
+    double misses = now() - start;
+    printf("datamgr_get_snapshot: %.1f ns per sensor in the map, %.1f ns per unknown sensor\n",
+           hits * 1e9 / LOOKUPS, misses * 1e9 / LOOKUPS);
+
+    free(order);
+    datamgr_free();
+    if (found != LOOKUPS || missing != LOOKUPS) {
+        printf("FAILED: %d of %d sensors found, %d of %d unknown sensors missing\n", found, LOOKUPS, missing,
+               LOOKUPS);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,160 @@
+#define _POSIX_C_SOURCE 200809L
+#include "sbuffer.h"
+#include "connmgr.h"
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Readings through the packed records of the shared buffer, with a writer, a data manager and a storage manager
+// thread as in the gateway. Every field has to come out bit for bit as it went in. Returns 1 if any check fails.
+
+#define FLOW_READINGS 1000000
+#define BATCH 256
+
+static int failures = 0;
+static sensor_ts_t start;       // time() just before the buffers are created, their epoch is this or later
+
+void write_log(const char *message) {
+    (void)message;
+}
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static uint64_t next_random(uint64_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Any id, any double including NaN payloads and infinities, a timestamp up to 34 years away
+static sensor_data_t random_reading(uint64_t *state) {
+    sensor_data_t data = {.id = (sensor_id_t)(next_random(state) % ((uint64_t)SENSOR_ID_MAX + 1))};
+    uint64_t bits = next_random(state);
+    memcpy(&data.value, &bits, sizeof(data.value));
+    data.ts = start + (int64_t)(next_random(state) >> 33) - (1 << 30);
+    return data;
+}
+
+static bool same_reading(const sensor_data_t *a, const sensor_data_t *b) {
+    return a->id == b->id && memcmp(&a->value, &b->value, sizeof(a->value)) == 0 && a->ts == b->ts &&
+           b->room_id == 0;
+}
+
+static void check_edges(void) {
+    sbuffer_t *buffer;
+    if (sbuffer_init(&buffer) != SBUFFER_SUCCESS) exit(2);
+    sensor_ts_t now = time(NULL);
+    sensor_data_t data;
+    check(sbuffer_peek_unprocessed(buffer, &data) == SBUFFER_EMPTY && sbuffer_peek(buffer, &data) == SBUFFER_EMPTY,
+          "a new buffer should be empty");
+
+    // The offset to the epoch of the buffer has to fit 32 bits
+    sensor_data_t fits[] = {
+        {.id = SENSOR_ID_MAX, .room_id = 7, .value = -0.0, .ts = start + INT32_MAX},
+        {.id = 0, .value = 4.9406564584124654e-324, .ts = now + INT32_MIN},
+        {.id = 1, .value = 1.7976931348623157e308, .ts = now},
+    };
+    sensor_data_t too_far[] = {{.id = 2, .ts = now + INT32_MAX + 1LL}, {.id = 3, .ts = start + INT32_MIN - 1LL}};
+    for (int i = 0; i < 3; i++) check(sbuffer_insert(buffer, &fits[i]) == SBUFFER_SUCCESS, "a reading that fits");
+    for (int i = 0; i < 2; i++) {
+        check(sbuffer_insert(buffer, &too_far[i]) == SBUFFER_FAILURE, "a timestamp too far from the epoch");
+    }
+
+    check(sbuffer_peek(buffer, &data) == SBUFFER_NO_DATA, "storage should not see an unprocessed reading");
+    for (int i = 0; i < 3; i++) {
+        check(sbuffer_peek_unprocessed(buffer, &data) == SBUFFER_SUCCESS && same_reading(&fits[i], &data),
+              "an edge reading does not come out as it went in");
+        sbuffer_mark_processed(buffer);
+    }
+    check(sbuffer_peek_unprocessed(buffer, &data) == SBUFFER_EMPTY, "rejected readings should not be buffered");
+    sensor_data_t batch[BATCH];
+    size_t count;
+    check(sbuffer_remove_batch(buffer, batch, BATCH, &count) == SBUFFER_SUCCESS && count == 3 &&
+          same_reading(&fits[0], &batch[0]) && same_reading(&fits[2], &batch[2]),
+          "the batch does not hold the processed readings");
+    check(sbuffer_remove(buffer, &data) == SBUFFER_EMPTY, "the buffer should be empty after the batch");
+    sbuffer_free(&buffer);
+}
+
+typedef struct flow {
+    sbuffer_t *buffer;
+    unsigned int errors;        // readings the buffer refused, or that came out different
+} flow_t;
+
+static void *writer_thread(void *arg) {
+    flow_t *flow = arg;
+    uint64_t state = 88172645463325252ULL;
+    for (int i = 0; i < FLOW_READINGS; i++) {
+        sensor_data_t data = random_reading(&state);
+        if (sbuffer_insert(flow->buffer, &data) != SBUFFER_SUCCESS) flow->errors++;
+    }
+    return NULL;
+}
+
+// Marks the readings processed as the data manager does, it checks them too
+static void *processing_thread(void *arg) {
+    flow_t *flow = arg;
+    uint64_t state = 88172645463325252ULL;
+    for (int i = 0; i < FLOW_READINGS; i++) {
+        sensor_data_t data;
+        while (sbuffer_peek_unprocessed(flow->buffer, &data) != SBUFFER_SUCCESS) sched_yield();
+        sensor_data_t expected = random_reading(&state);
+        if (!same_reading(&expected, &data)) flow->errors++;
+        sbuffer_mark_processed(flow->buffer);
+    }
+    return NULL;
+}
+
+static void check_flow(void) {
+    flow_t writer = {0}, processing = {0};
+    if (sbuffer_init(&writer.buffer) != SBUFFER_SUCCESS) exit(2);
+    processing.buffer = writer.buffer;
+    pthread_t writer_tid, processing_tid;
+    pthread_create(&writer_tid, NULL, writer_thread, &writer);
+    pthread_create(&processing_tid, NULL, processing_thread, &processing);
+
+    uint64_t state = 88172645463325252ULL;
+    uint64_t removed = 0, differ = 0;
+    sensor_data_t batch[BATCH];
+    while (removed < FLOW_READINGS) {
+        size_t count;
+        if (sbuffer_remove_batch(writer.buffer, batch, BATCH, &count) != SBUFFER_SUCCESS) {
+            sched_yield();
+            continue;
+        }
+        for (size_t i = 0; i < count; i++) {
+            sensor_data_t expected = random_reading(&state);
+            if (!same_reading(&expected, &batch[i]) && differ++ < 5) {
+                printf("MISMATCH at %" PRIu64 ": id %" PRIsensor " ts %ld instead of id %" PRIsensor " ts %ld\n",
+                       removed + i, batch[i].id, (long)batch[i].ts, expected.id, (long)expected.ts);
+            }
+        }
+        removed += count;
+    }
+    pthread_join(writer_tid, NULL);
+    pthread_join(processing_tid, NULL);
+    printf("sbuffer: %" PRIu64 " readings through 3 threads, %" PRIu64 " differ after storage, %u after processing\n",
+           removed, differ, processing.errors);
+    check(differ == 0 && processing.errors == 0 && writer.errors == 0,
+          "readings should come out of the buffer in order and unchanged");
+    sbuffer_free(&writer.buffer);
+}
+
+int main(void) {
+    start = time(NULL);
+    check_edges();
+    check_flow();
+    printf("sbuffer: %d checks failed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,122 @@
+#define _POSIX_C_SOURCE 200809L
+#include "segstore.h"
+#include "colstore.h"
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Late readings in the segment store: a steady stream of small blocks for periods that are older than every open
+// segment, more blocks per period than it has names for. Every block has to be written, each late period has to
+// end up in one segment and every reading has to be read back from its period. Returns 1 if any check fails.
+
+#define LATE_PERIODS 3          // interleaved, within SEGSTORE_LATE_SEGMENTS
+#define LATE_BLOCKS (LATE_PERIODS * (SEGMENT_SECONDS + 100))
+#define BLOCK_READINGS 4
+#define NOW ((sensor_ts_t)1800000000 / SEGMENT_SECONDS * SEGMENT_SECONDS)
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+static sensor_ts_t late_period(int p) {
+    return NOW - (p + 2 + SEGSTORE_OPEN_SEGMENTS) * (sensor_ts_t)SEGMENT_SECONDS;
+}
+
+// Readings of 'period' that differ for every block
+static void fill_block(sensor_data_t *block, sensor_ts_t period, int number) {
+    for (int i = 0; i < BLOCK_READINGS; i++) {
+        block[i] = (sensor_data_t){.id = (sensor_id_t)(1 + i), .value = number + i / 10.0,
+                                   .ts = period + (number * BLOCK_READINGS + i) % SEGMENT_SECONDS};
+    }
+}
+
+// Read every block of the segment at 'path' back, counting its readings and those outside its period
+static void read_segment(const char *path, uint64_t *readings, uint64_t *misplaced) {
+    segstore_index_entry_t *entries;
+    size_t count;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL || segstore_load_index(path, &entries, &count) != SEGSTORE_SUCCESS) {
+        check(false, "a segment cannot be read");
+        if (fp != NULL) fclose(fp);
+        return;
+    }
+    sensor_ts_t period = segstore_segment_period(path);
+    for (size_t i = 0; i < count; i++) {
+        uint8_t *block = malloc(entries[i].size);
+        sensor_data_t *data = malloc(entries[i].count * sizeof(sensor_data_t));
+        if (block == NULL || data == NULL) exit(2);
+        if (fseek(fp, (long)entries[i].offset, SEEK_SET) != 0 || fread(block, entries[i].size, 1, fp) != 1 ||
+            colstore_decode(block, data) != COLSTORE_SUCCESS) {
+            check(false, "a block cannot be decoded");
+        } else {
+            for (uint32_t r = 0; r < entries[i].count; r++) {
+                if (data[r].ts < period || data[r].ts >= period + SEGMENT_SECONDS) (*misplaced)++;
+            }
+            *readings += entries[i].count;
+        }
+        free(block);
+        free(data);
+    }
+    free(entries);
+    fclose(fp);
+}
+
+int main(void) {
+    char dir[] = "/tmp/segstore_check.XXXXXX";
+    if (mkdtemp(dir) == NULL) exit(2);
+    segstore_options_t options = {.dir = dir};
+    segstore_t *store = segstore_open(&options);
+    if (store == NULL) exit(2);
+
+    // The current periods take the open segments
+    sensor_data_t block[BLOCK_READINGS];
+    uint64_t written = 0, failed = 0;
+    for (int p = SEGSTORE_OPEN_SEGMENTS - 1; p >= 0; p--) {
+        fill_block(block, NOW - p * (sensor_ts_t)SEGMENT_SECONDS, 0);
+        failed += segstore_write(store, block, BLOCK_READINGS) != SEGSTORE_SUCCESS;
+        written += BLOCK_READINGS;
+    }
+
+    // A late block at a time, as a gateway gets them from a site that comes back online
+    for (int b = 0; b < LATE_BLOCKS; b++) {
+        fill_block(block, late_period(b % LATE_PERIODS), b);
+        failed += segstore_write(store, block, BLOCK_READINGS) != SEGSTORE_SUCCESS;
+        written += BLOCK_READINGS;
+    }
+    check(segstore_sync(store) == SEGSTORE_SUCCESS, "segstore_sync");
+    segstore_close(&store);
+
+    char **paths;
+    size_t count;
+    uint64_t read = 0, misplaced = 0;
+    size_t late_segments = 0;
+    if (segstore_list(dir, &paths, &count) != SEGSTORE_SUCCESS) exit(2);
+    for (size_t i = 0; i < count; i++) {
+        read_segment(paths[i], &read, &misplaced);
+        late_segments += segstore_segment_period(paths[i]) <= late_period(0);
+        char *idx = strdup(paths[i]);
+        if (idx == NULL) exit(2);
+        memcpy(idx + strlen(idx) - 4, ".idx", 4);
+        unlink(idx);
+        unlink(paths[i]);
+        free(idx);
+    }
+    segstore_free_list(paths, count);
+    rmdir(dir);
+
+    printf("segstore: %d late blocks over %d periods, %" PRIu64 " writes failed, %zu segments, %zu of them late, "
+           "%" PRIu64 " of %" PRIu64 " readings read back, %" PRIu64 " in the wrong period\n",
+           LATE_BLOCKS, LATE_PERIODS, failed, count, late_segments, read, written, misplaced);
+    check(failed == 0, "every late block should be written");
+    check(late_segments == LATE_PERIODS, "every late period should have one segment");
+    check(read == written && misplaced == 0, "every reading should be read back from its period");
+    printf("segstore: %d checks failed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,139 @@
+# The write-ahead log of sensor_gateway against a crash, run from the project folder by 'make check'
+# The gateway is killed with readings that were accepted but not stored, the next start has to store them.
+# The first run is killed before it logs anything, so the run after it reuses the name of its empty WAL file.
+# tests/sensor_gateway marks what it stored every WAL_APPLY_MS (2 s). A reading of a crashed run is in data.csv
+# already or replayed by the next start, after the restart every one of them has to be in data.csv.
+here=$(pwd)
+work=$(mktemp -d /tmp/wal_check.XXXXXX)
+port=$((20000 + $$ % 20000))
+export LD_LIBRARY_PATH=$here/lib
+cd $work || exit 1
+
+fail() {
+    echo -e "FAILED: $1"
+    kill -9 $GATEWAY_PID 2>/dev/null
+    cd $here && rm -rf $work
+    exit 1
+}
+
+# Wait until the gateway listens on the port, connecting would take one of its clients
+wait_for_gateway() {
+    local listen=$(printf ":%04X 00000000:0000 0A" $port)
+    for i in $(seq 100); do
+        grep -q "$listen" /proc/net/tcp && return 0
+        kill -0 $GATEWAY_PID 2>/dev/null || fail "the gateway stopped"
+        sleep 0.1
+    done
+    fail "the gateway does not listen on port $port"
+}
+
+# A gateway for one client stops cleanly once that client hung up
+stop_gateway() {
+    exec 3<>/dev/tcp/127.0.0.1/$port && exec 3>&-
+    wait $GATEWAY_PID || fail "the gateway did not stop cleanly"
+}
+
+# Kill the gateway the hard way, then wait for its logger process, which would write to the next gateway.log
+crash_gateway() {
+    local logger=$(pgrep -P $GATEWAY_PID)
+    kill -9 $GATEWAY_PID
+    wait $GATEWAY_PID 2>/dev/null
+    while [ -n "$logger" ] && kill -0 $logger 2>/dev/null; do sleep 0.1; done
+}
+
+# Send a file of readings, one connection per sensor
+send() {
+    local count=$($here/tests/sensor_replay -x 0 $@ 127.0.0.1 $port | sed -n 's/^Replayed \([0-9]*\) readings.*/\1/p')
+    [ -n "$count" ] && [ "$count" -gt 0 ] || fail "sensor_replay did not send $*"
+    total=$((total + count))
+}
+
+# Readings in data.csv and how many of them differ, its header is only written with the first flush
+readings() {
+    cat data.csv 2>/dev/null | grep -vc "^SensorID"
+}
+distinct() {
+    cat data.csv 2>/dev/null | grep -v "^SensorID" | sort -u | wc -l
+}
+
+# The last reading the WAL counts as stored
+applied() {
+    cat wal/applied 2>/dev/null || echo 0
+}
+
+# Restart after a crash, what was not in data.csv has to be replayed and then all 'total' readings are
+restart() {
+    local before=$(distinct)
+    $here/tests/sensor_gateway -w 10 $port 1 > /dev/null &
+    GATEWAY_PID=$!
+    wait_for_gateway
+    stop_gateway
+    local replayed=$(sed -n 's/.*WAL: Replayed \([0-9]*\) readings.*/\1/p' gateway.log)
+    [ -n "$replayed" ] && [ "$replayed" -ge $((total - before)) ] ||
+        fail "${replayed:-no} readings were replayed and $before of $total were in data.csv:\n$(grep WAL gateway.log)"
+    [ "$(distinct)" -eq $total ] || fail "$(distinct) of $total readings are in data.csv after the restart"
+    for id in $(cut -d' ' -f2 room_sensor.map); do
+        [ "$(grep "^$id," data.csv | sort -u | wc -l)" -eq $((total / sensors)) ] || fail "readings of sensor $id are missing"
+    done
+    echo -e "$before readings were in data.csv, $replayed were replayed"
+}
+
+# room_sensor.map and sensor_data, the same number of readings for every sensor
+$here/tests/file_creator > /dev/null
+sensors=$(grep -c . room_sensor.map)
+total=0
+
+echo -e "Starting the gateway with the WAL and killing it before the first reading"
+$here/tests/sensor_gateway -w 10 $port 1 > /dev/null &
+GATEWAY_PID=$!
+wait_for_gateway
+crash_gateway
+
+echo -e "Starting it again, sending sensor_data and killing it before the readings are stored"
+$here/tests/sensor_gateway -w 10 -n 1000000 -t 0 $port $((sensors + 1)) > /dev/null &
+GATEWAY_PID=$!
+wait_for_gateway
+send -t bin sensor_data
+sleep 0.5
+crash_gateway
+
+echo -e "Restarting it, the readings should be replayed and stored"
+restart
+
+# The same readings one and two days later, the duplicate filter lets them through
+awk -F, -v OFS=, '{ if (NR > 1) $3 += 86400; print }' data.csv > day2.csv
+awk -F, -v OFS=, '{ if (NR > 1) $3 += 2 * 86400; print }' data.csv > day3.csv
+
+echo -e "Sending readings, waiting until the WAL marks them as stored, sending more and killing it"
+first=$(applied) stored=$total
+$here/tests/sensor_gateway -w 10 -n 1000000 -t 0 $port $((2 * sensors + 2)) > /dev/null &
+GATEWAY_PID=$!
+wait_for_gateway
+# The gateway stops once every client hung up, one stays connected between the two files
+exec 4<>/dev/tcp/127.0.0.1/$port
+send -t csv day2.csv
+for i in $(seq 100); do
+    [ "$(applied)" -ge $((first + total - stored)) ] && break
+    [ $i -eq 100 ] && fail "the WAL did not mark the readings as stored within 10 s"
+    sleep 0.1
+done
+send -t csv day3.csv
+sleep 0.5
+crash_gateway
+# The gateway closed that connection first, its port stays taken for a while
+exec 4>&-
+port=$((port + 1))
+
+echo -e "Restarting it, data.csv should keep what was stored before the crash and get the rest"
+restart
+
+echo -e "Restarting it once more, nothing should be replayed and data.csv should keep the readings"
+$here/tests/sensor_gateway -w 10 $port 1 > /dev/null &
+GATEWAY_PID=$!
+wait_for_gateway
+stop_gateway
+grep -q "WAL: Replayed" gateway.log && fail "readings were replayed twice:\n$(grep WAL gateway.log)"
+[ "$(readings)" -eq $total ] || fail "$(readings) of $total readings are left in data.csv"
+
+echo -e "WAL check passed: $total readings survived two crashes"
+cd $here && rm -rf $work
@@ -0,0 +1,420 @@
+#define _POSIX_C_SOURCE 200809L
+#include "wal.h"
+#include "colstore.h"
+#include "connmgr.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define WAL_APPLIED_FILE "applied"
+#define WAL_PATH_MAX 512
+
+_Static_assert(sizeof(wal_record_t) == 32, "WAL records should take 32 bytes");
+
+static char *wal_dir = NULL;
+static unsigned int sync_interval_ms = WAL_SYNC_MS;
+
+// Appended records wait here for the WAL thread, which swaps the two arrays and writes the full one
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_cond = PTHREAD_COND_INITIALIZER;
+static wal_record_t *pending = NULL;
+static size_t pending_count = 0;
+static size_t pending_capacity = 0;
+static wal_record_t *writing = NULL;
+static size_t writing_capacity = 0;
+static uint64_t next_lsn = 1;           // of the next appended reading
+static uint64_t base_lsn = 0;           // of the last reading before this run
+static uint64_t handled_lsn = 0;        // synced to the WAL, or failed to
+static uint64_t lost = 0;               // readings that could not be buffered
+static bool sync_requested = false;
+static bool stopping = false;
+static pthread_t wal_thread;
+static bool running = false;
+
+// WAL files by their first LSN, oldest first; the last one is being written
+static uint64_t *files = NULL;
+static size_t file_count = 0;
+static int wal_fd = -1;
+static uint64_t wal_file_bytes = 0;
+
+// Files of earlier runs, until wal_replay() is done with them
+static uint64_t *old_files = NULL;
+static size_t old_file_count = 0;
+static uint64_t applied_lsn = 0;
+
+static void file_path(char *path, size_t size, uint64_t first_lsn) {
+    snprintf(path, size, "%s/wal-%020" PRIu64 ".log", wal_dir, first_lsn);
+}
+
+static uint32_t record_checksum(const wal_record_t *record) {
+    return colstore_crc32(0, record, offsetof(wal_record_t, checksum));
+}
+
+static void sync_dir(void) {
+    int fd = open(wal_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+static int read_applied(uint64_t *lsn) {
+    char path[WAL_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" WAL_APPLIED_FILE, wal_dir);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) return errno == ENOENT ? WAL_SUCCESS : WAL_FAILURE;
+    int result = fscanf(f, "%" SCNu64, lsn) == 1 ? WAL_SUCCESS : WAL_FAILURE;
+    fclose(f);
+    return result;
+}
+
+static int write_applied(uint64_t lsn) {
+    char path[WAL_PATH_MAX], tmp[WAL_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/" WAL_APPLIED_FILE, wal_dir);
+    snprintf(tmp, sizeof(tmp), "%s/" WAL_APPLIED_FILE ".tmp", wal_dir);
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) return WAL_FAILURE;
+    bool ok = fprintf(f, "%" PRIu64 "\n", lsn) > 0 && fflush(f) == 0 && fdatasync(fileno(f)) == 0;
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp, path) == -1) {
+        unlink(tmp);
+        return WAL_FAILURE;
+    }
+    sync_dir();
+    return WAL_SUCCESS;
+}
+
+// Walk the valid records of a WAL file, a torn or corrupt record ends it
+static int scan_file(uint64_t first_lsn, wal_replay_t replay, void *arg, uint64_t *last_lsn, size_t *count) {
+    char path[WAL_PATH_MAX];
+    file_path(path, sizeof(path), first_lsn);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) return WAL_FAILURE;
+
+    wal_record_t records[256];
+    size_t n;
+    bool valid = true;
+    while (valid && (n = fread(records, sizeof(wal_record_t), 256, f)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            if (records[i].checksum != record_checksum(&records[i]) || records[i].lsn <= *last_lsn) {
+                valid = false;
+                break;
+            }
+            *last_lsn = records[i].lsn;
+            if (replay != NULL && records[i].lsn > applied_lsn) {
+                sensor_data_t data = {.id = (sensor_id_t)records[i].id, .value = records[i].value, .ts = records[i].ts};
+                replay(&data, arg);
+                (*count)++;
+            }
+        }
+    }
+    fclose(f);
+    return WAL_SUCCESS;
+}
+
+static int compare_lsn(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int list_files(void) {
+    DIR *dir = opendir(wal_dir);
+    if (dir == NULL) return WAL_FAILURE;
+    size_t capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        uint64_t lsn;
+        int end = 0;
+        if (sscanf(entry->d_name, "wal-%" SCNu64 ".log%n", &lsn, &end) != 1 || entry->d_name[end] != '\0') continue;
+        if (old_file_count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            uint64_t *grown = realloc(old_files, capacity * sizeof(uint64_t));
+            if (grown == NULL) {
+                closedir(dir);
+                return WAL_FAILURE;
+            }
+            old_files = grown;
+        }
+        old_files[old_file_count++] = lsn;
+    }
+    closedir(dir);
+    if (old_file_count > 1) qsort(old_files, old_file_count, sizeof(uint64_t), compare_lsn);
+    return WAL_SUCCESS;
+}
+
+// Start the WAL file whose first record will be 'first_lsn', the lock is held
+static int start_file(uint64_t first_lsn) {
+    uint64_t *grown = realloc(files, (file_count + 1) * sizeof(uint64_t));
+    if (grown == NULL) return WAL_FAILURE;
+    files = grown;
+
+    char path[WAL_PATH_MAX];
+    file_path(path, sizeof(path), first_lsn);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) return WAL_FAILURE;
+    if (wal_fd != -1) close(wal_fd);
+    wal_fd = fd;
+    wal_file_bytes = 0;
+    files[file_count++] = first_lsn;
+    sync_dir();
+    return WAL_SUCCESS;
+}
+
+static int write_all(int fd, const void *data, size_t size) {
+    const char *p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return WAL_FAILURE;
+        p += n;
+        size -= n;
+    }
+    return WAL_SUCCESS;
+}
+
+// Group commit: every interval, or sooner when asked, write and sync everything appended so far
+static void *wal_thread_main(void *arg) {
+    pthread_mutex_lock(&wal_lock);
+    while (true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += sync_interval_ms / 1000;
+        deadline.tv_nsec += (long)(sync_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!stopping && !sync_requested &&
+               pthread_cond_timedwait(&wal_cond, &wal_lock, &deadline) != ETIMEDOUT) {
+        }
+        bool stop = stopping;
+        sync_requested = false;
+
+        // Swap the arrays, connection threads keep appending to the other one while this one is written
+        wal_record_t *records = pending;
+        size_t count = pending_count;
+        size_t capacity = pending_capacity;
+        uint64_t through = next_lsn - 1;
+        pending = writing;
+        pending_capacity = writing_capacity;
+        pending_count = 0;
+        writing = records;
+        writing_capacity = capacity;
+        pthread_mutex_unlock(&wal_lock);
+
+        int result = WAL_SUCCESS;
+        if (count > 0) {
+            result = write_all(wal_fd, records, count * sizeof(wal_record_t));
+            if (result == WAL_SUCCESS && fdatasync(wal_fd) == -1) result = WAL_FAILURE;
+            if (result != WAL_SUCCESS) write_log("WAL: Failed to write readings, they are not crash safe.");
+        }
+
+        pthread_mutex_lock(&wal_lock);
+        // Also moves on after a failure, nothing would ever make those readings durable
+        handled_lsn = through;
+        if (count > 0) {
+            wal_file_bytes += count * sizeof(wal_record_t);
+            if (wal_file_bytes >= WAL_FILE_BYTES && start_file(records[count - 1].lsn + 1) != WAL_SUCCESS) {
+                write_log("WAL: Failed to start a new file, the current one keeps growing.");
+            }
+        }
+        pthread_cond_broadcast(&wal_cond);
+        if (stop && pending_count == 0) break;
+    }
+    pthread_mutex_unlock(&wal_lock);
+    return NULL;
+}
+
+bool wal_exists(const char *dir) {
+    DIR *d = opendir(dir);
+    if (d == NULL) return false;
+    bool found = false;
+    struct dirent *entry;
+    while (!found && (entry = readdir(d)) != NULL) {
+        found = strncmp(entry->d_name, "wal-", 4) == 0 || strcmp(entry->d_name, WAL_APPLIED_FILE) == 0;
+    }
+    closedir(d);
+    return found;
+}
+
+int wal_open(const char *dir, unsigned int sync_ms) {
+    if (running || dir == NULL) return WAL_FAILURE;
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        write_log("WAL: Failed to create its directory.");
+        return WAL_FAILURE;
+    }
+    wal_dir = strdup(dir);
+    if (wal_dir == NULL) return WAL_FAILURE;
+    sync_interval_ms = sync_ms;
+
+    // Numbering continues after the last record of the previous run
+    uint64_t last_lsn = 0;
+    if (read_applied(&applied_lsn) != WAL_SUCCESS || list_files() != WAL_SUCCESS) {
+        write_log("WAL: Failed to read the files of the previous run.");
+        return WAL_FAILURE;
+    }
+    last_lsn = applied_lsn;
+    for (size_t i = 0; i < old_file_count; i++) {
+        size_t unused = 0;
+        if (old_files[i] > last_lsn) last_lsn = old_files[i] - 1;
+        scan_file(old_files[i], NULL, NULL, &last_lsn, &unused);
+    }
+    base_lsn = handled_lsn = last_lsn;
+    next_lsn = last_lsn + 1;
+    // A last file without records has the name of the new one, it is truncated and reused, not replayed or deleted
+    while (old_file_count > 0 && old_files[old_file_count - 1] >= next_lsn) old_file_count--;
+
+    pthread_mutex_lock(&wal_lock);
+    int result = start_file(next_lsn);
+    pthread_mutex_unlock(&wal_lock);
+    if (result != WAL_SUCCESS || pthread_create(&wal_thread, NULL, wal_thread_main, NULL) != 0) {
+        write_log("WAL: Failed to start.");
+        return WAL_FAILURE;
+    }
+    running = true;
+    return WAL_SUCCESS;
+}
+
+// Wait until everything appended so far is synced
+static void wal_sync(void) {
+    pthread_mutex_lock(&wal_lock);
+    uint64_t target = next_lsn - 1;
+    sync_requested = true;
+    pthread_cond_broadcast(&wal_cond);
+    while (handled_lsn < target && running) pthread_cond_wait(&wal_cond, &wal_lock);
+    pthread_mutex_unlock(&wal_lock);
+}
+
+int wal_replay(wal_replay_t replay, void *arg, size_t *count) {
+    *count = 0;
+    if (!running) return WAL_FAILURE;
+
+    uint64_t last_lsn = 0;
+    for (size_t i = 0; i < old_file_count; i++) {
+        if (last_lsn < old_files[i]) last_lsn = old_files[i] - 1;
+        scan_file(old_files[i], replay, arg, &last_lsn, count);
+    }
+
+    // The replayed readings are in the new file now, the old ones can go once that is on disk
+    wal_sync();
+    char path[WAL_PATH_MAX];
+    for (size_t i = 0; i < old_file_count; i++) {
+        file_path(path, sizeof(path), old_files[i]);
+        unlink(path);
+    }
+    sync_dir();
+    free(old_files);
+    old_files = NULL;
+    old_file_count = 0;
+
+    if (*count > 0) {
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "WAL: Replayed %zu readings that were not stored by the previous run", *count);
+        write_log(log_msg);
+    }
+    return WAL_SUCCESS;
+}
+
+void wal_append(const sensor_data_t *data) {
+    pthread_mutex_lock(&wal_lock);
+    if (!running) {
+        pthread_mutex_unlock(&wal_lock);
+        return;
+    }
+    if (pending_count == pending_capacity) {
+        size_t capacity = pending_capacity ? pending_capacity * 2 : 1024;
+        wal_record_t *grown = realloc(pending, capacity * sizeof(wal_record_t));
+        if (grown == NULL) {
+            // The reading is still stored, it just would not survive a crash
+            lost++;
+            next_lsn++;
+            pthread_mutex_unlock(&wal_lock);
+            return;
+        }
+        pending = grown;
+        pending_capacity = capacity;
+    }
+    wal_record_t *record = &pending[pending_count++];
+    *record = (wal_record_t){.lsn = next_lsn++, .ts = data->ts, .value = data->value, .id = data->id};
+    record->checksum = record_checksum(record);
+    pthread_mutex_unlock(&wal_lock);
+}
+
+int wal_applied(uint64_t count) {
+    if (!running) return WAL_FAILURE;
+    uint64_t lsn = base_lsn + count;
+    if (lsn <= applied_lsn) return WAL_SUCCESS;
+    if (write_applied(lsn) != WAL_SUCCESS) {
+        write_log("WAL: Failed to record which readings are stored.");
+        return WAL_FAILURE;
+    }
+    applied_lsn = lsn;
+
+    // A file whose successor starts at or before the next unapplied reading holds only applied readings
+    char path[WAL_PATH_MAX];
+    pthread_mutex_lock(&wal_lock);
+    size_t drop = 0;
+    while (drop + 1 < file_count && files[drop + 1] <= applied_lsn + 1) {
+        file_path(path, sizeof(path), files[drop++]);
+        unlink(path);
+    }
+    memmove(files, files + drop, (file_count - drop) * sizeof(uint64_t));
+    file_count -= drop;
+    pthread_mutex_unlock(&wal_lock);
+    return WAL_SUCCESS;
+}
+
+void wal_close(void) {
+    if (!running) return;
+    pthread_mutex_lock(&wal_lock);
+    stopping = true;
+    pthread_cond_broadcast(&wal_cond);
+    pthread_mutex_unlock(&wal_lock);
+    pthread_join(wal_thread, NULL);
+
+    pthread_mutex_lock(&wal_lock);
+    running = false;
+    pthread_mutex_unlock(&wal_lock);
+    close(wal_fd);
+    wal_fd = -1;
+
+    // Everything is stored, the next run starts with an empty log
+    char path[WAL_PATH_MAX];
+    if (applied_lsn >= next_lsn - 1) {
+        for (size_t i = 0; i < file_count; i++) {
+            file_path(path, sizeof(path), files[i]);
+            unlink(path);
+        }
+        sync_dir();
+    } else {
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "WAL: %" PRIu64 " readings are not marked as stored, they are replayed on the next start",
+                 next_lsn - 1 - applied_lsn);
+        write_log(log_msg);
+    }
+    if (lost > 0) {
+        char log_msg[128];
+        snprintf(log_msg, sizeof(log_msg), "WAL: %" PRIu64 " readings could not be logged", lost);
+        write_log(log_msg);
+    }
+
+    free(files);
+    free(pending);
+    free(writing);
+    free(wal_dir);
+    files = NULL;
+    file_count = 0;
+    pending = writing = NULL;
+    pending_count = pending_capacity = writing_capacity = 0;
+    wal_dir = NULL;
+    stopping = false;
+}
@@ -0,0 +1,56 @@
+#ifndef _WAL_H_
+#define _WAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "config.h"
+
+#define WAL_SUCCESS 0
+#define WAL_FAILURE -1
+
+// Default group commit interval, readings accepted in the last interval are lost when the gateway crashes
+#ifndef WAL_SYNC_MS
+#define WAL_SYNC_MS 100
+#endif
+
+// A WAL file is closed and a new one started once it grows past this, whole files are dropped once applied
+#ifndef WAL_FILE_BYTES
+#define WAL_FILE_BYTES (4 << 20)
+#endif
+
+// A WAL file is a sequence of these, numbered by a log sequence number that keeps counting across runs
+typedef struct wal_record {
+    uint64_t lsn;
+    int64_t ts;
+    double value;
+    uint32_t id;
+    uint32_t checksum;          // CRC-32 of the fields before it
+} wal_record_t;
+
+// Receives the readings that wal_replay() finds
+typedef void (*wal_replay_t)(const sensor_data_t *data, void *arg);
+
+// True if 'dir' holds WAL files of an earlier run, the readings in storage are part of what they record
+bool wal_exists(const char *dir);
+
+// Open the write-ahead log in 'dir', appended readings are written and fdatasync'ed every 'sync_ms'
+// The files left by earlier runs are kept until wal_replay() has handed their readings on.
+int wal_open(const char *dir, unsigned int sync_ms);
+
+// Hand every reading of earlier runs that was not marked as applied to 'replay', oldest first
+// Call it before any reading is appended. The old files are deleted once the replayed readings have been
+// appended again and synced. '*count' is set to the number of readings replayed.
+int wal_replay(wal_replay_t replay, void *arg, size_t *count);
+
+// Log an accepted reading, meant as the insert hook of the shared buffer (see sbuffer.h)
+void wal_append(const sensor_data_t *data);
+
+// The first 'count' readings appended in this run are durable in storage
+// Records the position and deletes the WAL files that only hold applied readings.
+int wal_applied(uint64_t count);
+
+// Write and sync what is left, then close the log. Files with readings that were not applied are kept.
+void wal_close(void);
+
+#endif /* _WAL_H_ */